@@ -0,0 +1,664 @@
+/*
+	libtfs benchmarks on synthetic archives
+
+	tfs-bench [-d dir] [-f] [suite...]
+		-d  where archives and extracted trees go, default /tmp
+		-f  full sizes: up to 1M entries and a member past 2 GiB
+		suites: init open read threads cache batch aio mounts, all when none given
+
+	output is tab separated. a line "# suite<TAB>column..." names the
+	columns of the rows after it and every row starts with its suite, so
+	runs can be diffed or loaded as is. latencies are ns, throughput MiB/s
+*/
+
+#define TFS_NO_OVERRIDE
+#include "tfs.h"
+#include "ctar.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "malloc.h"
+#include "pthread.h"
+#include "unistd.h"
+#include "sys/stat.h"
+
+static const char* bench_dir = "/tmp";
+static int bench_full = 0;
+
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* bytes currently allocated, heap and mmap'd chunks alike */
+static size_t heap_used(void){
+	struct mallinfo2 mi = mallinfo2();
+	return mi.uordblks + mi.hblkhd;
+}
+
+static int cmp_double(const void* a, const void* b){
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y? -1: x > y;
+}
+
+struct lat {
+	double p50;
+	double p90;
+	double p99;
+	double max;
+};
+
+/* sorts samples */
+static struct lat percentiles(double* samples, size_t n){
+	if(!n) return (struct lat){};
+	qsort(samples, n, sizeof(*samples), cmp_double);
+	return (struct lat){ samples[n / 2], samples[n * 9 / 10], samples[n * 99 / 100], samples[n - 1] };
+}
+
+static const char* bench_path(const char* name){
+	static char path[4][512];
+	static int next = 0;
+	char* p = path[next++ % 4];
+	snprintf(p, sizeof(*path), "%s/%s", bench_dir, name);
+	return p;
+}
+
+static void put_header(FILE* fp, const char* name, uint64_t size){
+	char block[512] = {};
+	snprintf(block, 100, "%s", name);
+	memcpy(block + 100, "0000644", 8);
+	memcpy(block + 108, "0000000", 8);
+	memcpy(block + 116, "0000000", 8);
+	if(size < 077777777777ull) snprintf(block + 124, 12, "%011llo", (unsigned long long) size);
+	else{
+		/* base-256 past 8 GiB */
+		block[124] = (char) 0x80;
+		for(int i = 0; i < 8; ++i) block[135 - i] = (char) (size >> (8 * i));
+	}
+	memcpy(block + 136, "00000000000", 12);
+	block[156] = '0';
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	memset(block + 148, ' ', 8);
+	unsigned int sum = 0;
+	for(int i = 0; i < 512; ++i) sum += (unsigned char) block[i];
+	snprintf(block + 148, 8, "%06o", sum);
+	fwrite(block, 512, 1, fp);
+}
+
+/* size bytes of a fixed pattern, padded to whole blocks inside a tar */
+static void put_data(FILE* fp, uint64_t size, int pad){
+	static char chunk[1 << 20];
+	if(!chunk[1]) for(size_t i = 0; i < sizeof(chunk); ++i) chunk[i] = (char) (i * 131);
+	uint64_t total = pad? (size + 511) / 512 * 512: size;
+	for(uint64_t off = 0; off < total; ){
+		size_t n = total - off < sizeof(chunk)? total - off: sizeof(chunk);
+		fwrite(chunk, n, 1, fp);
+		off += n;
+	}
+}
+
+static void put_trailer(FILE* fp){
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+}
+
+/* n members of size bytes each named m<i> */
+static int make_tar_sized(const char* path, int n, uint64_t size){
+	FILE* fp = fopen(path, "wb");
+	if(!fp) return -1;
+	char name[100];
+	for(int i = 0; i < n; ++i){
+		snprintf(name, sizeof(name), "m%d", i);
+		put_header(fp, name, size);
+		put_data(fp, size, 1);
+	}
+	put_trailer(fp);
+	return fclose(fp);
+}
+
+/* the same members extracted into dir, the plain fopen baseline */
+static int make_tree_sized(const char* dir, int n, uint64_t size){
+	char name[600];
+	mkdir(dir, 0755);
+	for(int i = 0; i < n; ++i){
+		snprintf(name, sizeof(name), "%s/m%d", dir, i);
+		FILE* fp = fopen(name, "wb");
+		if(!fp) return -1;
+		put_data(fp, size, 0);
+		fclose(fp);
+	}
+	return 0;
+}
+
+static void remove_tree_sized(const char* dir, int n){
+	char name[600];
+	for(int i = 0; i < n; ++i){
+		snprintf(name, sizeof(name), "%s/m%d", dir, i);
+		remove(name);
+	}
+	rmdir(dir);
+}
+
+#define ENTRY_NAME "d%d/f%d.bin"
+#define ENTRY_ARGS(i) (i) / 1000, (i)
+
+/* n members of 16 bytes each named d<i/1000>/f<i>.bin */
+static int make_tar(const char* path, int n){
+	FILE* fp = fopen(path, "wb");
+	if(!fp) return -1;
+	char name[100], data[512] = "0123456789abcdef";
+	for(int i = 0; i < n; ++i){
+		snprintf(name, sizeof(name), ENTRY_NAME, ENTRY_ARGS(i));
+		put_header(fp, name, 16);
+		fwrite(data, 512, 1, fp);
+	}
+	put_trailer(fp);
+	return fclose(fp);
+}
+
+static int make_tree(const char* dir, int n){
+	char name[600];
+	mkdir(dir, 0755);
+	for(int i = 0; i < n; ++i){
+		if(i % 1000 == 0){
+			snprintf(name, sizeof(name), "%s/d%d", dir, i / 1000);
+			mkdir(name, 0755);
+		}
+		snprintf(name, sizeof(name), "%s/" ENTRY_NAME, dir, ENTRY_ARGS(i));
+		FILE* fp = fopen(name, "wb");
+		if(!fp) return -1;
+		fwrite("0123456789abcdef", 16, 1, fp);
+		fclose(fp);
+	}
+	return 0;
+}
+
+static void remove_tree(const char* dir, int n){
+	char name[600];
+	for(int i = 0; i < n; ++i){
+		snprintf(name, sizeof(name), "%s/" ENTRY_NAME, dir, ENTRY_ARGS(i));
+		remove(name);
+		if(i % 1000 == 999 || i == n - 1){
+			snprintf(name, sizeof(name), "%s/d%d", dir, i / 1000);
+			rmdir(name);
+		}
+	}
+	rmdir(dir);
+}
+
+static void print_lat(const char* suite, int n, const char* impl, double* samples, size_t count){
+	struct lat l = percentiles(samples, count);
+	printf("%s\t%d\t%s\t%.0f\t%.0f\t%.0f\t%.0f\n", suite, n, impl, l.p50, l.p90, l.p99, l.max);
+}
+
+static const int entry_counts[] = { 1000, 10000, 100000, 1000000 };
+#define ENTRY_COUNTS (bench_full? 4: 3)
+
+
+/* init: building the index against ctar_read, and mounting from the saved sidecar */
+
+static void bench_init(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	printf("# init\tentries\tctar_read_us\tscan_us\tsidecar_us\tctar_bytes_per_entry\ttfs_bytes_per_entry\n");
+	for(int k = 0; k < ENTRY_COUNTS; ++k){
+		int n = entry_counts[k];
+		if(make_tar(tar, n) != 0) return;
+		FILE* fp = fopen(tar, "rb");
+		struct ctar_t* list = NULL;
+		size_t heap0 = heap_used();
+		double t0 = now_ns();
+		ctar_read(fp, &list, 0);
+		double ctar_us = (now_ns() - t0) / 1e3;
+		double ctar_bytes = (double) (heap_used() - heap0) / n;
+		ctar_free(list);
+		fclose(fp);
+
+		heap0 = heap_used();
+		t0 = now_ns();
+		tfs_inittarfile_ex(tar, TFS_INIT_NOINDEX);
+		double scan_us = (now_ns() - t0) / 1e3;
+		double tfs_bytes = (double) (heap_used() - heap0) / n;
+		tfs_deinit();
+		tfs_writeindex(tar, NULL);
+		t0 = now_ns();
+		tfs_inittarfile(tar);
+		double index_us = (now_ns() - t0) / 1e3;
+		tfs_deinit();
+		char idx[600];
+		snprintf(idx, sizeof(idx), "%s" TFS_INDEX_SUFFIX, tar);
+		remove(idx);
+		printf("init\t%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", n, ctar_us, scan_us, index_us, ctar_bytes, tfs_bytes);
+	}
+	remove(tar);
+}
+
+
+/* open: hits and misses through the index, ctar_exists, and fopen on extracted files */
+
+static void bench_open(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const char* tree = bench_path("tfs_bench.d");
+	const int lookups = 20000;
+	double* samples = malloc(lookups * sizeof(*samples));
+	int* pick = malloc(lookups * sizeof(*pick));
+	char name[600];
+	printf("# open\tentries\timpl\tp50_ns\tp90_ns\tp99_ns\tmax_ns\n");
+	for(int k = 0; k < ENTRY_COUNTS; ++k){
+		int n = entry_counts[k];
+		if(make_tar(tar, n) != 0) break;
+		srand(n);
+		for(int i = 0; i < lookups; ++i) pick[i] = rand() % n;
+
+		/* linear, so only as many as stay in budget */
+		FILE* fp = fopen(tar, "rb");
+		struct ctar_t* list = NULL;
+		ctar_read(fp, &list, 0);
+		int count = (double) lookups * n > 2e8? 2e8 / n: lookups;
+		for(int i = 0; i < count; ++i){
+			snprintf(name, sizeof(name), ENTRY_NAME, ENTRY_ARGS(pick[i]));
+			double t0 = now_ns();
+			if(!ctar_exists(list, name, 0)) abort();
+			samples[i] = now_ns() - t0;
+		}
+		print_lat("open", n, "ctar_exists", samples, count);
+		ctar_free(list);
+		fclose(fp);
+
+		tfs_inittarfile(tar);
+		for(int miss = 0; miss < 2; ++miss){
+			for(int i = 0; i < lookups; ++i){
+				snprintf(name, sizeof(name), miss? "@/d%d/x%d.bin": "@/" ENTRY_NAME, ENTRY_ARGS(pick[i]));
+				double t0 = now_ns();
+				FILE* tfp = tfs_fopen(name, "rb");
+				if((tfp == NULL) != miss) abort();
+				if(tfp) tfs_fclose(tfp);
+				samples[i] = now_ns() - t0;
+			}
+			print_lat("open", n, miss? "tfs_miss": "tfs_hit", samples, lookups);
+		}
+		/* the path already resolved */
+		for(int i = 0; i < lookups; ++i){
+			snprintf(name, sizeof(name), "@/" ENTRY_NAME, ENTRY_ARGS(pick[i]));
+			tfs_entry_id id = tfs_lookup(name);
+			double t0 = now_ns();
+			FILE* tfp = tfs_open_entry(id);
+			if(!tfp) abort();
+			tfs_fclose(tfp);
+			samples[i] = now_ns() - t0;
+		}
+		print_lat("open", n, "tfs_id", samples, lookups);
+		tfs_deinit();
+
+		/* a million files is more than the baseline is worth */
+		if(n <= 100000 && make_tree(tree, n) == 0){
+			for(int miss = 0; miss < 2; ++miss){
+				for(int i = 0; i < lookups; ++i){
+					snprintf(name, sizeof(name), miss? "%s/d%d/x%d.bin": "%s/" ENTRY_NAME, tree, ENTRY_ARGS(pick[i]));
+					double t0 = now_ns();
+					FILE* pfp = fopen(name, "rb");
+					if((pfp == NULL) != miss) abort();
+					if(pfp) fclose(pfp);
+					samples[i] = now_ns() - t0;
+				}
+				print_lat("open", n, miss? "fopen_miss": "fopen_hit", samples, lookups);
+			}
+			remove_tree(tree, n);
+		}
+	}
+	remove(tar);
+	free(pick);
+	free(samples);
+}
+
+
+/* read: sequential and random chunks through tfs_fread, the mapping and plain files */
+
+struct read_case {
+	const char* impl;
+	int flags;
+	/* extracted files through libc */
+	int plain;
+};
+
+static void bench_read_one(const struct read_case* rc, const char* tree, int members, uint64_t size,
+	size_t chunk, int random){
+
+	/* the same byte count for every case, at most one pass over the data */
+	uint64_t budget = (uint64_t) members * size < (256ull << 20)? (uint64_t) members * size: 256ull << 20;
+	size_t reads = budget / chunk;
+	uint64_t slots = size / chunk;
+	double* samples = malloc(reads * sizeof(*samples));
+	char* buf = malloc(chunk);
+	char name[600];
+	FILE** files = calloc(members, sizeof(*files));
+	for(int i = 0; i < members; ++i){
+		if(rc->plain) snprintf(name, sizeof(name), "%s/m%d", tree, i);
+		else snprintf(name, sizeof(name), "@/m%d", i);
+		files[i] = rc->plain? fopen(name, "rb"): tfs_fopen(name, "rb");
+		if(!files[i]) abort();
+	}
+	srand(chunk);
+	double start = now_ns();
+	for(size_t r = 0; r < reads; ++r){
+		int m = random? rand() % members: (int) (r / slots % members);
+		uint64_t slot = random? (((uint64_t) rand() << 31) | rand()) % slots: r % slots;
+		double t0 = now_ns();
+		size_t got;
+		if(rc->plain){
+			fseeko(files[m], slot * chunk, SEEK_SET);
+			got = fread(buf, 1, chunk, files[m]);
+		}else{
+			tfs_fseek(files[m], slot * chunk, SEEK_SET);
+			got = tfs_fread(buf, 1, chunk, files[m]);
+		}
+		samples[r] = now_ns() - t0;
+		if(got != chunk) abort();
+	}
+	double secs = (now_ns() - start) / 1e9;
+	struct lat l = percentiles(samples, reads);
+	printf("read\t%llu\t%s\t%s\t%zu\t%.1f\t%.0f\t%.0f\t%.0f\n", (unsigned long long) size, rc->impl,
+		random? "random": "seq", chunk, reads * chunk / secs / (1 << 20), l.p50, l.p99, l.max);
+	for(int i = 0; i < members; ++i){
+		if(rc->plain) fclose(files[i]);
+		else tfs_fclose(files[i]);
+	}
+	free(files);
+	free(buf);
+	free(samples);
+}
+
+static void bench_read(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const char* tree = bench_path("tfs_bench.d");
+	static const struct {
+		int members;
+		uint64_t size;
+	} shapes[] = { { 4096, 4 << 10 }, { 8, 32 << 20 }, { 1, (5ull << 30) / 2 } };
+	static const struct read_case cases[] = {
+		{ "tfs", 0, 0 },
+		{ "tfs_mmap", TFS_INIT_MMAP, 0 },
+		{ "fopen", 0, 1 },
+	};
+	static const size_t chunks[] = { 4 << 10, 64 << 10, 1 << 20 };
+	printf("# read\tmember_size\timpl\tpattern\tchunk\tMiB_per_s\tp50_ns\tp99_ns\tmax_ns\n");
+	for(int s = 0; s < (bench_full? 3: 2); ++s){
+		if(make_tar_sized(tar, shapes[s].members, shapes[s].size) != 0
+			|| make_tree_sized(tree, shapes[s].members, shapes[s].size) != 0)
+			break;
+		for(size_t c = 0; c < sizeof(cases) / sizeof(*cases); ++c){
+			if(!cases[c].plain) tfs_inittarfile_ex(tar, cases[c].flags);
+			for(size_t k = 0; k < sizeof(chunks) / sizeof(*chunks); ++k){
+				if(chunks[k] > shapes[s].size) continue;
+				for(int random = 0; random < 2; ++random)
+					bench_read_one(&cases[c], tree, shapes[s].members, shapes[s].size, chunks[k], random);
+			}
+			if(!cases[c].plain) tfs_deinit();
+		}
+		remove_tree_sized(tree, shapes[s].members);
+	}
+	remove(tar);
+}
+
+
+/* threads: every thread reads the whole archive, members in a different order */
+
+struct read_job {
+	int members;
+	int first;
+	size_t chunk;
+	size_t bytes;
+};
+
+static void* read_worker(void* arg){
+	struct read_job* job = arg;
+	char* buf = malloc(job->chunk);
+	char name[32];
+	for(int i = 0; i < job->members; ++i){
+		snprintf(name, sizeof(name), "@/m%d", (job->first + i * 7) % job->members);
+		FILE* fp = tfs_fopen(name, "rb");
+		if(!fp) abort();
+		size_t got;
+		while((got = tfs_fread(buf, 1, job->chunk, fp)) > 0) job->bytes += got;
+		tfs_fclose(fp);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void bench_threads(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const int members = 256;
+	const size_t size = 256 << 10;
+	if(make_tar_sized(tar, members, size) != 0) return;
+	tfs_inittarfile(tar);
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	printf("# threads\tthreads\tMiB_per_s\n");
+	for(long threads = 1; threads <= ncpu * 2 && threads <= 64; threads *= 2){
+		pthread_t tid[64];
+		struct read_job jobs[64];
+		double t0 = now_ns();
+		for(long i = 0; i < threads; ++i){
+			jobs[i] = (struct read_job){ members, i * 13, 64 << 10, 0 };
+			pthread_create(&tid[i], NULL, read_worker, &jobs[i]);
+		}
+		size_t bytes = 0;
+		for(long i = 0; i < threads; ++i){
+			pthread_join(tid[i], NULL);
+			bytes += jobs[i].bytes;
+		}
+		double secs = (now_ns() - t0) / 1e9;
+		printf("threads\t%ld\t%.1f\n", threads, bytes / secs / (1 << 20));
+	}
+	tfs_deinit();
+	remove(tar);
+}
+
+
+/* cache: small sequential reads, cold then warm, with and without the block cache */
+
+static void bench_cache(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const int members = 64;
+	if(make_tar_sized(tar, members, 64 << 10) != 0) return;
+	tfs_inittarfile(tar);
+	printf("# cache\tenabled\tpass\tus\thits\tmisses\treadahead\n");
+	char buf[4096], name[32];
+	for(int on = 1; on >= 0; --on){
+		tfs_cache_config(on? TFS_CACHE_DEFAULT_BUDGET: 0, 0);
+		for(int pass = 0; pass < 2; ++pass){
+			struct tfs_cache_stats s0, s1;
+			tfs_cache_getstats(&s0);
+			double t0 = now_ns();
+			for(int i = 0; i < members; ++i){
+				snprintf(name, sizeof(name), "@/m%d", i);
+				FILE* fp = tfs_fopen(name, "rb");
+				if(!fp) abort();
+				while(tfs_fread(buf, 1, sizeof(buf), fp) > 0);
+				tfs_fclose(fp);
+			}
+			double us = (now_ns() - t0) / 1e3;
+			tfs_cache_getstats(&s1);
+			printf("cache\t%d\t%d\t%.1f\t%lu\t%lu\t%lu\n", on, pass, us,
+				(unsigned long) (s1.hits - s0.hits), (unsigned long) (s1.misses - s0.misses),
+				(unsigned long) (s1.readahead - s0.readahead));
+		}
+	}
+	tfs_cache_config(TFS_CACHE_DEFAULT_BUDGET, 0);
+	tfs_deinit();
+	remove(tar);
+}
+
+
+/* batch: a level load, every member of a small-file tar in random order, one by one and batched */
+
+static void bench_batch(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const int members = 20000;
+	const size_t size = 2000;
+	if(make_tar_sized(tar, members, size) != 0) return;
+	tfs_inittarfile(tar);
+	char (*bufs)[2000] = malloc(members * sizeof(*bufs));
+	tfs_req* reqs = calloc(members, sizeof(*reqs));
+	char (*names)[16] = malloc(members * sizeof(*names));
+	int* order = malloc(members * sizeof(*order));
+	for(int i = 0; i < members; ++i) order[i] = i;
+	srand(1);
+	for(int i = members - 1; i > 0; --i){
+		int k = rand() % (i + 1), t = order[i];
+		order[i] = order[k];
+		order[k] = t;
+	}
+	for(int i = 0; i < members; ++i){
+		snprintf(names[i], sizeof(*names), "@/m%d", order[i]);
+		reqs[i] = (tfs_req){ .path = names[i], .len = size, .dest = bufs[i] };
+	}
+	printf("# batch\tmembers\tfopen_fread_us\treadbatch_us\n");
+	tfs_cache_config(0, 0);
+	double t0 = now_ns();
+	for(int i = 0; i < members; ++i){
+		FILE* fp = tfs_fopen(names[i], "rb");
+		if(!fp || tfs_fread(bufs[i], 1, size, fp) != size) abort();
+		tfs_fclose(fp);
+	}
+	double one_us = (now_ns() - t0) / 1e3;
+	t0 = now_ns();
+	if(tfs_readbatch(reqs, members) != 0) abort();
+	double batch_us = (now_ns() - t0) / 1e3;
+	tfs_cache_config(TFS_CACHE_DEFAULT_BUDGET, 0);
+	printf("batch\t%d\t%.1f\t%.1f\n", members, one_us, batch_us);
+	free(bufs);
+	free(reqs);
+	free(names);
+	free(order);
+	tfs_deinit();
+	remove(tar);
+}
+
+
+/* aio: one thread serving every member, blocking reads against the async engine */
+
+static void aio_count(void* user, ssize_t result, int error){
+	(void) error;
+	if(result > 0) *(size_t*) user += result;
+}
+
+static void bench_aio(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const int members = 1024;
+	const size_t size = 64 << 10;
+	if(make_tar_sized(tar, members, size) != 0) return;
+	tfs_inittarfile(tar);
+	tfs_cache_config(0, 0);
+	char* buf = malloc(members * size);
+	tfs_entry_id* ids = malloc(members * sizeof(*ids));
+	char name[32];
+	for(int i = 0; i < members; ++i){
+		snprintf(name, sizeof(name), "@/m%d", (i * 7919) % members);
+		ids[i] = tfs_lookup(name);
+	}
+	printf("# aio\tbackend\tdepth\tMiB_per_s\n");
+	double t0 = now_ns();
+	for(int i = 0; i < members; ++i){
+		snprintf(name, sizeof(name), "@/%s", tfs_entry_path(ids[i]));
+		FILE* fp = tfs_fopen(name, "rb");
+		if(!fp || tfs_fread(buf + i * size, 1, size, fp) != size) abort();
+		tfs_fclose(fp);
+	}
+	printf("aio\tsync\t1\t%.1f\n", members * size / ((now_ns() - t0) / 1e9) / (1 << 20));
+	static const int backends[] = { TFS_AIO_URING, TFS_AIO_THREADS };
+	static const char* names[] = { "uring", "threads" };
+	for(int b = 0; b < 2; ++b){
+		for(unsigned depth = 4; depth <= 64; depth *= 4){
+			if(tfs_aio_init(backends[b], depth) != backends[b]){
+				tfs_aio_deinit();
+				continue;
+			}
+			size_t bytes = 0;
+			t0 = now_ns();
+			for(int i = 0; i < members; ++i){
+				if(tfs_read_async(ids[i], 0, buf + i * size, size, aio_count, &bytes) != 0) abort();
+			}
+			tfs_aio_deinit();
+			if(bytes != members * size) abort();
+			printf("aio\t%s\t%u\t%.1f\n", names[b], depth, bytes / ((now_ns() - t0) / 1e9) / (1 << 20));
+		}
+	}
+	tfs_cache_config(TFS_CACHE_DEFAULT_BUDGET, 0);
+	free(ids);
+	free(buf);
+	tfs_deinit();
+	remove(tar);
+}
+
+
+/* mounts: opens through a base tar with patch tars stacked over it */
+
+static void bench_mounts(void){
+	const char* tar = bench_path("tfs_bench.tar");
+	const char* patch = bench_path("tfs_bench_patch.tar");
+	const int n = 100000, lookups = 20000;
+	static const int layer_counts[] = { 0, 1, 4, 16 };
+	if(make_tar(tar, n) != 0 || make_tar(patch, 100) != 0) return;
+	double* samples = malloc(lookups * sizeof(*samples));
+	char name[600];
+	printf("# mounts\tlayers\timpl\tp50_ns\tp90_ns\tp99_ns\tmax_ns\n");
+	for(size_t k = 0; k < sizeof(layer_counts) / sizeof(*layer_counts); ++k){
+		tfs_inittarfile(tar);
+		/* the same patch again and again, each mount one more layer */
+		for(int l = 0; l < layer_counts[k]; ++l) tfs_mount(patch, "/", l + 1);
+		srand(n);
+		for(int miss = 0; miss < 2; ++miss){
+			for(int i = 0; i < lookups; ++i){
+				int pick = rand() % n;
+				snprintf(name, sizeof(name), miss? "@/d%d/x%d.bin": "@/" ENTRY_NAME, ENTRY_ARGS(pick));
+				double t0 = now_ns();
+				FILE* fp = tfs_fopen(name, "rb");
+				if((fp == NULL) != miss) abort();
+				if(fp) tfs_fclose(fp);
+				samples[i] = now_ns() - t0;
+			}
+			print_lat("mounts", layer_counts[k], miss? "miss": "hit", samples, lookups);
+		}
+		tfs_deinit();
+	}
+	free(samples);
+	remove(tar);
+	remove(patch);
+}
+
+static const struct {
+	const char* name;
+	void (*run)(void);
+} suites[] = {
+	{ "init", bench_init },
+	{ "open", bench_open },
+	{ "read", bench_read },
+	{ "threads", bench_threads },
+	{ "cache", bench_cache },
+	{ "batch", bench_batch },
+	{ "aio", bench_aio },
+	{ "mounts", bench_mounts },
+};
+
+int main(int argc, char** argv){
+	int opt;
+	while((opt = getopt(argc, argv, "d:f")) != -1){
+		if(opt == 'd') bench_dir = optarg;
+		else if(opt == 'f') bench_full = 1;
+		else{
+			fprintf(stderr, "usage: %s [-d dir] [-f] [suite...]\n", argv[0]);
+			return 2;
+		}
+	}
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	for(size_t i = 0; i < sizeof(suites) / sizeof(*suites); ++i){
+		int run = optind == argc;
+		for(int k = optind; k < argc; ++k) run |= !strcmp(argv[k], suites[i].name);
+		if(run) suites[i].run();
+	}
+	return 0;
+}
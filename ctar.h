@@ -39,6 +39,7 @@ THE SOFTWARE
 
 #include "errno.h"
 #include "stdarg.h"
+#include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "string.h"
@@ -62,7 +63,7 @@ THE SOFTWARE
 // tar entry metadata structure (singly-linked list)
 struct ctar_t {
     char original_name[100];                // original filenme; only availible when writing into a tar
-    unsigned int begin;                     // location of data in file (including metadata)
+    uint64_t begin;                         // location of data in file (including metadata)
     union {
         union {
             // Pre-POSIX.1-1988 format
@@ -137,7 +138,10 @@ int ls_ctar_entry(FILE * f, struct ctar_t * archive, const size_t filecount, con
 // convert octal string to unsigned integer
 unsigned int ctar_oct2uint(char * oct, unsigned int size);
 
-#define ctar_getsize(archive) (ctar_oct2uint(archive? archive->size: NULL, 11))
+// convert a numeric field to 64 bits: octal, or GNU base-256 when the high bit of the first octet is set
+uint64_t ctar_oct2u64(const char * field, unsigned int size);
+
+#define ctar_getsize(archive) (ctar_oct2u64((archive)? (archive)->size: NULL, 12))
 
 // /////////////////////////////////////////////////////////////////////////////
 
@@ -185,7 +189,7 @@ int ctar_read(FILE* fp, struct ctar_t ** archive, const char verbosity){
         ERROR("Bad archive");
     }
 
-    unsigned int offset = 0;
+    uint64_t offset = 0;
     int count = 0;
 
     struct ctar_t ** tar = archive;
@@ -230,7 +234,7 @@ int ctar_read(FILE* fp, struct ctar_t ** archive, const char verbosity){
         (*tar) -> begin = offset;
 
         // skip over data and unfilled block
-        unsigned int jump = ctar_oct2uint((*tar) -> size, 11);
+        uint64_t jump = ctar_getsize(*tar);
         if (jump % 512){
             jump += 512 - (jump % 512);
         }
@@ -304,14 +308,14 @@ int print_entry_metadata(FILE * f, struct ctar_t * entry){
         return -1;
     }
 
-    time_t mtime = ctar_oct2uint(entry -> mtime, 12);
+    time_t mtime = (int64_t) ctar_oct2u64(entry -> mtime, 12);
     char mtime_str[32];
     strftime(mtime_str, sizeof(mtime_str), "%c", localtime(&mtime));
     fprintf(f, "File Name: %s\n", entry -> name);
     fprintf(f, "File Mode: %s (%03o)\n", entry -> mode, ctar_oct2uint(entry -> mode, 8));
     fprintf(f, "Owner UID: %s (%d)\n", entry -> uid, ctar_oct2uint(entry -> uid, 12));
     fprintf(f, "Owner GID: %s (%d)\n", entry -> gid, ctar_oct2uint(entry -> gid, 12));
-    fprintf(f, "File Size: %s (%d)\n", entry -> size, ctar_oct2uint(entry -> size, 12));
+    fprintf(f, "File Size: %s (%llu)\n", entry -> size, (unsigned long long) ctar_getsize(entry));
     fprintf(f, "Time     : %s (%s)\n", entry -> mtime, mtime_str);
     fprintf(f, "Checksum : %s\n", entry -> check);
     fprintf(f, "File Type: ");
@@ -419,10 +423,10 @@ int ls_ctar_entry(FILE * f, struct ctar_t * entry, const size_t filecount, const
             int rc = -1;
             switch (entry -> type){
                 case REGULAR: case NORMAL: case CONTIGUOUS:
-                    rc = sprintf(size_buf, "%u", ctar_oct2uint(entry -> size, 11));
+                    rc = sprintf(size_buf, "%llu", (unsigned long long) ctar_getsize(entry));
                     break;
                 case HARDLINK: case SYMLINK: case DIRECTORY: case FIFO:
-                    rc = sprintf(size_buf, "%u", ctar_oct2uint(entry -> size, 11));
+                    rc = sprintf(size_buf, "%llu", (unsigned long long) ctar_getsize(entry));
                     break;
                 case CHAR: case BLOCK:
                     rc = sprintf(size_buf, "%d,%d", ctar_oct2uint(entry -> major, 7), ctar_oct2uint(entry -> minor, 7));
@@ -435,7 +439,7 @@ int ls_ctar_entry(FILE * f, struct ctar_t * entry, const size_t filecount, const
 
             fprintf(f, "%s", size_buf);
 
-            time_t mtime = ctar_oct2uint(entry -> mtime, 11);
+            time_t mtime = (int64_t) ctar_oct2u64(entry -> mtime, 12);
             struct tm * time = localtime(&mtime);
             fprintf(f, " %d-%02d-%02d %02d:%02d ", time -> tm_year + 1900, time -> tm_mon + 1, time -> tm_mday, time -> tm_hour, time -> tm_min);
         }
@@ -477,6 +481,31 @@ unsigned int ctar_oct2uint(char * oct, unsigned int size){
     return out;
 }
 
+uint64_t ctar_oct2u64(const char * field, unsigned int size){
+    const unsigned char * p = (const unsigned char *) field;
+    uint64_t out = 0;
+    if (!p || !size){
+        return 0;
+    }
+    if (p[0] & 0x80){
+        // base-256, big endian two's complement; 0xff leads a negative value
+        out = (p[0] & 0x40)? ~(uint64_t) 0: 0;
+        out = (out << 6) | (p[0] & 0x3f);
+        for(unsigned int i = 1; i < size; i++){
+            out = (out << 8) | p[i];
+        }
+        return out;
+    }
+    unsigned int i = 0;
+    while ((i < size) && (p[i] == ' ')){
+        i++;
+    }
+    while ((i < size) && (p[i] >= '0') && (p[i] <= '7')){
+        out = (out << 3) | (uint64_t) (p[i++] - '0');
+    }
+    return out;
+}
+
 int ctar_iszeroed(char * buf, size_t size){
     for(size_t i = 0; i < size; buf++, i++){
         if (* (char *) buf){
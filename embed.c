@@ -0,0 +1,84 @@
+/*
+	a tar linked into the executable and mounted from memory, timed against
+	mounting the same tar from disk. TFS_EMBED_TAR names the tar to link in,
+	see the tfs-embed target in the Makefile
+*/
+
+#include "tfs.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+
+#ifndef TFS_EMBED_TAR
+#define TFS_EMBED_TAR "test.tar"
+#endif
+
+/* objcopy -I binary would do as well, .incbin keeps it to one compiler call */
+__asm__(
+	".section .rodata\n"
+	".balign 512\n"
+	".global tfs_embedded_tar\n"
+	"tfs_embedded_tar:\n"
+	".incbin \"" TFS_EMBED_TAR "\"\n"
+	".global tfs_embedded_tar_end\n"
+	"tfs_embedded_tar_end:\n"
+	".previous\n"
+);
+
+extern const char tfs_embedded_tar[];
+extern const char tfs_embedded_tar_end[];
+
+static double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* sum of every byte of the first regular member, to show the mounts agree */
+static long first_sum(void){
+	for(tfs_entry_id id = 0; tfs_entry_path(id); ++id){
+		char path[4200];
+		snprintf(path, sizeof(path), "@/%s", tfs_entry_path(id));
+		FILE* fp = fopen(path, "rb");
+		if(!fp) continue;
+		long sum = 0;
+		unsigned char buf[4096];
+		size_t n;
+		while((n = fread(buf, 1, sizeof(buf), fp)) > 0){
+			for(size_t i = 0; i < n; ++i) sum += buf[i];
+		}
+		fclose(fp);
+		return sum;
+	}
+	return -1;
+}
+
+int main(int argc, char** argv){
+	const char* tar = argc > 1? argv[1]: TFS_EMBED_TAR;
+	const int rounds = argc > 2? atoi(argv[2]): 1000;
+	size_t len = tfs_embedded_tar_end - tfs_embedded_tar;
+
+	double t0 = now_ns();
+	for(int i = 0; i < rounds; ++i) tfs_inittarmem(tfs_embedded_tar, len, 0);
+	double mem_us = (now_ns() - t0) / rounds / 1e3;
+	long mem_sum = first_sum();
+
+	t0 = now_ns();
+	for(int i = 0; i < rounds; ++i) tfs_inittar(tfs_embedded_tar);
+	double walk_us = (now_ns() - t0) / rounds / 1e3;
+
+	t0 = now_ns();
+	for(int i = 0; i < rounds; ++i) tfs_inittarfile(tar);
+	double file_us = (now_ns() - t0) / rounds / 1e3;
+	long file_sum = first_sum();
+	tfs_deinit();
+
+	printf("# bench\ttar_bytes\tinittarmem_us\tinittar_us\tinittarfile_us\n");
+	printf("embed\t%zu\t%.2f\t%.2f\t%.2f\n", len, mem_us, walk_us, file_us);
+	if(mem_sum < 0 || mem_sum != file_sum){
+		fprintf(stderr, "embedded and file mounts differ\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,20 @@
+#include "tfs.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "errno.h"
+
+int main(int argc, char** argv){
+	if(argc < 2 || argc > 3){
+		fprintf(stderr, "usage: %s <file.tar> [index]\n", argv[0]);
+		fprintf(stderr, "writes <file.tar>" TFS_INDEX_SUFFIX " unless index is given\n");
+		return 2;
+	}
+	if(tfs_writeindex(argv[1], argc > 2? argv[2]: NULL) != 0){
+		if(errno == EBADMSG) fprintf(stderr, "%s: bad header at offset %lld\n", argv[1],
+			(long long) tfs_corrupt_offset());
+		else fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,48 @@
+#include "tfs.h"
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "unistd.h"
+
+/* a size with an optional k or m suffix */
+static int parse_size(const char* s, uint64_t* out){
+	char* end;
+	unsigned long long v = strtoull(s, &end, 10);
+	if(end == s) return -1;
+	if(*end == 'k' || *end == 'K') v <<= 10, ++end;
+	else if(*end == 'm' || *end == 'M') v <<= 20, ++end;
+	if(*end) return -1;
+	*out = v;
+	return 0;
+}
+
+int main(int argc, char** argv){
+	struct tfs_pack_opts opts = { .align = 4096 };
+	uint64_t v;
+	int opt, min_set = 0;
+	while((opt = getopt(argc, argv, "a:m:o:")) != -1){
+		if(opt == 'a' && parse_size(optarg, &v) == 0) opts.align = v;
+		else if(opt == 'm' && parse_size(optarg, &v) == 0){
+			opts.min_size = v;
+			min_set = 1;
+		}else if(opt == 'o') opts.order = optarg;
+		else{
+			optind = argc;
+			break;
+		}
+	}
+	if(argc - optind != 2){
+		fprintf(stderr, "usage: %s [-a align] [-m min_size] [-o order] <in.tar> <out.tar>\n", argv[0]);
+		fprintf(stderr, "aligns the data of members of at least min_size (default align) to align (default 4k),\n"
+			"putting the members listed in order, one path per line, first\n");
+		return 2;
+	}
+	if(!min_set) opts.min_size = opts.align;
+	if(tfs_pack(argv[optind], argv[optind + 1], &opts) != 0){
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	return 0;
+}
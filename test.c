@@ -1,9 +1,1440 @@
 #include "tfs.h"
+/* after tfs.h, whose overrides stay on: the index layout for the corrupt index test */
+#include "tfs_internal.h"
 
+#include "errno.h"
+#include "fcntl.h"
+#include "limits.h"
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "poll.h"
+#include "pthread.h"
+#include "stdatomic.h"
+#include "unistd.h"
+#include "glob.h"
+#include "sys/resource.h"
+#include "sys/uio.h"
+#include "sys/wait.h"
 
-int main(void){
+#define STRESS_MEMBERS 64
+#define STRESS_THREADS 8
+#define STRESS_ROUNDS 4000
+
+static size_t stress_size(int i){
+	return (size_t) i * 1999 % 70000;
+}
+
+static unsigned char stress_byte(int i, size_t pos){
+	return (i * 31 + pos) & 0xff;
+}
+
+static void put_block(FILE* fp, const char* name, char type, size_t size, char block[512]){
+	snprintf(block, 100, "%s", name);
+	memcpy(block + 100, "0000644", 8);
+	if(!block[124]) snprintf(block + 124, 12, "%011zo", size);
+	block[156] = type;
+	memcpy(block + 257, "ustar", 6);
+	memcpy(block + 263, "00", 2);
+	memset(block + 148, ' ', 8);
+	unsigned int sum = 0;
+	for(int i = 0; i < 512; ++i) sum += (unsigned char) block[i];
+	snprintf(block + 148, 8, "%06o", sum);
+	fwrite(block, 512, 1, fp);
+}
+
+static void put_header(FILE* fp, const char* name, size_t size){
+	char block[512] = {};
+	put_block(fp, name, '0', size, block);
+}
+
+/* header plus padded data in one go */
+static void put_member(FILE* fp, const char* name, char type, const char* data, size_t size){
+	char block[512] = {};
+	put_block(fp, name, type, size, block);
+	for(size_t off = 0; off < size; off += 512){
+		memset(block, 0, sizeof(block));
+		memcpy(block, data + off, size - off < 512? size - off: 512);
+		fwrite(block, 512, 1, fp);
+	}
+}
+
+static int make_stress_tar(const char* path){
+	FILE* fp = fopen(path, "wb");
+	if(!fp) return -1;
+	static unsigned char data[70000 + 512];
+	char name[32];
+	for(int i = 0; i < STRESS_MEMBERS; ++i){
+		size_t size = stress_size(i);
+		snprintf(name, sizeof(name), "stress/%d", i);
+		put_header(fp, name, size);
+		memset(data, 0, sizeof(data));
+		for(size_t pos = 0; pos < size; ++pos) data[pos] = stress_byte(i, pos);
+		fwrite(data, (size + 511) / 512 * 512, 1, fp);
+	}
+	memset(data, 0, 1024);
+	fwrite(data, 1024, 1, fp);
+	fclose(fp);
+	return 0;
+}
+
+static void* stress_reader(void* arg){
+	unsigned int seed = (unsigned int) (size_t) arg;
+	unsigned char buf[4096];
+	char name[32];
+	for(int round = 0; round < STRESS_ROUNDS; ++round){
+		int i = rand_r(&seed) % STRESS_MEMBERS;
+		size_t size = stress_size(i);
+		snprintf(name, sizeof(name), "@/stress/%d", i);
+		FILE* fp = fopen(name, "rb");
+		if(!fp) return "fopen";
+		size_t pos = size? rand_r(&seed) % size: 0;
+		size_t want = rand_r(&seed) % sizeof(buf) + 1;
+		size_t expect = size - pos < want? size - pos: want;
+		if(fseek(fp, pos, SEEK_SET) != 0 || fread(buf, 1, want, fp) != expect){
+			fclose(fp);
+			return "fread";
+		}
+		for(size_t k = 0; k < expect; ++k){
+			if(buf[k] != stress_byte(i, pos + k)){
+				fclose(fp);
+				return "data";
+			}
+		}
+		fclose(fp);
+	}
+	return NULL;
+}
+
+static int run_stress_readers(void){
+	pthread_t threads[STRESS_THREADS];
+	for(size_t i = 0; i < STRESS_THREADS; ++i)
+		pthread_create(&threads[i], NULL, stress_reader, (void*) (i + 1));
+	int res = 0;
+	for(size_t i = 0; i < STRESS_THREADS; ++i){
+		void* err;
+		pthread_join(threads[i], &err);
+		if(err){
+			printf("thread %zu: %s error\n", i, (const char*) err);
+			res = -1;
+		}
+	}
+	return res;
+}
+
+static atomic_int resizing;
+
+/* swaps the cache under the readers until they are done */
+static void* cache_resizer(void* arg){
+	(void) arg;
+	for(int i = 0; atomic_load(&resizing); ++i) tfs_cache_config(i % 3? (256 << 10) << (i % 3): 0, 4096 << (i % 4));
+	return NULL;
+}
+
+/* many threads reading different members through one archive */
+static int test_threads(void){
+	const char* tar = "/tmp/tfs_stress.tar";
+	if(make_stress_tar(tar) != 0) return -1;
+	/* readers go through the saved index rather than a scan */
+	if(tfs_writeindex(tar, NULL) != 0) return -1;
+	tfs_inittarfile(tar);
+	int res = run_stress_readers();
+	struct tfs_cache_stats stats;
+	tfs_cache_getstats(&stats);
+	if(stats.hits == 0 || stats.used > stats.budget) res = -1;
+	/* a cache too small to hold the working set, and none at all */
+	tfs_cache_config(64 << 10, 4096);
+	if(res == 0) res = run_stress_readers();
+	tfs_cache_getstats(&stats);
+	if(stats.evictions == 0) res = -1;
+	tfs_cache_config(0, 0);
+	if(res == 0) res = run_stress_readers();
+	/* and one resized while they read */
+	pthread_t resizer;
+	atomic_store(&resizing, 1);
+	pthread_create(&resizer, NULL, cache_resizer, NULL);
+	if(res == 0) res = run_stress_readers();
+	atomic_store(&resizing, 0);
+	pthread_join(resizer, NULL);
+	tfs_cache_config(TFS_CACHE_DEFAULT_BUDGET, 0);
+	tfs_cache_getstats(&stats);
+	if(stats.used > stats.budget) res = -1;
+	tfs_deinit();
+	remove(tar);
+	remove("/tmp/tfs_stress.tar" TFS_INDEX_SUFFIX);
+	return res;
+}
+
+/* saved indexes whose pool runs off its end or whose slots are all taken are scanned past, not trusted */
+static int test_index_corrupt(void){
+	const char* tar = "/tmp/tfs_idxbad.tar";
+	const char* idx = "/tmp/tfs_idxbad.tar" TFS_INDEX_SUFFIX;
+	if(make_stress_tar(tar) != 0 || tfs_writeindex(tar, NULL) != 0) return -1;
+	/* the pool ends the file: its last terminator and the padding after it */
+	int res = -1;
+	int fd = open(idx, O_RDWR);
+	struct stat st;
+	if(fd >= 0 && fstat(fd, &st) == 0){
+		char* buf = malloc(st.st_size);
+		off_t end = buf && pread(fd, buf, st.st_size, 0) == st.st_size? st.st_size: 0;
+		while(end > 0 && !buf[end - 1]) --end;
+		if(end > 0){
+			memset(buf + end, 'x', st.st_size - end);
+			if(pwrite(fd, buf + end, st.st_size - end, end) == st.st_size - end) res = 0;
+		}
+		free(buf);
+	}
+	if(fd >= 0) close(fd);
+	for(int round = 0; round < 2 && res == 0; ++round){
+		/* then one with no empty slot and every bloom bit set, where a miss would probe forever */
+		if(round == 1){
+			struct tfs_arena arena;
+			res = -1;
+			fd = tfs_writeindex(tar, NULL) == 0? open(idx, O_RDWR): -1;
+			if(fd >= 0 && pread(fd, &arena, sizeof(arena), 0) == sizeof(arena)){
+				uint32_t* slots = calloc(arena.slot_count, sizeof(*slots));
+				uint64_t* bloom = malloc(arena.bloom_words * sizeof(*bloom));
+				if(slots && bloom){
+					for(uint32_t i = 0; i < arena.slot_count; ++i) slots[i] = i % arena.members + 1;
+					memset(bloom, 0xff, arena.bloom_words * sizeof(*bloom));
+					size_t slen = arena.slot_count * sizeof(*slots), blen = arena.bloom_words * sizeof(*bloom);
+					if(pwrite(fd, slots, slen, arena.slots) == (ssize_t) slen
+						&& pwrite(fd, bloom, blen, arena.bloom) == (ssize_t) blen)
+						res = 0;
+				}
+				free(slots);
+				free(bloom);
+			}
+			if(fd >= 0) close(fd);
+		}
+		tfs_inittarfile(tar);
+		for(int i = 0; res == 0 && i < STRESS_MEMBERS; ++i){
+			char name[32];
+			snprintf(name, sizeof(name), "@/stress/%d", i);
+			if(tfs_lookup(name) == TFS_ENTRY_NONE) res = -1;
+		}
+		if(tfs_lookup("@/stress") == TFS_ENTRY_NONE || tfs_lookup("@/stress/none") != TFS_ENTRY_NONE) res = -1;
+		tfs_deinit();
+	}
+	remove(idx);
+	remove(tar);
+	return res;
+}
+
+/* every member in two halves, by path and by id, plus requests that must fail */
+static int run_batch(void){
+	static unsigned char bufs[STRESS_MEMBERS * 2][40000];
+	tfs_req reqs[STRESS_MEMBERS * 2 + 2] = {};
+	char names[STRESS_MEMBERS][32];
+	size_t n = 0;
+	for(int i = STRESS_MEMBERS - 1; i >= 0; --i){
+		size_t half = stress_size(i) / 2;
+		snprintf(names[i], sizeof(*names), "@/stress/%d", i);
+		reqs[n++] = (tfs_req){ .path = names[i], .offset = 0, .len = half, .dest = bufs[2 * i] };
+		reqs[n++] = (tfs_req){ .path = NULL, .id = tfs_lookup(names[i]), .offset = half,
+			.len = sizeof(*bufs), .dest = bufs[2 * i + 1] };
+	}
+	reqs[n++] = (tfs_req){ .path = "@/stress/none", .len = 1, .dest = bufs[0] };
+	reqs[n++] = (tfs_req){ .path = "@/stress", .len = 1, .dest = bufs[0] };
+	if(tfs_readbatch(reqs, n) != 2 || reqs[n - 2].error != ENOENT || reqs[n - 1].error != EISDIR) return -1;
+	for(size_t k = 0; k < n - 2; ++k){
+		int i = STRESS_MEMBERS - 1 - k / 2;
+		size_t size = stress_size(i), half = size / 2;
+		size_t from = k % 2? half: 0, expect = k % 2? size - half: half;
+		if(reqs[k].result != (ssize_t) expect) return -1;
+		for(size_t pos = 0; pos < expect; ++pos){
+			if(((unsigned char*) reqs[k].dest)[pos] != stress_byte(i, from + pos)) return -1;
+		}
+	}
+	return 0;
+}
+
+static int test_batch(void){
+	const char* tar = "/tmp/tfs_batch.tar";
+	if(make_stress_tar(tar) != 0) return -1;
+	int res = 0;
+	for(int mapped = 0; mapped < 2 && res == 0; ++mapped){
+		tfs_inittarfile_ex(tar, mapped? TFS_INIT_MMAP: 0);
+		res = run_batch();
+		tfs_deinit();
+	}
+	remove(tar);
+	return res;
+}
+
+struct aio_check {
+	int member;
+	ssize_t result;
+	int calls;
+	unsigned char buf[70000];
+};
+
+static void aio_done(void* user, ssize_t result, int error){
+	struct aio_check* c = user;
+	c->result = error? -1: result;
+	++c->calls;
+}
+
+/* run as tfs-test aio-nothreads: no room for a thread stack, the thread backend fails rather than queue reads nobody runs */
+static int aio_nothreads_child(void){
+	unsigned long pages = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if(!statm || fscanf(statm, "%lu", &pages) != 1) return 2;
+	fclose(statm);
+	struct rlimit lim;
+	lim.rlim_cur = lim.rlim_max = pages * sysconf(_SC_PAGESIZE) + (2 << 20);
+	if(setrlimit(RLIMIT_AS, &lim) != 0) return 2;
+	return tfs_aio_init(TFS_AIO_THREADS, 4) != -1 || errno != EAGAIN;
+}
+
+/* every member at once on each backend, then drained through the eventfd */
+static int test_aio(void){
+	const char* tar = "/tmp/tfs_aio.tar";
+	if(make_stress_tar(tar) != 0) return -1;
+	static struct aio_check checks[STRESS_MEMBERS];
+	int res = 0;
+	for(int round = 0; round < 3 && res == 0; ++round){
+		int backend = round == 1? TFS_AIO_THREADS: TFS_AIO_AUTO;
+		tfs_inittarfile_ex(tar, round == 2? TFS_INIT_MMAP: 0);
+		/* a depth below the member count exercises back-pressure */
+		if(tfs_aio_init(backend, 16) < 0 || (backend == TFS_AIO_THREADS && tfs_aio_init(0, 0) != TFS_AIO_THREADS)){
+			res = -1;
+			break;
+		}
+		char name[32];
+		for(int i = 0; i < STRESS_MEMBERS; ++i){
+			checks[i] = (struct aio_check){ .member = i };
+			snprintf(name, sizeof(name), "@/stress/%d", i);
+			if(tfs_read_async(tfs_lookup(name), 0, checks[i].buf, sizeof(checks[i].buf), aio_done, &checks[i]) != 0)
+				res = -1;
+		}
+		int reaped = 0;
+		while(reaped < STRESS_MEMBERS && res == 0){
+			struct pollfd pfd = { tfs_aio_fd(), POLLIN, 0 };
+			poll(&pfd, 1, 1000);
+			int n = tfs_aio_reap(0);
+			if(n < 0) res = -1;
+			reaped += n;
+		}
+		for(int i = 0; i < STRESS_MEMBERS && res == 0; ++i){
+			size_t size = stress_size(i);
+			if(checks[i].calls != 1 || checks[i].result != (ssize_t) size) res = -1;
+			for(size_t pos = 0; pos < size && res == 0; ++pos){
+				if(checks[i].buf[pos] != stress_byte(i, pos)) res = -1;
+			}
+		}
+		if(tfs_read_async(TFS_ENTRY_NONE, 0, checks[0].buf, 1, aio_done, NULL) == 0) res = -1;
+		tfs_aio_deinit();
+		tfs_deinit();
+	}
+	/* a fresh process, a forked one reuses the stacks of threads already gone */
+	pid_t pid = res == 0? fork(): -1;
+	if(pid == 0){
+		execl("/proc/self/exe", "tfs-test", "aio-nothreads", (char*) NULL);
+		_exit(127);
+	}
+	int status = -1;
+	if(pid < 0 || waitpid(pid, &status, 0) != pid || status != 0) res = -1;
+	remove(tar);
+	return res;
+}
+
+#ifdef TFS_WITH_ZLIB
+#include "zlib.h"
+
+/* the stress tar split over three gzip members, with checkpoints small enough to matter */
+static int test_gzip(void){
+	const char* tar = "/tmp/tfs_stress.tar";
+	const char* tgz = "/tmp/tfs_stress.tar.gz";
+	if(make_stress_tar(tar) != 0) return -1;
+	FILE* in = fopen(tar, "rb");
+	static char buf[4 << 20];
+	size_t len = in? fread(buf, 1, sizeof(buf), in): 0;
+	if(in) fclose(in);
+	remove(tgz);
+	struct stat st;
+	for(int part = 0; part < 3; ++part){
+		gzFile gz = gzopen(tgz, part? "ab": "wb");
+		size_t from = len / 3 / 512 * 512 * part, to = part < 2? len / 3 / 512 * 512 * (part + 1): len;
+		if(!gz || gzwrite(gz, buf + from, to - from) <= 0) return -1;
+		gzclose(gz);
+		if(!part && stat(tgz, &st) != 0) return -1;
+	}
+	off_t second = st.st_size;
+	remove(tar);
+
+	tfs_zconfig(64 << 10, 1 << 20);
+	tfs_inittarfile(tgz);
+	int res = run_stress_readers();
+	if(res == 0) res = run_batch();
+	tfs_deinit();
+	/* and again from saved checkpoints */
+	if(res == 0 && tfs_writeindex(tgz, NULL) == 0){
+		tfs_inittarfile(tgz);
+		res = run_stress_readers();
+		tfs_deinit();
+	}
+	/* a first checkpoint moved off the start (its out, after the 40 byte header) is not trusted */
+	int zfd = res == 0? open("/tmp/tfs_stress.tar.gz" TFS_ZINDEX_SUFFIX, O_WRONLY): -1;
+	if(zfd >= 0){
+		uint64_t one = 1;
+		if(pwrite(zfd, &one, sizeof(one), 48) != sizeof(one)) res = -1;
+		close(zfd);
+		tfs_inittarfile(tgz);
+		if(res == 0) res = run_stress_readers();
+		tfs_deinit();
+	}else res = -1;
+	/* a middle member that no longer inflates fails the scan instead of ending the index there */
+	int fd = res == 0 && stat(tgz, &st) == 0? open(tgz, O_WRONLY): -1;
+	if(fd >= 0){
+		if(pwrite(fd, "\0\0", 2, second) != 2) res = -1;
+		futimens(fd, (struct timespec[2]){ st.st_atim, st.st_mtim });
+		close(fd);
+		/* the checkpoints are kept, so only the scan reads that far */
+		remove("/tmp/tfs_stress.tar.gz" TFS_INDEX_SUFFIX);
+		tfs_inittarfile(tgz);
+		if(tfs_lookup("@/stress/0") != TFS_ENTRY_NONE) res = -1;
+		tfs_deinit();
+	}
+	tfs_zconfig(4 << 20, 32 << 20);
+	remove(tgz);
+	remove("/tmp/tfs_stress.tar.gz" TFS_INDEX_SUFFIX);
+	remove("/tmp/tfs_stress.tar.gz" TFS_ZINDEX_SUFFIX);
+	return res;
+}
+#endif
+
+#ifdef TFS_WITH_ZSTD
+#include "zstd.h"
+
+static void put_le32(FILE* fp, uint32_t v){
+	unsigned char b[4] = { v, v >> 8, v >> 16, v >> 24 };
+	fwrite(b, sizeof(b), 1, fp);
+}
+
+/*
+	the stress tar in 64 KiB frames, placed by decompressing them and then
+	from a seek table, which is all a mount needs even past a broken frame
+*/
+static int test_zstd(void){
+	const char* tar = "/tmp/tfs_stress.tar";
+	const char* tzst = "/tmp/tfs_stress.tar.zst";
+	if(make_stress_tar(tar) != 0) return -1;
+	FILE* in = fopen(tar, "rb");
+	static char buf[4 << 20], frame[128 << 10];
+	static uint32_t sizes[2][256];
+	size_t len = in? fread(buf, 1, sizeof(buf), in): 0;
+	if(in) fclose(in);
+	remove(tar);
+
+	int res = 0;
+	uint32_t frames = 0;
+	tfs_zconfig(64 << 10, 1 << 20);
+	for(int seekable = 0; seekable < 2 && res == 0; ++seekable){
+		FILE* fp = fopen(tzst, "wb");
+		if(!fp) return -1;
+		frames = 0;
+		for(size_t off = 0; off < len && frames < 256; off += 64 << 10, ++frames){
+			size_t n = len - off < (64 << 10)? len - off: 64 << 10;
+			size_t c = ZSTD_compress(frame, sizeof(frame), buf + off, n, 3);
+			if(ZSTD_isError(c)) res = -1;
+			else fwrite(frame, 1, c, fp);
+			sizes[0][frames] = c;
+			sizes[1][frames] = n;
+		}
+		if(seekable){
+			put_le32(fp, 0x184d2a5e);
+			put_le32(fp, frames * 8 + 9);
+			for(uint32_t i = 0; i < frames; ++i){
+				put_le32(fp, sizes[0][i]);
+				put_le32(fp, sizes[1][i]);
+			}
+			put_le32(fp, frames);
+			fputc(0, fp);
+			put_le32(fp, 0x8f92eab1);
+		}
+		fclose(fp);
+		tfs_inittarfile(tzst);
+		if(res == 0) res = run_stress_readers();
+		if(res == 0) res = run_batch();
+		tfs_deinit();
+	}
+
+	/* with the member index saved, a frame in the middle that no longer decodes is only found when read */
+	struct stat st;
+	int fd = res == 0 && tfs_writeindex(tzst, NULL) == 0 && stat(tzst, &st) == 0? open(tzst, O_WRONLY): -1;
+	if(fd >= 0){
+		off_t at = 0;
+		for(uint32_t i = 0; i < frames / 2; ++i) at += sizes[0][i];
+		if(pwrite(fd, "\0\0\0\0", 4, at) != 4) res = -1;
+		futimens(fd, (struct timespec[2]){ st.st_atim, st.st_mtim });
+		close(fd);
+		remove("/tmp/tfs_stress.tar.zst" TFS_ZINDEX_SUFFIX);
+		tfs_inittarfile(tzst);
+		unsigned char first[8];
+		FILE* fp = fopen("@/stress/1", "rb");
+		if(!fp || fread(first, 1, sizeof(first), fp) != sizeof(first) || first[7] != stress_byte(1, 7)) res = -1;
+		if(fp) fclose(fp);
+		tfs_deinit();
+	}else res = -1;
+	tfs_zconfig(4 << 20, 32 << 20);
+	remove(tzst);
+	remove("/tmp/tfs_stress.tar.zst" TFS_INDEX_SUFFIX);
+	remove("/tmp/tfs_stress.tar.zst" TFS_ZINDEX_SUFFIX);
+	return res;
+}
+#endif
+
+/* pax path and size, gnu long name, base-256 size */
+static int test_extended(void){
+	const char* tar = "/tmp/tfs_ext.tar";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	char longname[300], record[400], path[320];
+	memset(longname, 'n', sizeof(longname) - 1);
+	longname[sizeof(longname) - 1] = '\0';
+
+	/* the ustar size field is wrong on purpose, pax wins */
+	int body = snprintf(record, sizeof(record), "path=pax/%s\n", longname);
+	int len = body + 4;
+	len = snprintf(record, sizeof(record), "%d path=pax/%s\n", len, longname);
+	len += snprintf(record + len, sizeof(record) - len, "%d size=5\n", 10);
+	put_member(fp, "PaxHeaders/x", 'x', record, len);
+	char block[512] = {};
+	put_block(fp, "short", '0', 1, block);
+	memset(block, 0, sizeof(block));
+	memcpy(block, "hello", 5);
+	fwrite(block, 512, 1, fp);
+
+	snprintf(path, sizeof(path), "gnu/%s", longname);
+	put_member(fp, "././@LongLink", 'L', path, strlen(path) + 1);
+	put_member(fp, "truncated", '0', "world", 5);
+
+	memset(block, 0, sizeof(block));
+	block[124] = (char) 0x80;
+	block[135] = 3;
+	put_block(fp, "b256", '0', 3, block);
+	memset(block, 0, sizeof(block));
+	memcpy(block, "abc", 3);
+	fwrite(block, 512, 1, fp);
+	memset(block, 0, sizeof(block));
+	fwrite(block, 512, 1, fp);
+	fwrite(block, 512, 1, fp);
+	fclose(fp);
+
+	/* from the file, then from memory with the end found by walking the headers */
+	static char mem[8 << 10];
+	fp = fopen(tar, "rb");
+	if(!fp || fread(mem, 1, sizeof(mem), fp) == 0) return -1;
+	fclose(fp);
+	int res = 0;
+	const char* expect[][2] = { { "pax/", "hello" }, { "gnu/", "world" }, { "", "abc" } };
+	for(int walk = 0; walk < 2; ++walk){
+		if(walk) tfs_inittar(mem);
+		else tfs_inittarfile(tar);
+		for(int i = 0; i < 3; ++i){
+			snprintf(path, sizeof(path), "@/%s%s", expect[i][0], i < 2? longname: "b256");
+			char buf[16] = {};
+			fp = fopen(path, "rb");
+			if(!fp || fread(buf, 1, sizeof(buf), fp) != strlen(expect[i][1]) || strcmp(buf, expect[i][1]))
+				res = -1;
+			if(fp) fclose(fp);
+		}
+		tfs_deinit();
+	}
+	remove(tar);
+	return res;
+}
+
+#define DEEP_LEVELS 1500
+
+static void* deep_mount(void* arg){
+	tfs_inittarfile(arg);
+	return (void*) (intptr_t) (tfs_lookup("@/d/d/d") == TFS_ENTRY_NONE);
+}
+
+/* a pax path of many levels, every one an implicit directory, mounted on a small stack */
+static int test_deep(void){
+	const char* tar = "/tmp/tfs_deep.tar";
+	static char record[DEEP_LEVELS * 2 + 64], path[DEEP_LEVELS * 2 + 2];
+	for(int i = 0; i < DEEP_LEVELS; ++i) memcpy(path + 2 * i, "d/", 2);
+	path[2 * DEEP_LEVELS] = 'f';
+	path[2 * DEEP_LEVELS + 1] = '\0';
+	/* the length counts its own digits, a couple of rounds settle it */
+	int len = 0, was;
+	do{
+		was = len;
+		len = snprintf(record, sizeof(record), "%d path=%s\n", was, path);
+	}while(len != was);
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "PaxHeaders/f", 'x', record, len);
+	put_member(fp, "f", '0', "deep", 4);
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 << 10);
+	pthread_t thread;
+	void* failed = (void*) 1;
+	if(pthread_create(&thread, &attr, deep_mount, (void*) tar) == 0) pthread_join(thread, &failed);
+	pthread_attr_destroy(&attr);
+	char buf[8] = {}, name[sizeof(path) + 2];
+	snprintf(name, sizeof(name), "@/%s", path);
+	fp = failed? NULL: fopen(name, "r");
+	int res = fp && fread(buf, 1, sizeof(buf), fp) == 4 && !strcmp(buf, "deep")? 0: -1;
+	if(fp) fclose(fp);
+	tfs_deinit();
+	remove(tar);
+	return res;
+}
+
+/* a flipped checksum fails the mount and points at the header */
+static int test_corrupt(void){
+	const char* tar = "/tmp/tfs_corrupt.tar";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "good", '0', "fine", 4);
+	char block[512] = {};
+	put_block(fp, "bad", '0', 0, block);
+	fseek(fp, 1024 + 150, SEEK_SET);
+	fputc('7', fp);
+	fseek(fp, 0, SEEK_END);
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	errno = 0;
+	tfs_inittarfile_ex(tar, TFS_INIT_NOINDEX);
+	int res = errno == EBADMSG && tfs_corrupt_offset() == 1024 && tfs_lookup("@/good") == TFS_ENTRY_NONE? 0: -1;
+	tfs_deinit();
+	/* a buffer that is no tar at all stops the walk at once */
+	static char text[4096];
+	memset(text, 'x', sizeof(text));
+	errno = 0;
+	tfs_inittar(text);
+	if(errno != EBADMSG || tfs_corrupt_offset() != 0 || tfs_lookup("@/x") != TFS_ENTRY_NONE) res = -1;
+	tfs_deinit();
+	remove(tar);
+	return res;
+}
+
+/* bytes for reads, one for anything else */
+static void count_event(void* user, const struct tfs_trace_event* ev){
+	((int*) user)[ev->type] += ev->type == TFS_TRACE_READ? (int) ev->len: 1;
+}
+
+/* counters of test.tar, and their json */
+static int test_stats(void){
 	tfs_inittarfile("./test.tar");
+	tfs_stats_reset();
+	int events[4] = {};
+	int traced = tfs_trace(count_event, events) == 0;
+	char buf[64], *json = NULL;
+	size_t json_len = 0;
+	for(int i = 0; i < 3; ++i){
+		FILE* fp = fopen("@/root/minicom.log", "r");
+		if(!fp) return -1;
+		while(fread(buf, 1, 16, fp) > 0);
+		fseek(fp, 0, SEEK_SET);
+		fclose(fp);
+	}
+	if(fopen("@/root/none", "r") || fopen("@/root", "r")) return -1;
+	tfs_trace(NULL, NULL);
+
+	struct tfs_stats s;
+	struct tfs_member_stats m;
+	tfs_stats_snapshot(&s);
+	int res = 0;
+	if(s.opens != 3 || s.open_misses != 2 || s.closes != 3 || s.seeks != 3 || s.bytes_read != 3 * 35
+		|| s.reads != 3 * 3)
+		res = -1;
+	if(tfs_stats_member(tfs_lookup("@/root/minicom.log"), &m) != 0 || m.opens != 3 || m.bytes_read != 105
+		|| tfs_stats_member(tfs_lookup("@/root/usb-boot"), &m) != 0 || m.opens != 0)
+		res = -1;
+	if(traced && (events[TFS_TRACE_OPEN] != 5 || events[TFS_TRACE_READ] != 105 || events[TFS_TRACE_CLOSE] != 3))
+		res = -1;
+	FILE* out = open_memstream(&json, &json_len);
+	if(!out || tfs_stats_dump(out, 8) != 0) res = -1;
+	if(out) fclose(out);
+	if(!json || !strstr(json, "\"opens\":3,\"open_misses\":2,")
+		|| !strstr(json, "\"members\":[{\"path\":\"root/minicom.log\",\"opens\":3,\"reads\":9,\"bytes_read\":105}]}"))
+		res = -1;
+	free(json);
+	tfs_deinit();
+	return res;
+}
+
+/* line-oriented stdio on a TFS_INIT_COOKIE member */
+static int test_cookie(void){
+	const char* tar = "/tmp/tfs_cookie.tar";
+	const char text[] = "width 640\nheight 480\nname tfs\n";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "conf/view.cfg", '0', text, sizeof(text) - 1);
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	int res = 0;
+	for(int mapped = 0; mapped < 2 && res == 0; ++mapped){
+		tfs_inittarfile_ex(tar, TFS_INIT_COOKIE | (mapped? TFS_INIT_MMAP: 0));
+		fp = fopen("@/conf/view.cfg", "r");
+		if(!fp || IS_TFS_FILE(fp)){
+			res = -1;
+			break;
+		}
+		int width = 0, height = 0;
+		char name[16] = {}, line[32] = {};
+		char* dyn = NULL;
+		size_t cap = 0;
+		if(fscanf(fp, "width %d\n", &width) != 1 || width != 640) res = -1;
+		int c = fgetc(fp);
+		if(c != 'h' || ungetc(c, fp) != c || !fgets(line, sizeof(line), fp) || strcmp(line, "height 480\n"))
+			res = -1;
+		if(sscanf(line, "height %d", &height) != 1 || height != 480) res = -1;
+		if(getline(&dyn, &cap, fp) != 9 || strcmp(dyn, "name tfs\n") || sscanf(dyn, "name %15s", name) != 1)
+			res = -1;
+		if(fgetc(fp) != EOF || !feof(fp)) res = -1;
+		if(fseek(fp, -4, SEEK_END) != 0 || ftell(fp) != (long) sizeof(text) - 5
+			|| !fgets(line, sizeof(line), fp) || strcmp(line, "tfs\n"))
+			res = -1;
+		rewind(fp);
+		if(fread(line, 5, 1, fp) != 1 || memcmp(line, "width", 5)) res = -1;
+		free(dyn);
+		fclose(fp);
+		tfs_deinit();
+	}
+	remove(tar);
+	return res;
+}
+
+/* names under dir, sorted into out, -1 on error */
+static int list_dir(const char* dir, char* out, size_t size){
+	DIR* dp = opendir(dir);
+	if(!dp) return -1;
+	char names[16][NAME_MAX + 2];
+	int n = 0;
+	struct dirent* ent;
+	while((ent = readdir(dp)) && n < 16) snprintf(names[n++], sizeof(*names), "%s%s", ent->d_name,
+		ent->d_type == DT_DIR? "/": "");
+	closedir(dp);
+	qsort(names, n, sizeof(*names), (int (*)(const void*, const void*)) strcmp);
+	out[0] = '\0';
+	for(int i = 0; i < n; ++i) snprintf(out + strlen(out), size - strlen(out), "%s ", names[i]);
+	return n;
+}
+
+/* explicit, implicit and shadowed directory members */
+static int test_dirs(void){
+	const char* tar = "/tmp/tfs_dirs.tar";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "shaders/", '5', NULL, 0);
+	put_member(fp, "shaders/a.glsl", '0', "a", 1);
+	put_member(fp, "shaders/sub/deep/b.glsl", '0', "bb", 2);
+	put_member(fp, "./top", '0', "old", 3);
+	put_member(fp, "top", '0', "new!", 4);
+	put_member(fp, "link", '2', NULL, 0);
+	/* a basename no dirent can hold */
+	char longname[NAME_MAX + 16];
+	memset(longname, 'n', sizeof(longname) - 1);
+	longname[sizeof(longname) - 1] = '\0';
+	char path[sizeof(longname) + 16];
+	snprintf(path, sizeof(path), "shaders/%s", longname);
+	put_member(fp, "././@LongLink", 'L', path, strlen(path) + 1);
+	put_member(fp, "shaders/long", '0', "long", 4);
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	tfs_inittarfile(tar);
+	char list[256];
+	struct stat st;
+	int res = 0;
+	if(list_dir("@/", list, sizeof(list)) != 3 || strcmp(list, "link shaders/ top ")) res = -1;
+	if(list_dir("@/shaders", list, sizeof(list)) != 2 || strcmp(list, "a.glsl sub/ ")) res = -1;
+	snprintf(path, sizeof(path), "@/shaders/%s", longname);
+	if(stat(path, &st) != 0 || st.st_size != 4) res = -1;
+	if(list_dir("@/shaders/sub/", list, sizeof(list)) != 1 || strcmp(list, "deep/ ")) res = -1;
+	if(opendir("@/top") || opendir("@/none")) res = -1;
+	if(stat("@/top", &st) != 0 || !S_ISREG(st.st_mode) || st.st_size != 4) res = -1;
+	if(stat("@/shaders/sub/deep", &st) != 0 || !S_ISDIR(st.st_mode)) res = -1;
+	if(stat("@/link", &st) != 0 || !S_ISLNK(st.st_mode)) res = -1;
+	if(stat("@/", &st) != 0 || !S_ISDIR(st.st_mode) || stat("@/none", &st) == 0) res = -1;
+	/* everything else still reaches the real functions */
+	DIR* dp = opendir(".");
+	if(!dp || !readdir(dp) || closedir(dp) != 0 || stat(tar, &st) != 0) res = -1;
+	tfs_deinit();
+	remove(tar);
+	return res;
+}
+
+/* name and contents pairs, up to NULL */
+static int write_tar(const char* path, const char* const* members){
+	FILE* fp = fopen(path, "wb");
+	if(!fp) return -1;
+	for(; *members; members += 2) put_member(fp, members[0], '0', members[1], strlen(members[1]));
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	return fclose(fp);
+}
+
+static int read_member(const char* path, char* out, size_t size){
+	FILE* fp = fopen(path, "r");
+	if(!fp) return -1;
+	size_t n = fread(out, 1, size - 1, fp);
+	out[n] = '\0';
+	fclose(fp);
+	return 0;
+}
+
+static void put_link(FILE* fp, const char* name, char type, const char* target){
+	char block[512] = {};
+	snprintf(block + 157, 100, "%s", target);
+	put_block(fp, name, type, 0, block);
+}
+
+/* hard and symbolic links, relative, absolute, chained, through directories and in loops */
+static int test_links(void){
+	const char* tar = "/tmp/tfs_links.tar";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "data/file", '0', "content", 7);
+	put_link(fp, "data/hard", '1', "data/file");
+	put_link(fp, "rel", '2', "data/file");
+	put_link(fp, "data/up", '2', "../rel");
+	put_link(fp, "abs", '2', "/data/file");
+	put_link(fp, "dirlink", '2', "data");
+	put_link(fp, "loop1", '2', "loop2");
+	put_link(fp, "loop2", '2', "./loop1");
+	put_link(fp, "dangling", '2', "nowhere");
+	/* hard links bind to the member of that name before them, not the last one */
+	put_member(fp, "ver", '0', "one", 3);
+	put_link(fp, "early", '1', "ver");
+	put_member(fp, "ver", '0', "two!", 4);
+	put_link(fp, "late", '1', "ver");
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	tfs_inittarfile_ex(tar, TFS_INIT_NOINDEX);
+	int res = 0;
+	char buf[32], list[256];
+	const char* same[] = { "@/data/hard", "@/rel", "@/data/up", "@/abs", "@/dirlink/file", "@/dirlink/up" };
+	for(size_t i = 0; i < sizeof(same) / sizeof(*same); ++i){
+		if(read_member(same[i], buf, sizeof(buf)) || strcmp(buf, "content")
+			|| tfs_lookup(same[i]) != tfs_lookup("@/data/file"))
+			res = -1;
+	}
+	if(read_member("@/early", buf, sizeof(buf)) || strcmp(buf, "one")
+		|| read_member("@/late", buf, sizeof(buf)) || strcmp(buf, "two!")
+		|| read_member("@/ver", buf, sizeof(buf)) || strcmp(buf, "two!"))
+		res = -1;
+	struct stat early;
+	if(stat("@/early", &early) || early.st_size != 3) res = -1;
+	if(fopen("@/loop1", "r") || errno != ELOOP || fopen("@/dangling", "r") || errno != ENOENT
+		|| fopen("@/dirlink/none", "r") || errno != ENOENT)
+		res = -1;
+	if(list_dir("@/dirlink", list, sizeof(list)) != 3 || strcmp(list, "file hard up ")) res = -1;
+	struct stat st, file;
+	if(stat("@/rel", &st) || !S_ISLNK(st.st_mode) || stat("@/data/file", &file)) res = -1;
+	if(stat("@/data/hard", &st) || !S_ISREG(st.st_mode) || st.st_size != 7 || st.st_ino != file.st_ino) res = -1;
+	/* ids from readdir name the links themselves, batches read what they point to */
+	const char* names[] = { "rel", "abs", "dirlink", "loop1", "dangling" };
+	const int errors[] = { 0, 0, EISDIR, ELOOP, ENOENT };
+	char dest[5][8] = {};
+	tfs_req reqs[5] = {};
+	DIR* dp = opendir("@/");
+	struct dirent* ent;
+	while(dp && (ent = readdir(dp))){
+		for(int i = 0; i < 5; ++i){
+			if(!strcmp(ent->d_name, names[i])) reqs[i] = (tfs_req){ .id = ent->d_ino - 1, .len = 8, .dest = dest[i] };
+		}
+	}
+	if(dp) closedir(dp);
+	if(tfs_readbatch(reqs, 5) != 3) res = -1;
+	for(int i = 0; i < 5; ++i){
+		if(reqs[i].error != errors[i] || (!errors[i] && (reqs[i].result != 7 || memcmp(dest[i], "content", 7)))) res = -1;
+	}
+	/* and so do reads without blocking */
+	static struct aio_check check;
+	check = (struct aio_check){};
+	for(int i = 0; i < 5; ++i){
+		int rc = tfs_read_async(reqs[i].id, 0, check.buf, 8, aio_done, &check);
+		if(errors[i]? rc != -1 || errno != errors[i]: rc != 0) res = -1;
+	}
+	while(res == 0 && check.calls < 2 && tfs_aio_reap(1) > 0);
+	if(check.calls != 2 || check.result != 7 || memcmp(check.buf, "content", 7)) res = -1;
+	tfs_aio_deinit();
+	tfs_deinit();
+	remove(tar);
+	return res;
+}
+
+/* packed with aligned data and in the order of a trace, then packed again unchanged */
+static int test_pack(void){
+	const char* tar = "/tmp/tfs_pack.tar", * packed = "/tmp/tfs_pack_out.tar", * order = "/tmp/tfs_pack.order";
+	static char big[9000];
+	memset(big, 'b', sizeof(big));
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "a", '0', big, 5000);
+	put_member(fp, "dir/small", '0', "small", 5);
+	put_member(fp, "c", '0', big, sizeof(big));
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+	fp = fopen(order, "w");
+	if(!fp) return -1;
+	fputs("@/c\ndir/small\nnone\n", fp);
+	fclose(fp);
+
+	struct tfs_pack_opts opts = { .align = 4096, .min_size = 1, .order = order };
+	if(tfs_pack(tar, packed, &opts) != 0) return -1;
+	tfs_inittarfile_ex(packed, TFS_INIT_MMAP);
+	const char* names[] = { "@/c", "@/dir/small", "@/a" };
+	const void* data[3] = {};
+	int res = 0;
+	for(int i = 0; i < 3 && res == 0; ++i){
+		size_t len = 0;
+		fp = fopen(names[i], "r");
+		if(!fp || tfs_getdata(fp, &data[i], &len) != 0 || ((uintptr_t) data[i] & 4095)
+			|| (i && data[i] <= data[i - 1]) || memcmp(data[i], i == 1? "small": big, len)) res = -1;
+		if(fp) fclose(fp);
+	}
+	tfs_deinit();
+	/* padding is dropped before padding again */
+	struct stat a, b;
+	if(res == 0 && (tfs_pack(packed, tar, &opts) != 0 || stat(tar, &a) != 0 || stat(packed, &b) != 0
+		|| a.st_size != b.st_size)) res = -1;
+	opts.align = 1000;
+	if(res == 0 && (tfs_pack(tar, packed, &opts) == 0 || errno != EINVAL)) res = -1;
+
+	/* padding of megabytes stays out of a member's own pax header, which readers skip past 1 MiB */
+	char longpath[128], records[256], path[140];
+	memset(longpath, 'p', 125);
+	longpath[125] = '\0';
+	int len = 0, was;
+	do{
+		was = len;
+		len = snprintf(records, sizeof(records), "%d path=%s\n", was, longpath);
+	}while(len != was);
+	fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "a", '0', big, 5000);
+	put_member(fp, "././@PaxHeader", 'x', records, len);
+	put_member(fp, "short", '0', big, sizeof(big));
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+	opts = (struct tfs_pack_opts){ .align = 2 << 20, .min_size = 1 };
+	snprintf(path, sizeof(path), "@/%s", longpath);
+	for(int pass = 0; pass < 2 && res == 0; ++pass){
+		if(tfs_pack(pass? packed: tar, pass? tar: packed, &opts) != 0) res = -1;
+		tfs_inittarfile_ex(pass? tar: packed, TFS_INIT_MMAP);
+		const void* at = NULL;
+		size_t got = 0;
+		fp = fopen(path, "r");
+		if(!fp || tfs_getdata(fp, &at, &got) != 0 || ((uintptr_t) at & ((2 << 20) - 1)) || got != sizeof(big)
+			|| memcmp(at, big, got) || tfs_lookup("@/short") != TFS_ENTRY_NONE)
+			res = -1;
+		if(fp) fclose(fp);
+		tfs_deinit();
+	}
+	if(res == 0 && (stat(tar, &a) != 0 || stat(packed, &b) != 0 || a.st_size != b.st_size)) res = -1;
+	remove(tar);
+	remove(packed);
+	remove(order);
+	return res;
+}
+
+/* the file through a pipe in odd pieces; every other member is read, the rest skipped */
+static int stream_pipe(const char* path){
+	int fds[2];
+	if(pipe(fds) != 0) return -1;
+	pid_t pid = fork();
+	if(pid == 0){
+		close(fds[0]);
+		FILE* in = fopen(path, "rb");
+		char piece[1000];
+		size_t n;
+		while(in && (n = fread(piece, 1, sizeof(piece), in)) > 0)
+			if(write(fds[1], piece, n) != (ssize_t) n) _exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	FILE* fp = fdopen(fds[0], "rb");
+	struct tfs_stream* s = fp? tfs_stream_open(fp): NULL;
+	struct tfs_stream_entry e;
+	static unsigned char data[70000];
+	char name[32];
+	int i = 0, res = s? 0: -1, more;
+	while(res == 0 && (more = tfs_stream_next(s, &e)) == 1){
+		snprintf(name, sizeof(name), "stress/%d", i);
+		if(strcmp(e.path, name) || e.size != stress_size(i) || e.type != '0' || e.mode != 0644) res = -1;
+		/* small reads come from the buffer, large ones go around it */
+		size_t got = 0, step = i % 4 == 0? 777: sizeof(data);
+		ssize_t n;
+		while(i % 2 == 0 && res == 0 && (n = tfs_stream_read(s, data + got, step)) > 0) got += n;
+		for(size_t pos = 0; i % 2 == 0 && pos < e.size; ++pos)
+			if(data[pos] != stress_byte(i, pos)) res = -1;
+		if(i % 2 == 0 && got != e.size) res = -1;
+		++i;
+	}
+	if(res == 0 && (more != 0 || i != STRESS_MEMBERS || tfs_stream_next(s, &e) != 0)) res = -1;
+	tfs_stream_close(s);
+	if(fp) fclose(fp);
+	else close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	return res;
+}
+
+static int test_stream(void){
+	const char* tar = "/tmp/tfs_stream.tar";
+	if(make_stress_tar(tar) != 0) return -1;
+	int res = stream_pipe(tar);
+#ifdef TFS_WITH_ZLIB
+	const char* tgz = "/tmp/tfs_stream.tar.gz";
+	static char buf[4 << 20];
+	FILE* in = fopen(tar, "rb");
+	size_t len = in? fread(buf, 1, sizeof(buf), in): 0;
+	if(in) fclose(in);
+	gzFile gz = gzopen(tgz, "wb");
+	if(!gz || gzwrite(gz, buf, len) <= 0) res = -1;
+	if(gz) gzclose(gz);
+	if(res == 0) res = stream_pipe(tgz);
+	remove(tgz);
+#endif
+	/* a member is handed out while the rest of the upload is still on its way */
+	int fds[2], go[2];
+	pid_t pid = res == 0 && pipe(fds) == 0 && pipe(go) == 0? fork(): -1;
+	if(pid == 0){
+		close(fds[0]);
+		close(go[1]);
+		FILE* out = fdopen(fds[1], "wb");
+		put_member(out, "first", '0', "early", 5);
+		fflush(out);
+		/* the end only once the reader has the first member, or after it gave up */
+		struct pollfd pfd = { go[0], POLLIN, 0 };
+		int waited = poll(&pfd, 1, 5000) == 1;
+		put_member(out, "second", '0', "late", 4);
+		char zero[1024] = {};
+		fwrite(zero, sizeof(zero), 1, out);
+		fclose(out);
+		_exit(!waited);
+	}
+	if(pid > 0){
+		close(fds[1]);
+		close(go[0]);
+		FILE* fp = fdopen(fds[0], "rb");
+		struct tfs_stream* s = fp? tfs_stream_open(fp): NULL;
+		struct tfs_stream_entry e;
+		char data[8] = {};
+		if(!s || tfs_stream_next(s, &e) != 1 || strcmp(e.path, "first")
+			|| tfs_stream_read(s, data, sizeof(data)) != 5 || memcmp(data, "early", 5)) res = -1;
+		if(write(go[1], "", 1) != 1) res = -1;
+		if(!s || tfs_stream_next(s, &e) != 1 || strcmp(e.path, "second") || tfs_stream_next(s, &e) != 0) res = -1;
+		tfs_stream_close(s);
+		if(fp) fclose(fp);
+		close(go[1]);
+		int status = -1;
+		if(waitpid(pid, &status, 0) != pid || status != 0) res = -1;
+	}else if(res == 0) res = -1;
+	/* cut off inside a member */
+	if(res == 0 && truncate(tar, 40000) == 0){
+		FILE* fp = fopen(tar, "rb");
+		struct tfs_stream* s = fp? tfs_stream_open(fp): NULL;
+		struct tfs_stream_entry e;
+		int more;
+		while(s && (more = tfs_stream_next(s, &e)) == 1);
+		if(!s || more != -1 || errno != EBADMSG) res = -1;
+		tfs_stream_close(s);
+		if(fp) fclose(fp);
+	}
+	remove(tar);
+	return res;
+}
+
+#define PAR_BIG (9 << 20)
+
+struct par_check {
+	atomic_ullong bytes;
+	atomic_int bad;
+};
+
+static int par_even(void* user, tfs_entry_id id, const char* path){
+	(void) user;
+	(void) id;
+	return strncmp(path, "stress/", 7) || atoi(path + 7) % 2 == 0;
+}
+
+static int par_visit(void* user, const tfs_chunk* c){
+	struct par_check* check = user;
+	int i = strcmp(c->path, "big")? atoi(c->path + 7): 99;
+	for(size_t k = 0; k < c->len; ++k)
+		if(((const unsigned char*) c->data)[k] != stress_byte(i, c->offset + k)) atomic_fetch_add(&check->bad, 1);
+	if(c->size != (i == 99? PAR_BIG: stress_size(i))) atomic_fetch_add(&check->bad, 1);
+	atomic_fetch_add(&check->bytes, c->len);
+	return 0;
+}
+
+static int par_stop(void* user, const tfs_chunk* c){
+	(void) user;
+	(void) c;
+	return 7;
+}
+
+/* the stress members plus one split into pieces, visited then extracted with links */
+static int test_parallel(void){
+	const char* tar = "/tmp/tfs_par.tar", * dest = "/tmp/tfs_par_out";
+	FILE* fp = fopen(tar, "wb");
+	static unsigned char data[PAR_BIG];
+	char name[32];
+	if(!fp) return -1;
+	uint64_t all = 0, even = 0;
+	for(int i = 0; i < STRESS_MEMBERS; ++i){
+		size_t size = stress_size(i);
+		for(size_t pos = 0; pos < size; ++pos) data[pos] = stress_byte(i, pos);
+		snprintf(name, sizeof(name), "stress/%d", i);
+		put_member(fp, name, '0', (const char*) data, size);
+		all += size;
+		if(i % 2 == 0) even += size;
+	}
+	for(size_t pos = 0; pos < PAR_BIG; ++pos) data[pos] = stress_byte(99, pos);
+	put_member(fp, "big", '0', (const char*) data, PAR_BIG);
+	put_member(fp, "empty/", '5', NULL, 0);
+	put_link(fp, "stress/sym", '2', "../big");
+	put_link(fp, "hard", '1', "stress/3");
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	int res = 0;
+	for(int mapped = 0; mapped < 2 && res == 0; ++mapped){
+		tfs_inittarfile_ex(tar, mapped? TFS_INIT_MMAP: 0);
+		struct par_check check = {};
+		if(tfs_foreach_parallel(NULL, par_visit, &check, 4) != 0 || check.bytes != all + PAR_BIG || check.bad) res = -1;
+		check = (struct par_check){};
+		if(tfs_foreach_parallel(par_even, par_visit, &check, 0) != 0 || check.bytes != even + PAR_BIG || check.bad) res = -1;
+		if(tfs_foreach_parallel(NULL, par_stop, NULL, 3) != 7) res = -1;
+		if(!mapped && tfs_extract(dest, 4) != 0) res = -1;
+		tfs_deinit();
+	}
+
+	char link[64];
+	struct stat st, hard;
+	FILE* big = fopen("/tmp/tfs_par_out/big", "rb");
+	size_t got = big? fread(data, 1, sizeof(data), big): 0;
+	if(big) fclose(big);
+	ssize_t n = readlink("/tmp/tfs_par_out/stress/sym", link, sizeof(link) - 1);
+	if(res == 0 && (got != PAR_BIG || data[PAR_BIG - 1] != stress_byte(99, PAR_BIG - 1)
+		|| stat("/tmp/tfs_par_out/stress/5", &st) != 0 || (size_t) st.st_size != stress_size(5)
+		|| n != 6 || memcmp(link, "../big", 6)
+		|| stat("/tmp/tfs_par_out/hard", &hard) != 0 || stat("/tmp/tfs_par_out/stress/3", &st) != 0 || hard.st_ino != st.st_ino
+		|| stat("/tmp/tfs_par_out/empty", &st) != 0 || !S_ISDIR(st.st_mode))) res = -1;
+	for(int i = 0; i < STRESS_MEMBERS; ++i){
+		snprintf(name, sizeof(name), "%s/stress/%d", dest, i);
+		remove(name);
+	}
+	remove("/tmp/tfs_par_out/stress/sym");
+	remove("/tmp/tfs_par_out/stress");
+	remove("/tmp/tfs_par_out/big");
+	remove("/tmp/tfs_par_out/hard");
+	remove("/tmp/tfs_par_out/empty");
+	remove(dest);
+	remove(tar);
+	return res;
+}
+
+static int par_count(void* user, const tfs_chunk* c){
+	atomic_fetch_add((atomic_ullong*) user, c->len);
+	return 0;
+}
+
+/* only the copy a path opens is visited and extracted, in one tar and across stacked ones */
+static int test_parallel_shadow(void){
+	const char* tar = "/tmp/tfs_par_dup.tar", * dest = "/tmp/tfs_par_dup";
+	static char big[6000000];
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "f", '0', big, sizeof(big));
+	put_member(fp, "f", '0', "last", 4);
+	put_link(fp, "g", '2', "f");
+	put_member(fp, "g", '0', "file", 4);
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	int res = 0;
+	char buf[16];
+	struct stat st;
+	atomic_ullong bytes = 0;
+	tfs_inittarfile(tar);
+	if(tfs_foreach_parallel(NULL, par_count, &bytes, 4) != 0 || bytes != 8) res = -1;
+	if(tfs_extract(dest, 4) != 0) res = -1;
+	tfs_deinit();
+	if(stat("/tmp/tfs_par_dup/f", &st) != 0 || st.st_size != 4
+		|| lstat("/tmp/tfs_par_dup/g", &st) != 0 || !S_ISREG(st.st_mode)
+		|| read_member("/tmp/tfs_par_dup/g", buf, sizeof(buf)) || strcmp(buf, "file"))
+		res = -1;
+	remove("/tmp/tfs_par_dup/f");
+	remove("/tmp/tfs_par_dup/g");
+	remove(tar);
+
+	const char* base[] = { "a.txt", "base", "b.txt", "only-base", NULL };
+	const char* patch[] = { "a.txt", "patch", NULL };
+	if(write_tar("/tmp/tfs_par_base.tar", base) || write_tar("/tmp/tfs_par_patch.tar", patch)) res = -1;
+	bytes = 0;
+	if(tfs_mount("/tmp/tfs_par_base.tar", NULL, 0) || tfs_mount("/tmp/tfs_par_patch.tar", NULL, 10)
+		|| tfs_foreach_parallel(NULL, par_count, &bytes, 2) != 0 || bytes != 5 + 9
+		|| tfs_extract(dest, 2) != 0)
+		res = -1;
+	tfs_deinit();
+	if(read_member("/tmp/tfs_par_dup/a.txt", buf, sizeof(buf)) || strcmp(buf, "patch")
+		|| read_member("/tmp/tfs_par_dup/b.txt", buf, sizeof(buf)) || strcmp(buf, "only-base"))
+		res = -1;
+	remove("/tmp/tfs_par_dup/a.txt");
+	remove("/tmp/tfs_par_dup/b.txt");
+	remove("/tmp/tfs_par_base.tar");
+	remove("/tmp/tfs_par_patch.tar");
+	remove(dest);
+	return res;
+}
+
+/* base, patches over it by priority and a tar under a directory */
+static int test_mounts(void){
+	const char* base[] = { "a.txt", "base", "shared/x", "base-x", "only-base", "1", NULL };
+	const char* patch[] = { "a.txt", "patch", "shared/y", "patch-y", NULL };
+	const char* mid[] = { "a.txt", "mid", NULL };
+	const char* mods[] = { "m.txt", "mod", NULL };
+	if(write_tar("/tmp/tfs_base.tar", base) || write_tar("/tmp/tfs_patch.tar", patch)
+		|| write_tar("/tmp/tfs_mid.tar", mid) || write_tar("/tmp/tfs_mods.tar", mods))
+		return -1;
+	int res = 0;
+	char buf[32], list[256];
+	if(tfs_mount("/tmp/tfs_base.tar", NULL, 0) || tfs_mount("/tmp/tfs_patch.tar", "/", 10)
+		|| tfs_mount("/tmp/tfs_mid.tar", "@/", 5) || tfs_mount_ex("/tmp/tfs_mods.tar", "@/mods", 0, TFS_INIT_MMAP))
+		res = -1;
+	if(read_member("@/a.txt", buf, sizeof(buf)) || strcmp(buf, "patch")) res = -1;
+	if(read_member("@/shared/x", buf, sizeof(buf)) || strcmp(buf, "base-x")) res = -1;
+	if(read_member("@/mods/m.txt", buf, sizeof(buf)) || strcmp(buf, "mod")) res = -1;
+	if(tfs_lookup("@/m.txt") != TFS_ENTRY_NONE || tfs_lookup("@/none") != TFS_ENTRY_NONE) res = -1;
+	if(list_dir("@/", list, sizeof(list)) != 4 || strcmp(list, "a.txt mods/ only-base shared/ ")) res = -1;
+	if(list_dir("@/shared", list, sizeof(list)) != 2 || strcmp(list, "x y ")) res = -1;
+
+	tfs_req reqs[2] = { { .path = "@/only-base", .len = 8, .dest = buf }, { .path = "@/mods/m.txt", .len = 8, .dest = buf + 8 } };
+	if(tfs_readbatch(reqs, 2) != 0 || reqs[0].result != 1 || reqs[1].result != 3 || memcmp(buf, "1", 1)
+		|| memcmp(buf + 8, "mod", 3))
+		res = -1;
+
+	/* an open handle keeps reading the tar it came from */
+	FILE* fp = fopen("@/a.txt", "r");
+	if(tfs_unmount("/tmp/tfs_patch.tar") || tfs_unmount("/tmp/tfs_patch.tar") != -1 || errno != ENOENT) res = -1;
+	if(read_member("@/a.txt", buf, sizeof(buf)) || strcmp(buf, "mid") || tfs_lookup("@/shared/y") != TFS_ENTRY_NONE)
+		res = -1;
+	memset(buf, 0, sizeof(buf));
+	if(!fp || fread(buf, 1, sizeof(buf), fp) != 5 || strcmp(buf, "patch")) res = -1;
+	if(fp) fclose(fp);
+	tfs_deinit();
+	if(tfs_lookup("@/a.txt") != TFS_ENTRY_NONE) res = -1;
+	remove("/tmp/tfs_base.tar");
+	remove("/tmp/tfs_patch.tar");
+	remove("/tmp/tfs_mid.tar");
+	remove("/tmp/tfs_mods.tar");
+	return res;
+}
+
+/* a one member tar written aside and renamed over path, as a deploy would */
+static int replace_tar(const char* path, const char* text){
+	char tmp[64];
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	FILE* fp = fopen(tmp, "wb");
+	if(!fp) return -1;
+	put_member(fp, "version", '0', text, strlen(text));
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+	return rename(tmp, path);
+}
+
+static int read_version(char* out, size_t size){
+	FILE* fp = fopen("@/version", "r");
+	if(!fp) return -1;
+	size_t n = fread(out, 1, size - 1, fp);
+	out[n] = '\0';
+	fclose(fp);
+	return 0;
+}
+
+static atomic_int reload_stop;
+
+static void* reload_reader(void* arg){
+	(void) arg;
+	char buf[16];
+	while(!atomic_load(&reload_stop)){
+		if(read_version(buf, sizeof(buf)) != 0 || buf[0] != 'v' || tfs_lookup("@/version") == TFS_ENTRY_NONE)
+			return (void*) 1;
+	}
+	return NULL;
+}
+
+/* a second process maps the index the first one shared, rather than scanning and sharing again */
+static int test_shared(void){
+	const char* tar = "/tmp/tfs_shared.tar";
+	if(make_stress_tar(tar) != 0) return -1;
+	glob_t before = {}, after = {};
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), TFS_SHARED_DIR "/tfs-%ld/*" TFS_INDEX_SUFFIX, (long) geteuid());
+	glob(pattern, 0, NULL, &before);
+	tfs_inittarfile_ex(tar, TFS_INIT_SHARED);
+	glob(pattern, 0, NULL, &after);
+	const char* shared = NULL;
+	for(size_t i = 0; i < after.gl_pathc; ++i){
+		int known = 0;
+		for(size_t k = 0; k < before.gl_pathc; ++k) known |= !strcmp(after.gl_pathv[i], before.gl_pathv[k]);
+		if(!known) shared = after.gl_pathv[i];
+	}
+	struct stat st = {}, again = {};
+	int res = shared && stat(shared, &st) == 0 && (st.st_mode & 0777) == 0600
+		&& tfs_lookup("@/stress/3") != TFS_ENTRY_NONE? 0: -1;
+	tfs_deinit();
+	pid_t pid = res == 0? fork(): -1;
+	if(pid == 0){
+		tfs_inittarfile_ex(tar, TFS_INIT_SHARED);
+		char buf[32];
+		_exit(read_member("@/stress/3", buf, sizeof(buf)) != 0 || (unsigned char) buf[5] != stress_byte(3, 5));
+	}
+	int status = -1;
+	if(pid < 0 || waitpid(pid, &status, 0) != pid || status != 0
+		|| stat(shared, &again) != 0 || again.st_ino != st.st_ino) res = -1;
+	/* one anyone may write to is not trusted, the tar is scanned and shared again */
+	if(res == 0 && chmod(shared, 0666) == 0){
+		tfs_inittarfile_ex(tar, TFS_INIT_SHARED);
+		if(tfs_lookup("@/stress/3") == TFS_ENTRY_NONE || stat(shared, &again) != 0
+			|| again.st_ino == st.st_ino || (again.st_mode & 0777) != 0600)
+			res = -1;
+		tfs_deinit();
+	}
+	if(shared) remove(shared);
+	globfree(&before);
+	globfree(&after);
+	remove(tar);
+	return res;
+}
+
+/* run as tfs-test preload under the shim: the calls cat does not make */
+static int preload_child(void){
+	char a[4] = {}, b[8] = {}, line[16] = {};
+	struct iovec iov[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+	int fd = open("/tfs-preload/dir/file", O_RDONLY);
+	if(fd < 0 || readv(fd, iov, 2) != 9 || memcmp(a, "prel", 4) || memcmp(b, "oaded", 5)) return 1;
+	if(preadv(fd, iov + 1, 1, 3) != 6 || memcmp(b, "loaded", 6)) return 2;
+	/* a copy the shim does not know fails rather than read as empty */
+	int copy = dup(fd);
+	if(copy < 0 || read(copy, line, sizeof(line)) != -1 || errno != EBADF) return 3;
+	close(copy);
+	lseek(fd, 0, SEEK_SET);
+	FILE* fp = fdopen(fd, "r");
+	if(!fp || !fgets(line, sizeof(line), fp) || strcmp(line, "preloaded")) return 4;
+	fclose(fp);
+	return 0;
+}
+
+/* a program that knows nothing of tfs, reading members through the preload shim */
+static int test_preload(void){
+	const char* tar = "/tmp/tfs_preload.tar";
+	FILE* fp = fopen(tar, "wb");
+	if(!fp) return -1;
+	put_member(fp, "dir/file", '0', "preloaded", 9);
+	put_link(fp, "link", '2', "dir/file");
+	char zero[1024] = {};
+	fwrite(zero, sizeof(zero), 1, fp);
+	fclose(fp);
+
+	char shim[4096 + 16] = "LD_PRELOAD=";
+	if(!realpath("libtfs_preload.so", shim + strlen(shim))) return -1;
+	char* env[] = { shim, "TFS_PRELOAD=/tfs-preload=/tmp/tfs_preload.tar", NULL };
+	int fds[2];
+	if(pipe(fds) != 0) return -1;
+	pid_t pid = fork();
+	if(pid == 0){
+		dup2(fds[1], 1);
+		execle("/bin/cat", "cat", "/tfs-preload/dir/file", "/tfs-preload/link", (char*) NULL, env);
+		_exit(127);
+	}
+	close(fds[1]);
+	char out[64] = {};
+	size_t n = 0;
+	ssize_t got;
+	while(n < sizeof(out) - 1 && (got = read(fds[0], out + n, sizeof(out) - 1 - n)) > 0) n += got;
+	close(fds[0]);
+	int status = -1;
+	if(pid > 0) waitpid(pid, &status, 0);
+	int res = status == 0 && !strcmp(out, "preloadedpreloaded")? 0: -1;
+	pid = res == 0? fork(): -1;
+	if(pid == 0){
+		execle("/proc/self/exe", "tfs-test", "preload", (char*) NULL, env);
+		_exit(127);
+	}
+	status = -1;
+	if(pid > 0) waitpid(pid, &status, 0);
+	if(status != 0) res = -1;
+	remove(tar);
+	return res;
+}
+
+/* open handles keep their generation across tfs_reload, new opens see the new one */
+static int test_reload(void){
+	const char* tar = "/tmp/tfs_reload.tar";
+	if(replace_tar(tar, "v1") != 0) return -1;
+	tfs_inittarfile(tar);
+	FILE* old = fopen("@/version", "r");
+	char buf[16] = {};
+	int res = 0;
+	if(!old || replace_tar(tar, "v2 longer") != 0 || tfs_reload() != 0) res = -1;
+	if(res == 0 && (read_version(buf, sizeof(buf)) != 0 || strcmp(buf, "v2 longer"))) res = -1;
+	if(old && (fread(buf, 1, sizeof(buf), old) != 2 || memcmp(buf, "v1", 2))) res = -1;
+	if(old) fclose(old);
+
+	/* readers never block or fail while generations come and go */
+	pthread_t tid[4];
+	atomic_store(&reload_stop, 0);
+	for(int i = 0; i < 4; ++i) pthread_create(&tid[i], NULL, reload_reader, NULL);
+	for(int i = 0; i < 200 && res == 0; ++i){
+		snprintf(buf, sizeof(buf), "v%d", i + 3);
+		if(replace_tar(tar, buf) != 0 || tfs_reload() != 0) res = -1;
+	}
+	atomic_store(&reload_stop, 1);
+	for(int i = 0; i < 4; ++i){
+		void* ret;
+		pthread_join(tid[i], &ret);
+		if(ret) res = -1;
+	}
+
+	/* the watcher picks up a rename without being asked */
+	if(res == 0 && (tfs_watch() != 0 || replace_tar(tar, "watched") != 0)) res = -1;
+	for(int i = 0; i < 100 && res == 0; ++i){
+		if(read_version(buf, sizeof(buf)) == 0 && !strcmp(buf, "watched")) break;
+		usleep(20000);
+	}
+	if(strcmp(buf, "watched")) res = -1;
+	tfs_deinit();
+	if(tfs_reload() == 0 || fopen("@/version", "r")) res = -1;
+	remove(tar);
+	return res;
+}
+
+int main(int argc, char** argv){
+	if(argc > 1 && !strcmp(argv[1], "preload")) return preload_child();
+	if(argc > 1 && !strcmp(argv[1], "aio-nothreads")) return aio_nothreads_child();
+	tfs_inittarfile("./test.tar");
+	if(tfs_lookup("@/root//./usb-boot") == TFS_ENTRY_NONE || tfs_lookup("@/root/none") != TFS_ENTRY_NONE){
+		puts("lookup error");
+		return 1;
+	}
 	FILE* fp = fopen("@/root/minicom.log", "r");
 	if(!fp){
 		puts("fopen error");
@@ -14,6 +1445,148 @@ int main(void){
 	printf("count = %d, size = %ld\n", count, ((TFS_FILE*)fp)->data_len);
 	puts(buf);
 	fclose(fp);
+	/* by id, over and over: handles come back from the thread's cache */
+	tfs_entry_id id = tfs_lookup("@/root/minicom.log");
+	for(int i = 0; i < 100; ++i){
+		char ibuf[64] = {};
+		fp = tfs_open_entry(id);
+		if(!fp || fread(ibuf, 1, sizeof(ibuf), fp) != 35 || memcmp(ibuf, buf, 35)){
+			puts("open by id error");
+			return 1;
+		}
+		fclose(fp);
+	}
+	if(tfs_open_entry(TFS_ENTRY_NONE) || tfs_open_entry(1 << 30) || errno != ENOENT
+		|| tfs_open_entry(tfs_lookup("@/root")) || errno != EISDIR){
+		puts("open by id error");
+		return 1;
+	}
+	char list[64];
+	if(list_dir("@/root", list, sizeof(list)) != 2 || strcmp(list, "minicom.log usb-boot ")){
+		puts("readdir error");
+		return 1;
+	}
+	tfs_deinit();
+
+	tfs_inittarfile_ex("./test.tar", TFS_INIT_MMAP);
+	fp = fopen("@/root/minicom.log", "r");
+	const void* data = NULL;
+	size_t len = 0;
+	char mbuf[64] = {};
+	if(!fp || tfs_getdata(fp, &data, &len) != 0 || len != 35
+		|| fread(mbuf, 1, sizeof(mbuf), fp) != len || memcmp(mbuf, data, len) || memcmp(mbuf, buf, len)){
+		puts("mmap error");
+		return 1;
+	}
+	fclose(fp);
 	tfs_deinit();
+
+	/* the same tar from memory, both with and without its length */
+	static char tarbuf[16 << 10];
+	FILE* tfp = fopen("./test.tar", "rb");
+	size_t tarlen = tfp? fread(tarbuf, 1, sizeof(tarbuf), tfp): 0;
+	if(tfp) fclose(tfp);
+	for(int walk = 0; walk < 2; ++walk){
+		if(walk) tfs_inittar(tarbuf);
+		else tfs_inittarmem(tarbuf, tarlen, 0);
+		memset(mbuf, 0, sizeof(mbuf));
+		fp = fopen("@/root/minicom.log", "r");
+		if(!fp || tfs_getdata(fp, &data, &len) != 0 || data < (void*) tarbuf || data >= (void*) (tarbuf + tarlen)
+			|| fread(mbuf, 1, sizeof(mbuf), fp) != 35 || memcmp(mbuf, buf, 35)){
+			puts("memory error");
+			return 1;
+		}
+		fclose(fp);
+	}
+	tfs_deinit();
+
+	if(test_stats() != 0){
+		puts("stats error");
+		return 1;
+	}
+	if(test_corrupt() != 0){
+		puts("corrupt header error");
+		return 1;
+	}
+	if(test_extended() != 0){
+		puts("extended header error");
+		return 1;
+	}
+	if(test_deep() != 0){
+		puts("deep path error");
+		return 1;
+	}
+	if(test_cookie() != 0){
+		puts("cookie error");
+		return 1;
+	}
+	if(test_dirs() != 0){
+		puts("dirs error");
+		return 1;
+	}
+	if(test_links() != 0){
+		puts("links error");
+		return 1;
+	}
+	if(test_pack() != 0){
+		puts("pack error");
+		return 1;
+	}
+	if(test_stream() != 0){
+		puts("stream error");
+		return 1;
+	}
+	if(test_parallel() != 0){
+		puts("parallel error");
+		return 1;
+	}
+	if(test_parallel_shadow() != 0){
+		puts("parallel shadow error");
+		return 1;
+	}
+	if(test_mounts() != 0){
+		puts("mount error");
+		return 1;
+	}
+	if(test_preload() != 0){
+		puts("preload error");
+		return 1;
+	}
+	if(test_reload() != 0){
+		puts("reload error");
+		return 1;
+	}
+	if(test_batch() != 0){
+		puts("batch error");
+		return 1;
+	}
+	if(test_aio() != 0){
+		puts("aio error");
+		return 1;
+	}
+	if(test_shared() != 0){
+		puts("shared index error");
+		return 1;
+	}
+	if(test_threads() != 0){
+		puts("threads error");
+		return 1;
+	}
+	if(test_index_corrupt() != 0){
+		puts("corrupt index error");
+		return 1;
+	}
+#ifdef TFS_WITH_ZLIB
+	if(test_gzip() != 0){
+		puts("gzip error");
+		return 1;
+	}
+#endif
+#ifdef TFS_WITH_ZSTD
+	if(test_zstd() != 0){
+		puts("zstd error");
+		return 1;
+	}
+#endif
 	return 0;
 }
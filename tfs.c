@@ -1,5 +1,8 @@
-#define TFS_NO_OVERRIDE
-#include "tfs.h"
+/* fopencookie */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tfs_internal.h"
 
 #define CTAR_IMPLEMENTATION
 #include "ctar.h"
@@ -8,11 +11,33 @@
 #include "string.h"
 #include "stdlib.h"
 
-struct ctar_t* tfs_rootentry = NULL;
-FILE* tfs_currfile = NULL;
+#include "fcntl.h"
+#include "pthread.h"
+#include "sched.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
 
-#define TFS_SETERRNO(no) errno = no
-#define TFS_STREAM_SETERRNO(no) stream->_errno = TFS_SETERRNO(no)
+/*
+	generations: the mounted archive is one published pointer. readers
+	count themselves into a stripe of the current epoch's parity, a swap
+	bumps the epoch and waits for the old parity to drain before it drops
+	its reference to the old archive
+*/
+#define TFS_GEN_STRIPES 16
+
+static struct {
+	atomic_uint n;
+	/* a cache line each */
+	char pad[64 - sizeof(atomic_uint)];
+} tfs_readers[2][TFS_GEN_STRIPES];
+
+static atomic_uint tfs_epoch;
+static _Atomic(struct tfs_archive*) tfs_current = NULL;
+/* serialises swaps, readers never take it */
+static pthread_mutex_t tfs_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint tfs_stripe_next;
+static _Thread_local int tfs_stripe = -1;
 
 /* returns the next name ptr */
 char* tfs_namepath(char* pathname){
@@ -40,32 +65,694 @@ struct ctar_t* tfs_query_path(struct ctar_t* archive, const char* pathname){
 	return archive;
 }
 
-// void tfs_inittar(const char* buffer){
-	// 
-// }
+const struct tfs_archive* tfs_archive_layer(const struct tfs_archive* arc, uint64_t* off){
+	if(!arc->layers) return arc;
+	uint64_t layer = *off >> TFS_LAYER_SHIFT;
+	*off &= ((uint64_t) 1 << TFS_LAYER_SHIFT) - 1;
+	return arc->layers[layer];
+}
+
+ssize_t tfs_archive_read_ra(const struct tfs_archive* arc, void* buf, size_t len, uint64_t off,
+	struct tfs_readahead* ra){
+
+	if(arc->layers) arc = tfs_archive_layer(arc, &off);
+	if(off >= arc->size) return 0;
+	if(len > arc->size - off) len = arc->size - off;
+	if(arc->z) return tfs_z_read(arc->z, buf, len, off);
+	if(arc->map){
+		memcpy(buf, arc->map + off, len);
+		return len;
+	}
+	return tfs_cache_read(arc, buf, len, off, ra);
+}
+
+ssize_t tfs_archive_read(const struct tfs_archive* arc, void* buf, size_t len, uint64_t off){
+	return tfs_archive_read_ra(arc, buf, len, off, NULL);
+}
+
+/* ustar splits long names into prefix + '/' + name */
+static int tfs_entrypath(const struct ctar_t* entry, char* out, size_t size){
+	char joined[sizeof(entry->prefix) + 1 + sizeof(entry->name)];
+	size_t n = 0;
+	if(!memcmp(entry->ustar, "ustar", 6)){
+		n = strnlen(entry->prefix, sizeof(entry->prefix));
+		memcpy(joined, entry->prefix, n);
+		if(n) joined[n++] = '/';
+	}
+	size_t name_len = strnlen(entry->name, sizeof(entry->name));
+	memcpy(joined + n, entry->name, name_len);
+	n += name_len;
+	return tfs_normpath(joined, n, out, size);
+}
+
+static void tfs_meta_set(struct tfs_meta* meta, int bit, char* dst, const char* src, size_t len){
+	if(len >= TFS_PATH_MAX){
+		if(bit == TFS_META_PATH) meta->set |= TFS_META_TOOLONG;
+		return;
+	}
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+	meta->set = (meta->set | bit) & ~(bit == TFS_META_PATH? TFS_META_TOOLONG: 0);
+}
+
+/* pax records are "<len> <key>=<value>\n", len counting the whole record */
+void tfs_meta_ext(struct tfs_meta* meta, char type, const char* data, size_t len){
+	if(type == 'L' || type == 'K'){
+		size_t n = strnlen(data, len);
+		if(type == 'L') tfs_meta_set(meta, TFS_META_PATH, meta->path, data, n);
+		else tfs_meta_set(meta, TFS_META_LINKPATH, meta->linkpath, data, n);
+		return;
+	}
+	const char* end = data + len;
+	while(data < end){
+		size_t rec = 0;
+		const char* p = data;
+		while(p < end && *p >= '0' && *p <= '9') rec = rec * 10 + (*p++ - '0');
+		if(p >= end || *p != ' ' || rec == 0 || rec > (size_t) (end - data)) return;
+		const char* key = p + 1;
+		const char* rec_end = data + rec;
+		const char* eq = memchr(key, '=', rec_end - key);
+		data = rec_end;
+		if(!eq || rec_end[-1] != '\n') continue;
+		size_t key_len = eq - key;
+		const char* val = eq + 1;
+		size_t val_len = rec_end - 1 - val;
+		if(key_len == 4 && !memcmp(key, "path", 4)){
+			tfs_meta_set(meta, TFS_META_PATH, meta->path, val, val_len);
+		}else if(key_len == 8 && !memcmp(key, "linkpath", 8)){
+			tfs_meta_set(meta, TFS_META_LINKPATH, meta->linkpath, val, val_len);
+		}else if(key_len == 4 && !memcmp(key, "size", 4)){
+			meta->size = strtoull(val, NULL, 10);
+			meta->set |= TFS_META_SIZE;
+		}else if(key_len == 5 && !memcmp(key, "mtime", 5)){
+			/* fractional seconds are dropped */
+			meta->mtime = strtoll(val, NULL, 10);
+			meta->set |= TFS_META_MTIME;
+		}
+	}
+}
+
+int tfs_member_decode(struct tfs_member* m, const struct ctar_t* header, struct tfs_meta meta[2]){
+	const struct tfs_meta* local = &meta[0];
+	const struct tfs_meta* global = &meta[1];
+	int set = local->set | global->set;
+	int res = 0;
+
+	m->type = header->type;
+	m->size = tfs_hdr_num(header->size, sizeof(header->size));
+	m->mtime = (int64_t) tfs_hdr_num(header->mtime, sizeof(header->mtime));
+	if(set & TFS_META_SIZE) m->size = (local->set & TFS_META_SIZE? local: global)->size;
+	if(set & TFS_META_MTIME) m->mtime = (local->set & TFS_META_MTIME? local: global)->mtime;
+
+	if(local->set & TFS_META_TOOLONG) res = -1;
+	else if(set & TFS_META_PATH){
+		const char* path = (local->set & TFS_META_PATH? local: global)->path;
+		if(tfs_normpath(path, strlen(path), m->path, sizeof(m->path)) < 0) res = -1;
+	}else if(tfs_entrypath(header, m->path, sizeof(m->path)) < 0) res = -1;
+
+	if(set & TFS_META_LINKPATH){
+		strcpy(m->linkpath, (local->set & TFS_META_LINKPATH? local: global)->linkpath);
+	}else{
+		size_t n = strnlen(header->link_name, sizeof(header->link_name));
+		memcpy(m->linkpath, header->link_name, n);
+		m->linkpath[n] = '\0';
+	}
+	meta[0].set = 0;
+	return res;
+}
+
+/* FNV-1a over the first and last member headers, cheap enough to check on every mount */
+static uint64_t tfs_archive_check(const struct tfs_archive* arc, const struct tfs_index* idx){
+	char block[512];
+	uint64_t h = 14695981039346656037ull;
+	uint64_t at[2] = { 0, idx->members? idx->offsets[idx->members - 1] - 512: 0 };
+	for(int i = 0; i < 2; ++i){
+		if(tfs_archive_read(arc, block, sizeof(block), at[i]) != sizeof(block)) return 0;
+		for(size_t k = 0; k < sizeof(block); ++k) h = (h ^ (unsigned char) block[k]) * 1099511628211ull;
+	}
+	return h;
+}
+
+static void tfs_archive_close(struct tfs_archive* arc){
+	if(arc->fd < 0 && !arc->borrowed && !arc->layers) return;
+	for(uint32_t i = 0; i < arc->layer_count; ++i) tfs_archive_release(arc->layers[i]);
+	free(arc->layers);
+	if(arc->map && !arc->borrowed) munmap((void*) arc->map, arc->size);
+	tfs_z_close(arc->z);
+	tfs_index_free(&arc->idx);
+	free(arc->mstats);
+	if(arc->fd >= 0) close(arc->fd);
+	*arc = (struct tfs_archive){ .fd = -1 };
+}
+
+struct tfs_archive* tfs_archive_enter(unsigned* token){
+	if(tfs_stripe < 0) tfs_stripe = atomic_fetch_add(&tfs_stripe_next, 1) % TFS_GEN_STRIPES;
+	for(;;){
+		unsigned epoch = atomic_load(&tfs_epoch);
+		atomic_uint* n = &tfs_readers[epoch & 1][tfs_stripe].n;
+		atomic_fetch_add(n, 1);
+		/* a swap may have gone by between the two, it would not wait for us */
+		if(atomic_load(&tfs_epoch) == epoch){
+			*token = (epoch & 1) * TFS_GEN_STRIPES + tfs_stripe;
+			return atomic_load(&tfs_current);
+		}
+		atomic_fetch_sub(n, 1);
+	}
+}
+
+void tfs_archive_leave(unsigned token){
+	atomic_fetch_sub(&tfs_readers[token / TFS_GEN_STRIPES][token % TFS_GEN_STRIPES].n, 1);
+}
+
+struct tfs_archive* tfs_archive_acquire(void){
+	unsigned token;
+	struct tfs_archive* arc = tfs_archive_enter(&token);
+	if(arc) atomic_fetch_add(&arc->refs, 1);
+	tfs_archive_leave(token);
+	return arc;
+}
+
+void tfs_archive_release(struct tfs_archive* arc){
+	if(!arc || atomic_fetch_sub(&arc->refs, 1) != 1) return;
+	free(arc->pathname);
+	tfs_archive_close(arc);
+	free(arc);
+}
+
+/* publish lock held */
+static void tfs_archive_drain(void){
+	/* every reader that could still see what was swapped out counted itself under this parity */
+	unsigned parity = atomic_fetch_add(&tfs_epoch, 1) & 1;
+	for(int i = 0; i < TFS_GEN_STRIPES; ++i){
+		while(atomic_load(&tfs_readers[parity][i].n)) sched_yield();
+	}
+}
+
+void tfs_archive_publish(struct tfs_archive* arc){
+	pthread_mutex_lock(&tfs_publish_lock);
+	struct tfs_archive* old = atomic_exchange(&tfs_current, arc);
+	tfs_archive_drain();
+	pthread_mutex_unlock(&tfs_publish_lock);
+	tfs_archive_release(old);
+}
+
+void tfs_archive_synchronize(void){
+	pthread_mutex_lock(&tfs_publish_lock);
+	tfs_archive_drain();
+	pthread_mutex_unlock(&tfs_publish_lock);
+}
+
+/* maps the index at idxpath if it is one of this very archive */
+static int tfs_archive_sidecar(struct tfs_archive* arc, const char* idxpath, int owned){
+	if(tfs_index_load(&arc->idx, idxpath, owned) != 0) return -1;
+	const struct tfs_arena* arena = arc->idx.arena;
+	if(arena->tar_size != arc->size || arena->tar_mtime_ns != arc->mtime_ns
+		|| arena->tar_check != tfs_archive_check(arc, &arc->idx)){
+		tfs_index_free(&arc->idx);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	the shared index of the tar at pathname, named after its absolute path
+	in a directory of this user's that no one else can write to
+*/
+static int tfs_shared_path(const char* pathname, char* out, size_t size){
+	char dir[64];
+	snprintf(dir, sizeof(dir), TFS_SHARED_DIR "/tfs-%ld", (long) geteuid());
+	struct stat st;
+	if(mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+	if(lstat(dir, &st) != 0) return -1;
+	if(!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || st.st_mode & 077){
+		TFS_SETERRNO(EPERM);
+		return -1;
+	}
+	char* abs = realpath(pathname, NULL);
+	if(!abs) return -1;
+	uint64_t h = 0xcbf29ce484222325ull;
+	for(const char* p = abs; *p; ++p) h = (h ^ (unsigned char) *p) * 0x100000001b3ull;
+	free(abs);
+	return snprintf(out, size, "%s/%016llx" TFS_INDEX_SUFFIX, dir, (unsigned long long) h) < (int) size? 0: -1;
+}
+
+/*
+	check the tail and index the archive, from the sidecar at idxpath when
+	it still matches, else from the shared one at shmpath
+*/
+static int tfs_archive_index(struct tfs_archive* arc, const char* idxpath, const char* shmpath, int flags){
+	/* a tar ends in two zero blocks */
+	char tail[1024];
+	if(arc->size < sizeof(tail)
+		|| tfs_archive_read(arc, tail, sizeof(tail), arc->size - sizeof(tail)) != sizeof(tail)
+		|| !ctar_iszeroed(tail, sizeof(tail))){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+
+	if(idxpath && !(flags & TFS_INIT_NOINDEX)) tfs_archive_sidecar(arc, idxpath, 0);
+	if(!arc->idx.arena && shmpath) tfs_archive_sidecar(arc, shmpath, 1);
+	if(!arc->idx.arena){
+		struct tfs_builder b = {};
+		if(tfs_archive_scan(arc, &b) != 0 || tfs_builder_finish(&b, &arc->idx) != 0){
+			tfs_builder_free(&b);
+			return -1;
+		}
+		arc->idx.arena->tar_size = arc->size;
+		arc->idx.arena->tar_mtime_ns = arc->mtime_ns;
+		arc->idx.arena->tar_check = tfs_archive_check(arc, &arc->idx);
+		/* the scanning process maps what it shared too, so the index is paid for once */
+		struct tfs_index own = arc->idx;
+		if(shmpath && tfs_index_save(&own, shmpath, 0600) == 0){
+			arc->idx = (struct tfs_index){};
+			if(tfs_archive_sidecar(arc, shmpath, 1) == 0) tfs_index_free(&own);
+			else arc->idx = own;
+		}
+	}
+	if(tfs_stats_attach(arc) != 0){
+		TFS_SETERRNO(ENOMEM);
+		return -1;
+	}
+	return 0;
+}
+
+static _Atomic uint64_t tfs_serial = 0;
+
+static int tfs_archive_open(struct tfs_archive* arc, const char* pathname, int flags){
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) return -1;
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return -1;
+	}
+	*arc = (struct tfs_archive){ .fd = fd, .flags = flags, .size = st.st_size, .serial = ++tfs_serial, .ino = st.st_ino };
+	arc->mtime_ns = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+	char idxpath[TFS_PATH_MAX];
+
+	int kind = tfs_z_detect(fd);
+	if(kind != TFS_Z_NONE){
+		snprintf(idxpath, sizeof(idxpath), "%s" TFS_ZINDEX_SUFFIX, pathname);
+		arc->z = tfs_z_open(fd, kind, st.st_size, arc->mtime_ns, flags & TFS_INIT_NOINDEX? NULL: idxpath);
+		if(!arc->z){
+			close(fd);
+			*arc = (struct tfs_archive){ .fd = -1 };
+			return -1;
+		}
+		arc->size = tfs_z_size(arc->z);
+	}else if(flags & TFS_INIT_MMAP){
+		void* map = mmap(NULL, arc->size, PROT_READ, MAP_SHARED, fd, 0);
+		if(map != MAP_FAILED) arc->map = map;
+	}
+
+	char shmpath[TFS_PATH_MAX];
+	int shared = flags & TFS_INIT_SHARED && !(flags & TFS_INIT_NOINDEX)
+		&& tfs_shared_path(pathname, shmpath, sizeof(shmpath)) == 0;
+	snprintf(idxpath, sizeof(idxpath), "%s" TFS_INDEX_SUFFIX, pathname);
+	if(tfs_archive_index(arc, idxpath, shared? shmpath: NULL, flags) != 0){
+		int err = errno;
+		tfs_archive_close(arc);
+		TFS_SETERRNO(err);
+		return -1;
+	}
+	return 0;
+}
 
 void tfs_inittarfile(const char* pathname){
-	FILE* fp = fopen(pathname, "rb");
+	tfs_inittarfile_ex(pathname, 0);
+}
+
+struct tfs_archive* tfs_archive_new(const char* pathname, int flags){
+	struct tfs_archive* arc = calloc(1, sizeof(*arc));
+	char* path = strdup(pathname);
+	if(!arc || !path || tfs_archive_open(arc, pathname, flags) != 0){
+		free(arc);
+		free(path);
+		return NULL;
+	}
+	arc->pathname = path;
+	atomic_init(&arc->refs, 1);
+	return arc;
+}
+
+void tfs_inittarfile_ex(const char* pathname, int flags){
 	// TODO error handling
-	if(!fp) return;
-	if(!ctar_istarfile(fp)){
-		fclose(fp);
+	struct tfs_archive* arc = pathname? tfs_archive_new(pathname, flags): NULL;
+	if(arc) tfs_mounts_reset(arc);
+}
+
+void tfs_inittarmem(const void* buffer, size_t len, int flags){
+	if(!buffer){
+		TFS_SETERRNO(EINVAL);
+		return;
+	}
+	struct tfs_archive* arc = calloc(1, sizeof(*arc));
+	if(!arc) return;
+	/* members are read straight out of the buffer, there is nothing to cache or map */
+	*arc = (struct tfs_archive){
+		.fd = -1,
+		.flags = flags & ~TFS_INIT_MMAP,
+		.serial = ++tfs_serial,
+		.size = len,
+		.map = buffer,
+		.borrowed = 1,
+	};
+	atomic_init(&arc->refs, 1);
+	if(tfs_archive_index(arc, NULL, NULL, flags) != 0){
+		int err = errno;
+		tfs_index_free(&arc->idx);
+		free(arc->mstats);
+		free(arc);
+		TFS_SETERRNO(err);
 		return;
 	}
-	ctar_read(fp, &tfs_rootentry, 0);
-	tfs_currfile = fp;
+	tfs_mounts_reset(arc);
+}
+
+void tfs_inittar(const char* buffer){
+	if(!buffer){
+		TFS_SETERRNO(EINVAL);
+		return;
+	}
+	struct tfs_meta* meta = calloc(2, sizeof(*meta));
+	struct tfs_member* m = malloc(sizeof(*m));
+	if(!meta || !m){
+		free(meta);
+		free(m);
+		return;
+	}
+	/* no length given, walk the headers up to the two zero blocks */
+	struct ctar_t header;
+	uint64_t off = 0;
+	int bad = 0;
+	for(;;){
+		const char* block = buffer + off;
+		if(tfs_hdr_iszero(block)){
+			if(tfs_hdr_iszero(block + 512)) break;
+			/* a lone zero block is skipped, as the scan does */
+			off += 512;
+			continue;
+		}
+		/* not a header, and where the buffer ends is unknown past it */
+		if(tfs_hdr_checksum(block) != 0){
+			bad = 1;
+			break;
+		}
+		memcpy(header.block, block, sizeof(header.block));
+		uint64_t size = tfs_hdr_num(header.size, sizeof(header.size));
+		if(tfs_header_isext(header.type)){
+			if(size <= TFS_EXT_MAX) tfs_meta_ext(&meta[header.type == 'g'? 1: 0], header.type, block + 512, size);
+		}else{
+			tfs_member_decode(m, &header, meta);
+			size = m->size;
+		}
+		if(size > UINT64_MAX / 2 - off){
+			bad = 1;
+			break;
+		}
+		off += 512 + ((size + 511) & ~(uint64_t) 511);
+	}
+	free(meta);
+	free(m);
+	if(bad){
+		tfs_corrupt(off);
+		return;
+	}
+	tfs_inittarmem(buffer, off + 1024, 0);
 }
 
 void tfs_deinit(){
-	if(tfs_currfile){
-		ctar_free(tfs_rootentry);
-		tfs_currfile = NULL;
+	tfs_unwatch();
+	tfs_mounts_reset(NULL);
+}
+
+int tfs_writeindex(const char* pathname, const char* indexpath){
+	struct tfs_archive arc;
+	char defpath[TFS_PATH_MAX];
+	if(!pathname){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	if(!indexpath){
+		snprintf(defpath, sizeof(defpath), "%s" TFS_INDEX_SUFFIX, pathname);
+		indexpath = defpath;
+	}
+	if(tfs_archive_open(&arc, pathname, TFS_INIT_NOINDEX) != 0) return -1;
+	int res = tfs_index_save(&arc.idx, indexpath, 0644);
+	if(res == 0 && arc.z){
+		snprintf(defpath, sizeof(defpath), "%s" TFS_ZINDEX_SUFFIX, pathname);
+		res = tfs_z_save(arc.z, defpath, arc.mtime_ns);
+	}
+	tfs_archive_close(&arc);
+	return res;
+}
+
+
+/* index */
+
+tfs_entry_id tfs_archive_lookup(const struct tfs_archive* arc, const char* pathname){
+	char path[TFS_PATH_MAX];
+	if(!arc || !pathname || pathname[0] != TFS_PATH_PREFIX || pathname[1] != '/'
+		|| tfs_normpath(pathname + 2, strlen(pathname + 2), path, sizeof(path)) < 0){
+		TFS_SETERRNO(ENOENT);
+		return TFS_ENTRY_NONE;
+	}
+	return tfs_index_resolve(&arc->idx, path, 1);
+}
+
+tfs_entry_id tfs_lookup(const char* pathname){
+	unsigned token;
+	tfs_entry_id id = tfs_archive_lookup(tfs_archive_enter(&token), pathname);
+	tfs_archive_leave(token);
+	return id;
+}
+
+const char* tfs_entry_path(tfs_entry_id id){
+	unsigned token;
+	const struct tfs_archive* arc = tfs_archive_enter(&token);
+	const char* path = arc && id >= 0 && id < arc->idx.count? tfs_index_path(&arc->idx, id): NULL;
+	tfs_archive_leave(token);
+	return path;
+}
+
+uint64_t tfs_entry_size(tfs_entry_id id){
+	unsigned token;
+	const struct tfs_archive* arc = tfs_archive_enter(&token);
+	uint64_t size = arc && id >= 0 && id < arc->idx.count? arc->idx.sizes[id]: 0;
+	tfs_archive_leave(token);
+	return size;
+}
+
+int tfs_entry_header(tfs_entry_id id, struct ctar_t* header){
+	struct tfs_archive* arc = tfs_archive_acquire();
+	int res = -1;
+	if(!arc || id < 0 || id >= arc->idx.count || !header){
+		TFS_SETERRNO(EINVAL);
+	}else if(id >= arc->idx.members){
+		/* implicit directories have no header */
+		TFS_SETERRNO(ENOENT);
+	}else{
+		/* the ustar header always sits in the block right before the data */
+		uint64_t off = arc->idx.offsets[id] - 512;
+		const struct tfs_archive* src = tfs_archive_layer(arc, &off);
+		memset(header, 0, sizeof(*header));
+		if(tfs_archive_read(src, header->block, 512, off) != 512) TFS_SETERRNO(EIO);
+		else{
+			header->begin = off;
+			res = 0;
+		}
 	}
+	tfs_archive_release(arc);
+	return res;
 }
 
 
 /* generic */
 
+/* up to len bytes at the handle position, advancing it */
+static ssize_t tfs_member_read(TFS_FILE* stream, void* ptr, size_t len){
+	if(stream->now_pos >= stream->data_len) return 0;
+	if(len > stream->data_len - stream->now_pos) len = stream->data_len - stream->now_pos;
+	TFS_TRACE_BEGIN(t0);
+	ssize_t got;
+	if(stream->data){
+		memcpy(ptr, stream->data + stream->now_pos, len);
+		got = len;
+	}else{
+		/* positional, so handles never disturb each other */
+		got = tfs_archive_read_ra(stream->arc, ptr, len, stream->data_begin + stream->now_pos, &stream->ra);
+		if(got < 0){
+			TFS_STREAM_SETERRNO(errno);
+			return -1;
+		}
+	}
+	tfs_stats_read(stream->arc, stream->id, got);
+	TFS_TRACE(TFS_TRACE_READ, stream->id, NULL, stream->now_pos, got, t0);
+	stream->now_pos += got;
+	return got;
+}
+
+static ssize_t tfs_cookie_read(void* cookie, char* buf, size_t size){
+	return tfs_member_read(cookie, buf, size);
+}
+
+static int tfs_cookie_seek(void* cookie, off64_t* offset, int whence){
+	TFS_FILE* stream = cookie;
+	int64_t pos = *offset;
+	switch(whence){
+		case SEEK_SET: break;
+		case SEEK_CUR: pos += stream->now_pos; break;
+		case SEEK_END: pos += stream->data_len; break;
+		default: TFS_SETERRNO(EINVAL); return -1;
+	}
+	if(pos < 0 || (uint64_t) pos > stream->data_len){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	stream->now_pos = *offset = pos;
+	tfs_stats_seek();
+	return 0;
+}
+
+static int tfs_cookie_close(void* cookie){
+	TFS_FILE* stream = cookie;
+	tfs_stats_close();
+	TFS_TRACE(TFS_TRACE_CLOSE, stream->id, NULL, 0, 0, 0);
+	tfs_archive_release(stream->arc);
+	free(stream);
+	return 0;
+}
+
+/* no larger than the member, plus one so an empty member still gets a buffer */
+#define tfs_cookie_bufsize(size) ((size) < TFS_COOKIE_BUFSIZE? (size_t) (size) + 1: (size_t) TFS_COOKIE_BUFSIZE)
+
+/* a real FILE over tfp, which it then owns along with its buffer and archive reference */
+static FILE* tfs_cookie_open(TFS_FILE* tfp){
+	FILE* fp = fopencookie(tfp, "r", (cookie_io_functions_t){
+		.read = tfs_cookie_read,
+		.seek = tfs_cookie_seek,
+		.close = tfs_cookie_close,
+	});
+	if(!fp) return NULL;
+	/* the buffer sits right behind tfp, see tfs_open_id */
+	setvbuf(fp, (char*) (tfp + 1), _IOFBF, tfs_cookie_bufsize(tfp->data_len));
+	return fp;
+}
+
+/*
+	closed handles are kept by the closing thread for its next opens, so a
+	hot open and close allocate nothing. cookie handles carry their stdio
+	buffer and are not kept
+*/
+#define TFS_HANDLE_CACHE 64
+
+struct tfs_handle {
+	TFS_FILE file;
+	struct tfs_handle* next;
+};
+
+static _Thread_local struct tfs_handle* tfs_handles;
+static _Thread_local unsigned tfs_handles_count;
+/* set once the thread's destructor is registered */
+static _Thread_local int tfs_handles_owned;
+static pthread_key_t tfs_handles_key;
+static pthread_once_t tfs_handles_once = PTHREAD_ONCE_INIT;
+
+/* at thread exit */
+static void tfs_handles_drain(void* unused){
+	(void) unused;
+	while(tfs_handles){
+		struct tfs_handle* h = tfs_handles;
+		tfs_handles = h->next;
+		free(h);
+	}
+	tfs_handles_count = 0;
+}
+
+static void tfs_handles_init(void){
+	pthread_key_create(&tfs_handles_key, tfs_handles_drain);
+}
+
+static TFS_FILE* tfs_handle_new(void){
+	struct tfs_handle* h = tfs_handles;
+	if(!h) return malloc(sizeof(struct tfs_handle));
+	tfs_handles = h->next;
+	--tfs_handles_count;
+	return &h->file;
+}
+
+static void tfs_handle_free(TFS_FILE* tfp){
+	/* a stale pointer must not pass for a handle */
+	tfp->magic = 0;
+	if(tfs_handles_count >= TFS_HANDLE_CACHE){
+		free(tfp);
+		return;
+	}
+	if(!tfs_handles_owned){
+		pthread_once(&tfs_handles_once, tfs_handles_init);
+		pthread_setspecific(tfs_handles_key, (void*) 1);
+		tfs_handles_owned = 1;
+	}
+	struct tfs_handle* h = (struct tfs_handle*) tfp;
+	h->next = tfs_handles;
+	tfs_handles = h;
+	++tfs_handles_count;
+}
+
+/* a handle on entry id, taking over the reference to arc; pathname is for tracing */
+static FILE* tfs_open_id(struct tfs_archive* arc, tfs_entry_id id, const char* pathname){
+	(void) pathname;
+	const struct tfs_index* idx = &arc->idx;
+	uint8_t type = id >= 0 && id < idx->count? idx->types[id]: 0;
+	if(id >= 0 && id < idx->count && (type == HARDLINK || type == SYMLINK)){
+		/* ids from readdir may name a link, its target is cached */
+		uint32_t target = idx->targets[id];
+		id = target && target < TFS_TARGET_DANGLING? (tfs_entry_id) target - 1: TFS_ENTRY_NONE;
+		if(id == TFS_ENTRY_NONE) TFS_SETERRNO(target == TFS_TARGET_LOOP? ELOOP: ENOENT);
+		type = id == TFS_ENTRY_NONE? 0: idx->types[id];
+	}else if(id != TFS_ENTRY_NONE && (id < 0 || id >= idx->count)){
+		TFS_SETERRNO(ENOENT);
+		id = TFS_ENTRY_NONE;
+	}
+	if(id == TFS_ENTRY_NONE || !((type == REGULAR) || (type == NORMAL) || (type == CONTIGUOUS))){
+		if(id != TFS_ENTRY_NONE) TFS_SETERRNO(type == DIRECTORY? EISDIR: ENOENT);
+		tfs_stats_open(arc, TFS_ENTRY_NONE);
+		TFS_TRACE(TFS_TRACE_OPEN, TFS_ENTRY_NONE, pathname, 0, 0, 0);
+		tfs_archive_release(arc);
+		return NULL;
+	}
+	/* the tar the member is in decides how it is read */
+	uint64_t off = idx->offsets[id];
+	const struct tfs_archive* src = tfs_archive_layer(arc, &off);
+	int cookie = src->flags & TFS_INIT_COOKIE;
+	/* every field of the handle is set below, the buffer needs no clearing */
+	TFS_FILE* tfp = cookie? malloc(sizeof(TFS_FILE) + tfs_cookie_bufsize(idx->sizes[id])): tfs_handle_new();
+	if(!tfp){
+		tfs_archive_release(arc);
+		return NULL;
+	}
+	tfs_stats_open(arc, id);
+	TFS_TRACE(TFS_TRACE_OPEN, id, pathname, 0, 0, 0);
+	*tfp = (TFS_FILE){
+		.magic = TFS_MAGIC,
+		.arc = arc,
+		.id = id,
+		.data_begin = idx->offsets[id],
+		.data_len = idx->sizes[id],
+	};
+	if(src->map && off + tfp->data_len <= src->size)
+		tfp->data = src->map + off;
+	if(cookie){
+		FILE* fp = tfs_cookie_open(tfp);
+		if(!fp){
+			tfs_archive_release(arc);
+			free(tfp);
+		}
+		return fp;
+	}
+	return (FILE*) tfp;
+}
+
 FILE* tfs_fopen(const char* pathname, const char* mode){
 	if(!pathname || *pathname == '\0') return NULL;
 	if(*pathname == TFS_PATH_PREFIX){
@@ -74,32 +761,26 @@ FILE* tfs_fopen(const char* pathname, const char* mode){
 			return NULL;
 		}
 		// tfs
-		TFS_FILE* tfp = (TFS_FILE*) calloc(sizeof(TFS_FILE), 1);
-		if(!tfp) return NULL;
-		if(!tfs_rootentry){
+		/* the handle keeps this generation alive across tfs_reload */
+		struct tfs_archive* arc = tfs_archive_acquire();
+		if(!arc){
 			TFS_SETERRNO(ENOMEM);
-			free(tfp);
 			return NULL;
 		}
 		// struct ctar_t* entry = tfs_query_path(tfs_rootentry, pathname + 1);
-		struct ctar_t* entry = ctar_exists(tfs_rootentry, pathname + 2, 0);
-		if(!entry){
-			TFS_SETERRNO(ENOENT);
-			free(tfp);
-			return NULL;
-		};
-		if((entry->type == REGULAR) || (entry->type == NORMAL) || (entry->type == CONTIGUOUS)){
-			tfp->magic = TFS_MAGIC;
-			tfp->base = tfs_currfile;
-			tfp->data_begin = entry->begin + 512;
-			tfp->data_len = ctar_getsize(entry);
-			return (FILE*) tfp;
-		}
-		free(tfp);
-		return NULL;
+		return tfs_open_id(arc, tfs_archive_lookup(arc, pathname), pathname);
 	}else return fopen(pathname, mode);
 }
 
+FILE* tfs_open_entry(tfs_entry_id id){
+	struct tfs_archive* arc = tfs_archive_acquire();
+	if(!arc){
+		TFS_SETERRNO(ENOENT);
+		return NULL;
+	}
+	return tfs_open_id(arc, id, NULL);
+}
+
 size_t tfs_fread(void* ptr, size_t size, size_t nmemb, FILE* _stream){
 	if(IS_TFS_FILE(_stream)){
 		// tfs
@@ -108,25 +789,30 @@ size_t tfs_fread(void* ptr, size_t size, size_t nmemb, FILE* _stream){
 			return 0;
 		}
 		TFS_FILE* stream = (TFS_FILE*) _stream;
-		size_t off = 0;
-		// TODO optimize
-		int stat = fseek(stream->base, stream->data_begin + stream->now_pos, SEEK_SET);
-		if(stat != 0) return 0;
-		int count = 0;
-		while(stream->now_pos < stream->data_len){
-			size_t remain_size = stream->data_len - stream->now_pos;
-			size_t size_to_read = size <= remain_size? size: remain_size;
-			size_t got = fread(ptr + off, 1, size_to_read, stream->base);
-			if(got<=0) break;
-			++count;
-			off += got;
-			stream->now_pos += got;
-		}
-		return count;
+		if(size == 0 || nmemb == 0) return 0;
+		size_t want = nmemb <= SIZE_MAX / size? size * nmemb: SIZE_MAX;
+		ssize_t got = tfs_member_read(stream, ptr, want);
+		/* complete members only, as fread; a partial one is still consumed */
+		return got > 0? (size_t) got / size: 0;
 	}
 	else return fread(ptr, size, nmemb, _stream);
 }
 
+int tfs_getdata(FILE* _stream, const void** ptr, size_t* len){
+	if(!_stream || !IS_TFS_FILE(_stream)){
+		TFS_SETERRNO(EBADF);
+		return -1;
+	}
+	TFS_FILE* stream = (TFS_FILE*) _stream;
+	if(!stream->data){
+		TFS_STREAM_SETERRNO(ENOTSUP);
+		return -1;
+	}
+	if(ptr) *ptr = stream->data;
+	if(len) *len = stream->data_len;
+	return 0;
+}
+
 int tfs_fseek(FILE* _stream, long offset, int whence){
 	if(IS_TFS_FILE(_stream)){
 		TFS_FILE* stream = (TFS_FILE*) _stream;
@@ -155,6 +841,7 @@ int tfs_fseek(FILE* _stream, long offset, int whence){
 				break;
 		}
 		stream->now_pos = offset;
+		tfs_stats_seek();
 		return 0;
 	}else return fseek(_stream, offset, whence);
 }
@@ -179,13 +866,163 @@ int tfs_fclose(FILE* _stream){
 	if(IS_TFS_FILE(_stream)){
 		// tfs
 		TFS_FILE* stream = (TFS_FILE*) _stream;
-		free(stream);
+		tfs_stats_close();
+		TFS_TRACE(TFS_TRACE_CLOSE, stream->id, NULL, 0, 0, 0);
+		tfs_archive_release(stream->arc);
+		tfs_handle_free(stream);
 		return 0;
 	}else{
 		return fclose(_stream);
 	}
 }
 
+/* directories */
+
+/* like tfs_archive_lookup, but "@/" resolves to the root and a symlink at the end is kept unless follow */
+static tfs_entry_id tfs_lookup_any(const struct tfs_archive* arc, const char* pathname, int follow){
+	char path[TFS_PATH_MAX];
+	if(!arc || pathname[1] != '/' || tfs_normpath(pathname + 2, strlen(pathname + 2), path, sizeof(path)) < 0){
+		TFS_SETERRNO(ENOENT);
+		return TFS_ENTRY_NONE;
+	}
+	if(path[0] == '\0') return tfs_index_root(&arc->idx);
+	return tfs_index_resolve(&arc->idx, path, follow);
+}
+
+DIR* tfs_opendir(const char* name){
+	if(!name || *name == '\0'){
+		TFS_SETERRNO(ENOENT);
+		return NULL;
+	}
+	if(*name != TFS_PATH_PREFIX) return opendir(name);
+	struct tfs_archive* arc = tfs_archive_acquire();
+	tfs_entry_id id = tfs_lookup_any(arc, name, 1);
+	TFS_DIR* dir = NULL;
+	if(id != TFS_ENTRY_NONE && id != tfs_index_root(&arc->idx) && arc->idx.types[id] != DIRECTORY)
+		TFS_SETERRNO(ENOTDIR);
+	else if(id != TFS_ENTRY_NONE) dir = calloc(1, sizeof(TFS_DIR));
+	if(!dir){
+		tfs_archive_release(arc);
+		return NULL;
+	}
+	const struct tfs_index* idx = &arc->idx;
+	dir->magic = TFS_MAGIC;
+	dir->arc = arc;
+	dir->next = idx->dirs[id];
+	dir->end = idx->dirs[id + 1];
+	return (DIR*) dir;
+}
+
+static unsigned char tfs_dtype(uint8_t type){
+	switch(type){
+		case REGULAR: case NORMAL: case CONTIGUOUS: case HARDLINK: return DT_REG;
+		case SYMLINK: return DT_LNK;
+		case CHAR: return DT_CHR;
+		case BLOCK: return DT_BLK;
+		case DIRECTORY: return DT_DIR;
+		case FIFO: return DT_FIFO;
+		default: return DT_UNKNOWN;
+	}
+}
+
+struct dirent* tfs_readdir(DIR* dirp){
+	if(!IS_TFS_FILE(dirp)) return readdir(dirp);
+	TFS_DIR* dir = (TFS_DIR*) dirp;
+	const struct tfs_index* idx = &dir->arc->idx;
+	uint32_t id;
+	const char* base;
+	do{
+		if(dir->next >= dir->end) return NULL;
+		id = idx->children[dir->next++];
+		const char* path = tfs_index_path(idx, id);
+		base = strrchr(path, '/');
+		base = base? base + 1: path;
+		/* no dirent holds a name over NAME_MAX, such members are only reached by path */
+	}while(strlen(base) >= sizeof(dir->ent.d_name));
+	dir->ent.d_ino = id + 1;
+	dir->ent.d_off = dir->next;
+	dir->ent.d_reclen = sizeof(dir->ent);
+	dir->ent.d_type = tfs_dtype(idx->types[id]);
+	strcpy(dir->ent.d_name, base);
+	return &dir->ent;
+}
+
+int tfs_closedir(DIR* dirp){
+	if(!IS_TFS_FILE(dirp)) return closedir(dirp);
+	tfs_archive_release(((TFS_DIR*) dirp)->arc);
+	free(dirp);
+	return 0;
+}
+
+static mode_t tfs_mode(uint8_t type){
+	switch(type){
+		case SYMLINK: return S_IFLNK | 0777;
+		case CHAR: return S_IFCHR | 0444;
+		case BLOCK: return S_IFBLK | 0444;
+		case DIRECTORY: return S_IFDIR | 0555;
+		case FIFO: return S_IFIFO | 0444;
+		default: return S_IFREG | 0444;
+	}
+}
+
+void tfs_stat_entry(const struct tfs_index* idx, tfs_entry_id id, struct stat* statbuf){
+	memset(statbuf, 0, sizeof(*statbuf));
+	statbuf->st_ino = id + 1;
+	statbuf->st_blksize = BLOCKSIZE;
+	if(id == tfs_index_root(idx)){
+		statbuf->st_mode = S_IFDIR | 0555;
+		statbuf->st_nlink = 2;
+	}else{
+		statbuf->st_mode = tfs_mode(idx->types[id]);
+		statbuf->st_nlink = idx->types[id] == DIRECTORY? 2: 1;
+		statbuf->st_size = idx->sizes[id];
+		statbuf->st_blocks = (idx->sizes[id] + 511) / 512;
+		statbuf->st_mtim.tv_sec = idx->mtimes[id];
+		statbuf->st_atim = statbuf->st_ctim = statbuf->st_mtim;
+	}
+}
+
+int tfs_stat_follow(const char* pathname, struct stat* statbuf, int follow){
+	unsigned token;
+	const struct tfs_archive* arc = tfs_archive_enter(&token);
+	tfs_entry_id id = tfs_lookup_any(arc, pathname, follow);
+	if(id != TFS_ENTRY_NONE) tfs_stat_entry(&arc->idx, id, statbuf);
+	tfs_archive_leave(token);
+	return id == TFS_ENTRY_NONE? -1: 0;
+}
+
+ssize_t tfs_readlink(const char* pathname, char* buf, size_t size){
+	unsigned token;
+	const struct tfs_archive* arc = tfs_archive_enter(&token);
+	tfs_entry_id id = tfs_lookup_any(arc, pathname, 0);
+	ssize_t n = -1;
+	if(id != TFS_ENTRY_NONE){
+		const struct tfs_index* idx = &arc->idx;
+		if(id == tfs_index_root(idx) || idx->types[id] != SYMLINK || idx->links[id] == UINT32_MAX){
+			TFS_SETERRNO(EINVAL);
+		}else{
+			/* targets are kept from the root of the mount, so this one is absolute */
+			const char* target = idx->pool + idx->links[id];
+			size_t len = strlen(target) + 1;
+			n = len < size? len: size;
+			if(n > 0) buf[0] = '/';
+			if(n > 1) memcpy(buf + 1, target, n - 1);
+		}
+	}
+	tfs_archive_leave(token);
+	return n;
+}
+
+int tfs_stat(const char* pathname, struct stat* statbuf){
+	if(!pathname || !statbuf){
+		TFS_SETERRNO(EFAULT);
+		return -1;
+	}
+	if(*pathname != TFS_PATH_PREFIX) return stat(pathname, statbuf);
+	/* as lstat: a symlink is reported rather than followed */
+	return tfs_stat_follow(pathname, statbuf, 0);
+}
+
 /* error handling */
 
 void tfs_clearerr(FILE* _stream){
@@ -9,6 +9,16 @@
 
 #include "stdio.h"
 #include "stdint.h"
+#include "dirent.h"
+#include "sys/stat.h"
+
+struct tfs_archive;
+
+/* sequential read-ahead state of a handle, see tfs_cache_config */
+struct tfs_readahead {
+	uint64_t next;
+	uint64_t size;
+};
 
 #define TFS_PATH_PREFIX '@'
 
@@ -17,28 +27,334 @@
 
 #define IS_TFS_FILE(stream) (*(TFS_MAGIC_T*)stream == TFS_MAGIC)
 
+/* index of a member inside the mounted tar, see tfs_lookup */
+typedef int64_t tfs_entry_id;
+#define TFS_ENTRY_NONE ((tfs_entry_id)-1)
+
 typedef struct {
 	/* to be compatible with std */
 	// FILE fp;
 	TFS_MAGIC_T magic;
-	FILE* base;
-	size_t data_begin;
-	size_t data_len;
-	size_t now_pos;
+	/* archive this member belongs to, read positionally */
+	struct tfs_archive* arc;
+	tfs_entry_id id;
+	/* member bytes inside the mapping, NULL unless TFS_INIT_MMAP */
+	const char* data;
+	uint64_t data_begin;
+	uint64_t data_len;
+	uint64_t now_pos;
+	struct tfs_readahead ra;
 	int _errno;
 } TFS_FILE;
 
-// void tfs_inittar(const char* buffer);
+/* flags for tfs_inittarfile_ex */
+#define TFS_INIT_MMAP 0x1
+/* always scan, ignore <tar>.tfsidx */
+#define TFS_INIT_NOINDEX 0x2
+/*
+	members open as real FILE* through fopencookie, so fgets, getline,
+	fscanf, ungetc and the rest of stdio work on them; tfs_getdata does not
+*/
+#define TFS_INIT_COOKIE 0x4
+/*
+	without a usable <tar>.tfsidx, share one index between every process
+	of this user mounting the same tar: the first to scan it writes the
+	index to TFS_SHARED_DIR/tfs-<uid>/, the others map it read-only instead
+	of scanning. the directory is created 0700 and not used unless it is
+	the user's own; nothing removes the files, deleting them is always safe
+*/
+#define TFS_INIT_SHARED 0x8
+
+#ifndef TFS_SHARED_DIR
+#define TFS_SHARED_DIR "/dev/shm"
+#endif
+
+/* index file looked for next to the tar */
+#define TFS_INDEX_SUFFIX ".tfsidx"
+/* checkpoints for a .tar.gz / .tar.zst, also written by tfs_writeindex */
+#define TFS_ZINDEX_SUFFIX ".tfszidx"
+
+/*
+	mount a tar already in memory, e.g. linked into the executable (see the
+	tfs-embed target); it is read in place and must outlive the mount.
+	tfs_inittar finds the end by walking the headers, so the buffer has to
+	hold the whole tar including its two zero blocks. the walk stops at the
+	first block that is neither a header nor zero and fails with EBADMSG,
+	its offset in tfs_corrupt_offset, rather than read past the buffer
+*/
+void tfs_inittar(const char* buffer);
+void tfs_inittarmem(const void* buffer, size_t len, int flags);
 void tfs_inittarfile(const char* pathname);
+void tfs_inittarfile_ex(const char* pathname, int flags);
+/*
+	stack tars: the tar at pathname appears under mountpoint ("@/dir", "/"
+	or NULL for the root) on top of the tars already mounted. where paths
+	clash the higher priority wins, on a tie the later mount. tfs_inittar*
+	replace the whole stack with one tar at the root
+*/
+int tfs_mount(const char* pathname, const char* mountpoint, int priority);
+int tfs_mount_ex(const char* pathname, const char* mountpoint, int priority, int flags);
+/* take every mount of the tar at pathname (as given to tfs_mount) off the stack */
+int tfs_unmount(const char* pathname);
+/* unmounts everything; handles still open keep their archive until closed */
 void tfs_deinit();
+/*
+	mount the tars that changed on disk again, e.g. after they were
+	replaced. lookups and opens move to the new archive at once without
+	taking a lock, open handles go on reading the one they were opened on.
+	nothing changes when one of the tars fails to open
+*/
+int tfs_reload(void);
+/* tfs_reload whenever a mounted tar is rewritten or renamed over, from a thread watching their directories */
+int tfs_watch(void);
+void tfs_unwatch(void);
+/*
+	compressed archives: a checkpoint every span bytes of tar (default 4 MiB),
+	at most budget bytes of decompressed data cached (default 32 MiB); 0 keeps
+	the current value, takes effect on the next mount
+*/
+void tfs_zconfig(size_t span, size_t budget);
+/*
+	block cache shared by every handle on a plain (not mapped, not
+	compressed) archive: budget bytes (default 8 MiB, 0 disables) in blocks
+	of block_size (default 64 KiB). drops the current cache, so only call it
+	while no reads are in flight
+*/
+void tfs_cache_config(size_t budget, size_t block_size);
+
+#define TFS_CACHE_DEFAULT_BUDGET (8 << 20)
+#define TFS_CACHE_DEFAULT_BLOCK (64 << 10)
+
+struct tfs_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	/* blocks fetched beyond what a read asked for */
+	uint64_t readahead;
+	uint64_t evictions;
+	/* reads too large to go through the cache */
+	uint64_t bypass;
+	size_t used;
+	size_t budget;
+	size_t block_size;
+};
+
+void tfs_cache_getstats(struct tfs_cache_stats* stats);
+
+/* counters since start or tfs_stats_reset */
+struct tfs_stats {
+	uint64_t opens;
+	/* paths that are not in the archive or not a regular member */
+	uint64_t open_misses;
+	uint64_t closes;
+	/* tfs_fread calls and batch, async and cookie reads */
+	uint64_t reads;
+	uint64_t bytes_read;
+	uint64_t seeks;
+	struct tfs_cache_stats cache;
+};
+
+/* of one member of the current mount, zeroed on every mount */
+struct tfs_member_stats {
+	uint64_t opens;
+	uint64_t reads;
+	uint64_t bytes_read;
+};
+
+void tfs_stats_snapshot(struct tfs_stats* stats);
+int tfs_stats_member(tfs_entry_id id, struct tfs_member_stats* stats);
+void tfs_stats_reset(void);
+/* the counters as one json object, with the top members by bytes read */
+int tfs_stats_dump(FILE* fp, size_t top);
+
+/* trace events, delivered only in builds with TFS_WITH_TRACE (make TFS_TRACE=1) */
+#define TFS_TRACE_OPEN 1
+#define TFS_TRACE_READ 2
+#define TFS_TRACE_CLOSE 3
+
+struct tfs_trace_event {
+	int type;
+	/* TFS_ENTRY_NONE for an open that found nothing */
+	tfs_entry_id id;
+	/* as given to tfs_fopen, open only */
+	const char* path;
+	/* read: position in the member, bytes returned and time taken */
+	uint64_t offset;
+	size_t len;
+	uint64_t ns;
+};
+
+/* runs on the thread doing the access, keep it short */
+typedef void (*tfs_trace_cb)(void* user, const struct tfs_trace_event* ev);
+
+/* set or, with NULL, clear the hook; -1 with ENOTSUP when built without tracing */
+int tfs_trace(tfs_trace_cb cb, void* user);
+
+/*
+	a mount fails with EBADMSG on a header whose checksum does not match or
+	whose data runs past the end; this is its offset in the tar, -1 after
+	any other outcome. per thread
+*/
+int64_t tfs_corrupt_offset(void);
+
+/* save the index of a tar so later mounts skip the scan, NULL for <tar>.tfsidx */
+int tfs_writeindex(const char* pathname, const char* indexpath);
+
+struct tfs_pack_opts {
+	/* a power of two, 0 or 512 to leave offsets alone */
+	size_t align;
+	/* smaller members are not aligned */
+	uint64_t min_size;
+	/* file of member paths, one per line, to be put first in that order; NULL keeps the order */
+	const char* order;
+};
+
+/*
+	rewrite the plain tar in as out, padding so the data of members of at
+	least min_size starts on a multiple of align and ordering the members
+	by opts->order. NULL opts copies the archive as it is
+*/
+int tfs_pack(const char* in, const char* out, const struct tfs_pack_opts* opts);
+
+/* streaming, see tfs_stream.c */
+struct tfs_stream;
+
+struct tfs_stream_entry {
+	/* normalized, good until the next tfs_stream_next */
+	const char* path;
+	const char* linkpath;
+	uint64_t size;
+	int64_t mtime;
+	/* permission bits */
+	uint32_t mode;
+	/* ustar type flag, '0' for a regular file, '5' for a directory */
+	char type;
+};
+
+/*
+	read a plain or gzip tar from fp front to back, which need not be
+	seekable. the stream reads ahead of the member it is at, fp is not
+	good for anything else afterwards
+*/
+struct tfs_stream* tfs_stream_open(FILE* fp);
+/* the next member: 1, 0 at the end of the archive, -1 on error; unread data is skipped */
+int tfs_stream_next(struct tfs_stream* s, struct tfs_stream_entry* entry);
+/* up to len bytes of the current member's data, 0 once it is all read */
+ssize_t tfs_stream_read(struct tfs_stream* s, void* buf, size_t len);
+/* fp stays open */
+void tfs_stream_close(struct tfs_stream* s);
+
+/* index */
+/*
+	resolve "@/path" without opening it, TFS_ENTRY_NONE if absent. ids and
+	paths belong to the current mount and go stale after tfs_reload,
+	tfs_mount and tfs_unmount
+*/
+tfs_entry_id tfs_lookup(const char* pathname);
+const char* tfs_entry_path(tfs_entry_id id);
+uint64_t tfs_entry_size(tfs_entry_id id);
+/* raw ustar header, read from the archive on demand */
+struct ctar_t;
+int tfs_entry_header(tfs_entry_id id, struct ctar_t* header);
 
 /* generic */
 FILE* tfs_fopen(const char* pathname, const char* mode);
+/* open a member already found with tfs_lookup, skipping the path entirely */
+FILE* tfs_open_entry(tfs_entry_id id);
 size_t tfs_fread(void* ptr, size_t size, size_t nmemb, FILE* stream);
 int tfs_fseek(FILE* stream, long offset, int whence);
 long tfs_ftell(FILE* stream);
 size_t tfs_fwrite(const void* ptr, size_t size, size_t nmemb, FILE* stream);
 int tfs_fclose(FILE* stream);
+/* zero-copy view of the whole member, TFS_INIT_MMAP only */
+int tfs_getdata(FILE* stream, const void** ptr, size_t* len);
+
+/* one member range for tfs_readbatch */
+typedef struct {
+	/* "@/path", or NULL to use id */
+	const char* path;
+	tfs_entry_id id;
+	/* range inside the member, clipped to its size */
+	uint64_t offset;
+	size_t len;
+	void* dest;
+	/* out: bytes read, or -1 with error set to an errno value */
+	ssize_t result;
+	int error;
+} tfs_req;
+
+/*
+	read many member ranges in one call: they are sorted by archive offset
+	and neighbours merged into large reads. returns the number of failed
+	requests, -1 if nothing is mounted
+*/
+int tfs_readbatch(tfs_req* reqs, size_t n);
+
+/* asynchronous reads, see tfs_aio.c */
+#define TFS_AIO_AUTO 0
+#define TFS_AIO_URING 1
+#define TFS_AIO_THREADS 2
+
+/* completion of a tfs_read_async, run by tfs_aio_reap on its caller's thread */
+typedef void (*tfs_aio_cb)(void* user, ssize_t result, int error);
+
+/*
+	start the engine with up to depth reads in flight (0 for 64), on io_uring
+	when the kernel allows or a thread pool otherwise. optional, the first
+	read starts it with TFS_AIO_AUTO. returns the backend in use, -1 on error
+*/
+int tfs_aio_init(int backend, unsigned depth);
+/* waits out every read in flight, running their callbacks, and stops the engine */
+void tfs_aio_deinit(void);
+/* queue a read of up to len bytes at offset in a member, 0 once queued */
+int tfs_read_async(tfs_entry_id id, uint64_t offset, void* buf, size_t len, tfs_aio_cb cb, void* user);
+/* run the callbacks of finished reads, with wait blocks for one if any are in flight; returns how many ran */
+int tfs_aio_reap(int wait);
+/* readable while finished reads wait for tfs_aio_reap, for poll/epoll loops */
+int tfs_aio_fd(void);
+
+/* parallel traversal, see tfs_parallel.c */
+typedef struct {
+	tfs_entry_id id;
+	/* without "@/" */
+	const char* path;
+	/* of the whole member */
+	uint64_t size;
+	/* this piece of it */
+	uint64_t offset;
+	const void* data;
+	size_t len;
+} tfs_chunk;
+
+/* nonzero to visit the member */
+typedef int (*tfs_filter_cb)(void* user, tfs_entry_id id, const char* path);
+/* runs on any worker, data is only good during the call; nonzero stops the traversal */
+typedef int (*tfs_foreach_cb)(void* user, const tfs_chunk* chunk);
+
+/*
+	every regular file passing filter (NULL passes all) to cb on nthreads
+	threads, 0 for one per cpu. only the copy a path opens counts, members
+	replaced later in the tar or by a higher mount are left out. a member of up to 4 MiB comes whole in one
+	call, larger ones in pieces that may run at the same time on different
+	threads. returns 0, -1 on a read error, or what a callback stopped with
+*/
+int tfs_foreach_parallel(tfs_filter_cb filter, tfs_foreach_cb cb, void* user, unsigned nthreads);
+/*
+	write the mounted tree under dest_dir, created if missing: directories,
+	files, then links. the index keeps no modes or owners, files get 0644
+	and directories 0755 under the umask; mtimes are kept. returns the
+	number of entries that failed, -1 if nothing could be done
+*/
+int tfs_extract(const char* dest_dir, unsigned nthreads);
+
+/* directories, "@/" is the root of the archive */
+DIR* tfs_opendir(const char* name);
+struct dirent* tfs_readdir(DIR* dirp);
+int tfs_closedir(DIR* dirp);
+/*
+	from the index alone: read-only modes, no owner. like lstat, a symlink
+	at the end of the path is not followed; a hardlink is its target
+*/
+int tfs_stat(const char* pathname, struct stat* statbuf);
 
 /* error handling */
 void tfs_clearerr(FILE* stream);
@@ -52,6 +368,11 @@ int tfs_ferror(FILE* stream);
 	#define fwrite(ptr, size, nmemb, stream) tfs_fwrite(ptr, size, nmemb, stream)
 	#define fclose(stream) tfs_fclose(stream)
 
+	#define opendir(name) tfs_opendir(name)
+	#define readdir(dirp) tfs_readdir(dirp)
+	#define closedir(dirp) tfs_closedir(dirp)
+	#define stat(pathname, statbuf) tfs_stat(pathname, statbuf)
+
 	#define clearerr(stream) tfs_clearerr(stream)
 	#define ferror(stream) tfs_ferror(stream)
 #endif
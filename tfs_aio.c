@@ -0,0 +1,424 @@
+/*
+	asynchronous member reads
+
+	one engine per process. on io_uring (raw syscalls, no liburing) reads
+	of a plain archive go straight to the kernel and one thread can keep
+	depth of them in flight. without io_uring, or for compressed archives,
+	a pool of threads runs them through tfs_archive_read. mapped archives
+	complete on submit. finished reads wait on a done list until
+	tfs_aio_reap runs their callbacks, an eventfd tells poll about them
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "poll.h"
+#include "pthread.h"
+#include "sys/eventfd.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "sys/uio.h"
+#include "unistd.h"
+
+#include "linux/io_uring.h"
+
+#define TFS_AIO_DEFAULT_DEPTH 64
+#define TFS_AIO_THREADS_MAX 16
+/* io_uring lengths are 32 bit, longer reads go in pieces */
+#define TFS_AIO_MAX_PIECE (1u << 30)
+
+struct tfs_aio_op {
+	/* referenced until the callback has run */
+	struct tfs_archive* arc;
+	/* the tar read from, arc unless that is a union; off is in it */
+	const struct tfs_archive* src;
+	tfs_entry_id id;
+	char* buf;
+	size_t len;
+	uint64_t off;
+	size_t done;
+	int error;
+	struct iovec iov;
+	tfs_aio_cb cb;
+	void* user;
+	struct tfs_aio_op* next;
+};
+
+struct tfs_uring {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int backend;
+	unsigned depth;
+	int efd;
+	struct tfs_uring ring;
+	/* reads the kernel or the pool still owes */
+	unsigned inflight;
+	/* finished, for tfs_aio_reap */
+	struct tfs_aio_op* done;
+	struct tfs_aio_op** done_tail;
+	/* waiting for a pool thread */
+	struct tfs_aio_op* queue;
+	struct tfs_aio_op** queue_tail;
+	pthread_cond_t queue_cond;
+	/* inflight dropped below depth */
+	pthread_cond_t room_cond;
+	pthread_t threads[TFS_AIO_THREADS_MAX];
+	int nthreads;
+	int stopping;
+} tfs_aio = { .lock = PTHREAD_MUTEX_INITIALIZER, .efd = -1 };
+
+
+/* io_uring */
+
+static int tfs_uring_setup(struct tfs_uring* ring, unsigned depth, int efd){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, depth, &p);
+	if(fd < 0) return -1;
+	*ring = (struct tfs_uring){ .fd = fd };
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(ring->cq_len > ring->sq_len) ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	ring->cq_ptr = ring->cq_len? mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_CQ_RING): ring->sq_ptr;
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED
+		|| syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &efd, 1) != 0){
+		if(ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_len);
+		if(ring->cq_len && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_len);
+		if(ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_len);
+		close(fd);
+		ring->fd = -1;
+		return -1;
+	}
+	char* sq = ring->sq_ptr;
+	char* cq = ring->cq_ptr;
+	ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void tfs_uring_free(struct tfs_uring* ring){
+	munmap(ring->sqes, ring->sqes_len);
+	if(ring->cq_len) munmap(ring->cq_ptr, ring->cq_len);
+	munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* engine locked, the ring has room since inflight never exceeds depth */
+static int tfs_uring_submit(struct tfs_uring* ring, struct tfs_aio_op* op){
+	size_t left = op->len - op->done;
+	op->iov = (struct iovec){ op->buf + op->done, left < TFS_AIO_MAX_PIECE? left: TFS_AIO_MAX_PIECE };
+	unsigned tail = *ring->sq_tail;
+	unsigned slot = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[slot];
+	memset(sqe, 0, sizeof(*sqe));
+	/* readv rather than read, it goes back to the first io_uring kernels */
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = op->src->fd;
+	sqe->addr = (uintptr_t) &op->iov;
+	sqe->len = 1;
+	sqe->off = op->off + op->done;
+	sqe->user_data = (uintptr_t) op;
+	ring->sq_array[slot] = slot;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	int n;
+	do n = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	while(n < 0 && errno == EINTR);
+	if(n == 1) return 0;
+	/* not consumed, take it back */
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	return -1;
+}
+
+
+/* engine */
+
+/* engine locked */
+static void tfs_aio_finish(struct tfs_aio_op* op){
+	op->next = NULL;
+	*tfs_aio.done_tail = op;
+	tfs_aio.done_tail = &op->next;
+	--tfs_aio.inflight;
+	pthread_cond_broadcast(&tfs_aio.room_cond);
+}
+
+static void tfs_aio_signal(void){
+	uint64_t one = 1;
+	while(write(tfs_aio.efd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+/* engine locked, move completions off the ring, resubmitting short reads */
+static void tfs_uring_harvest(struct tfs_uring* ring){
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	struct tfs_aio_op* again = NULL;
+	for(; head != tail; ++head){
+		const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+		struct tfs_aio_op* op = (struct tfs_aio_op*) (uintptr_t) cqe->user_data;
+		int res = cqe->res;
+		if(res == -EINTR || res == -EAGAIN || (res > 0 && op->done + res < op->len)){
+			if(res > 0) op->done += res;
+			op->next = again;
+			again = op;
+			continue;
+		}
+		if(res < 0) op->error = -res;
+		else op->done += res;
+		tfs_aio_finish(op);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	while(again){
+		struct tfs_aio_op* op = again;
+		again = op->next;
+		if(tfs_uring_submit(ring, op) != 0){
+			op->error = errno;
+			tfs_aio_finish(op);
+		}
+	}
+}
+
+/* a queued read, done on the calling thread */
+static void tfs_aio_run(struct tfs_aio_op* op){
+	ssize_t n = tfs_archive_read(op->src, op->buf, op->len, op->off);
+	if(n < 0) op->error = errno;
+	else op->done = n;
+}
+
+static void* tfs_aio_worker(void* arg){
+	(void) arg;
+	pthread_mutex_lock(&tfs_aio.lock);
+	for(;;){
+		while(!tfs_aio.queue && !tfs_aio.stopping) pthread_cond_wait(&tfs_aio.queue_cond, &tfs_aio.lock);
+		struct tfs_aio_op* op = tfs_aio.queue;
+		if(!op) break;
+		tfs_aio.queue = op->next;
+		if(!tfs_aio.queue) tfs_aio.queue_tail = &tfs_aio.queue;
+		pthread_mutex_unlock(&tfs_aio.lock);
+		tfs_aio_run(op);
+		pthread_mutex_lock(&tfs_aio.lock);
+		tfs_aio_finish(op);
+		tfs_aio_signal();
+	}
+	pthread_mutex_unlock(&tfs_aio.lock);
+	return NULL;
+}
+
+/* engine locked */
+static int tfs_aio_start(int backend, unsigned depth){
+	if(!depth) depth = TFS_AIO_DEFAULT_DEPTH;
+	tfs_aio.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(tfs_aio.efd < 0) return -1;
+	tfs_aio.ring.fd = -1;
+	if(backend != TFS_AIO_THREADS && tfs_uring_setup(&tfs_aio.ring, depth, tfs_aio.efd) != 0
+		&& backend == TFS_AIO_URING){
+		close(tfs_aio.efd);
+		tfs_aio.efd = -1;
+		return -1;
+	}
+	tfs_aio.done_tail = &tfs_aio.done;
+	tfs_aio.queue_tail = &tfs_aio.queue;
+	pthread_cond_init(&tfs_aio.queue_cond, NULL);
+	pthread_cond_init(&tfs_aio.room_cond, NULL);
+	tfs_aio.stopping = 0;
+	tfs_aio.depth = depth;
+	/* a few threads even with io_uring, compressed archives still need them */
+	int nthreads = tfs_aio.ring.fd >= 0? 2: (int) depth;
+	if(nthreads > TFS_AIO_THREADS_MAX) nthreads = TFS_AIO_THREADS_MAX;
+	int rc = 0;
+	for(tfs_aio.nthreads = 0; tfs_aio.nthreads < nthreads; ++tfs_aio.nthreads){
+		rc = pthread_create(&tfs_aio.threads[tfs_aio.nthreads], NULL, tfs_aio_worker, NULL);
+		if(rc != 0) break;
+	}
+	/* io_uring manages without the pool, queued reads then run on the caller */
+	if(!tfs_aio.nthreads && tfs_aio.ring.fd < 0){
+		pthread_cond_destroy(&tfs_aio.queue_cond);
+		pthread_cond_destroy(&tfs_aio.room_cond);
+		close(tfs_aio.efd);
+		tfs_aio.efd = -1;
+		TFS_SETERRNO(rc);
+		return -1;
+	}
+	tfs_aio.backend = tfs_aio.ring.fd >= 0? TFS_AIO_URING: TFS_AIO_THREADS;
+	return tfs_aio.backend;
+}
+
+int tfs_aio_init(int backend, unsigned depth){
+	pthread_mutex_lock(&tfs_aio.lock);
+	int res = tfs_aio.backend? tfs_aio.backend: tfs_aio_start(backend, depth);
+	pthread_mutex_unlock(&tfs_aio.lock);
+	return res;
+}
+
+int tfs_aio_fd(void){
+	return tfs_aio_init(TFS_AIO_AUTO, 0) < 0? -1: tfs_aio.efd;
+}
+
+int tfs_read_async(tfs_entry_id id, uint64_t offset, void* buf, size_t len, tfs_aio_cb cb, void* user){
+	if(!cb || (!buf && len)){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_archive* arc = tfs_archive_acquire();
+	if(!arc || id < 0 || id >= arc->idx.count){
+		tfs_archive_release(arc);
+		TFS_SETERRNO(ENOENT);
+		return -1;
+	}
+	const struct tfs_index* idx = &arc->idx;
+	uint8_t type = idx->types[id];
+	int err = 0;
+	if(type == HARDLINK || type == SYMLINK){
+		/* ids from readdir may name a link, read its target as fopen would */
+		uint32_t target = idx->targets[id];
+		if(!target || target >= TFS_TARGET_DANGLING) err = target == TFS_TARGET_LOOP? ELOOP: ENOENT;
+		else type = idx->types[id = target - 1];
+	}
+	if(!err && type != REGULAR && type != NORMAL && type != CONTIGUOUS) err = type == DIRECTORY? EISDIR: ENOENT;
+	struct tfs_aio_op* op = NULL;
+	if(err) TFS_SETERRNO(err);
+	else if(tfs_aio_init(TFS_AIO_AUTO, 0) >= 0) op = calloc(1, sizeof(*op));
+	if(!op){
+		tfs_archive_release(arc);
+		return -1;
+	}
+	uint64_t size = idx->sizes[id];
+	uint64_t off = idx->offsets[id] + offset;
+	const struct tfs_archive* src = tfs_archive_layer(arc, &off);
+	*op = (struct tfs_aio_op){
+		.arc = arc,
+		.src = src,
+		.id = id,
+		.buf = buf,
+		.len = offset >= size? 0: size - offset < len? size - offset: len,
+		.off = off,
+		.cb = cb,
+		.user = user,
+	};
+
+	pthread_mutex_lock(&tfs_aio.lock);
+	/* back-pressure: the ring and the completion queue hold depth reads */
+	while(tfs_aio.inflight >= tfs_aio.depth){
+		if(tfs_aio.ring.fd >= 0){
+			tfs_uring_harvest(&tfs_aio.ring);
+			if(tfs_aio.inflight < tfs_aio.depth) break;
+			pthread_mutex_unlock(&tfs_aio.lock);
+			struct pollfd pfd = { tfs_aio.efd, POLLIN, 0 };
+			poll(&pfd, 1, 1);
+			pthread_mutex_lock(&tfs_aio.lock);
+		}else pthread_cond_wait(&tfs_aio.room_cond, &tfs_aio.lock);
+	}
+	++tfs_aio.inflight;
+	if(src->map || op->len == 0){
+		/* nothing to wait for */
+		if(op->len) memcpy(op->buf, src->map + op->off, op->len);
+		op->done = op->len;
+		tfs_aio_finish(op);
+		tfs_aio_signal();
+	}else if(tfs_aio.ring.fd >= 0 && !src->z && tfs_uring_submit(&tfs_aio.ring, op) == 0){
+		/* the kernel has it */
+	}else if(tfs_aio.nthreads){
+		op->next = NULL;
+		*tfs_aio.queue_tail = op;
+		tfs_aio.queue_tail = &op->next;
+		pthread_cond_signal(&tfs_aio.queue_cond);
+	}else{
+		/* no thread to hand it to */
+		pthread_mutex_unlock(&tfs_aio.lock);
+		tfs_aio_run(op);
+		pthread_mutex_lock(&tfs_aio.lock);
+		tfs_aio_finish(op);
+		tfs_aio_signal();
+	}
+	pthread_mutex_unlock(&tfs_aio.lock);
+	return 0;
+}
+
+int tfs_aio_reap(int wait){
+	if(!tfs_aio.backend) return 0;
+	struct tfs_aio_op* done;
+	for(;;){
+		uint64_t count;
+		while(read(tfs_aio.efd, &count, sizeof(count)) < 0 && errno == EINTR);
+		pthread_mutex_lock(&tfs_aio.lock);
+		if(tfs_aio.ring.fd >= 0) tfs_uring_harvest(&tfs_aio.ring);
+		done = tfs_aio.done;
+		tfs_aio.done = NULL;
+		tfs_aio.done_tail = &tfs_aio.done;
+		unsigned inflight = tfs_aio.inflight;
+		pthread_mutex_unlock(&tfs_aio.lock);
+		if(done || !wait || !inflight) break;
+		struct pollfd pfd = { tfs_aio.efd, POLLIN, 0 };
+		poll(&pfd, 1, -1);
+	}
+	/* callbacks run unlocked, they may queue more reads */
+	int n = 0;
+	while(done){
+		struct tfs_aio_op* op = done;
+		done = op->next;
+		if(!op->error) tfs_stats_read(op->arc, op->id, op->done);
+		op->cb(op->user, op->error? -1: (ssize_t) op->done, op->error);
+		tfs_archive_release(op->arc);
+		free(op);
+		++n;
+	}
+	return n;
+}
+
+void tfs_aio_deinit(void){
+	if(!tfs_aio.backend) return;
+	for(;;){
+		pthread_mutex_lock(&tfs_aio.lock);
+		unsigned inflight = tfs_aio.inflight;
+		int pending = tfs_aio.done != NULL;
+		pthread_mutex_unlock(&tfs_aio.lock);
+		if(!inflight && !pending) break;
+		tfs_aio_reap(1);
+	}
+	pthread_mutex_lock(&tfs_aio.lock);
+	tfs_aio.stopping = 1;
+	pthread_cond_broadcast(&tfs_aio.queue_cond);
+	pthread_mutex_unlock(&tfs_aio.lock);
+	for(int i = 0; i < tfs_aio.nthreads; ++i) pthread_join(tfs_aio.threads[i], NULL);
+	if(tfs_aio.ring.fd >= 0) tfs_uring_free(&tfs_aio.ring);
+	close(tfs_aio.efd);
+	pthread_cond_destroy(&tfs_aio.queue_cond);
+	pthread_cond_destroy(&tfs_aio.room_cond);
+	pthread_mutex_lock(&tfs_aio.lock);
+	tfs_aio.efd = -1;
+	tfs_aio.nthreads = 0;
+	tfs_aio.backend = 0;
+	pthread_mutex_unlock(&tfs_aio.lock);
+}
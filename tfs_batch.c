@@ -0,0 +1,177 @@
+/*
+	batched member reads
+
+	every range is resolved to an archive offset first, then the ranges are
+	read in archive order. on a descriptor, neighbours closer than
+	TFS_BATCH_GAP are merged into one preadv that scatters straight into the
+	callers' buffers, the gaps going to a scratch sink
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "sys/uio.h"
+#include "unistd.h"
+
+/* largest hole read through rather than split at */
+#define TFS_BATCH_GAP (64 << 10)
+/* largest single merged read */
+#define TFS_BATCH_MAX_RUN (8 << 20)
+/* iovecs per preadv, IOV_MAX on linux */
+#define TFS_BATCH_IOV 1024
+
+struct tfs_span {
+	uint64_t off;
+	size_t len;
+	tfs_req* req;
+	tfs_entry_id id;
+};
+
+static int tfs_span_cmp(const void* a, const void* b){
+	uint64_t x = ((const struct tfs_span*) a)->off, y = ((const struct tfs_span*) b)->off;
+	return x < y? -1: x > y;
+}
+
+static void tfs_req_fail(tfs_req* req, int error){
+	req->result = -1;
+	req->error = error;
+}
+
+/* one range at a time, for sources that are not a plain descriptor and after a short preadv */
+static void tfs_span_read(const struct tfs_archive* arc, struct tfs_span* span){
+	ssize_t n = tfs_archive_read(arc, span->req->dest, span->len, span->off);
+	if(n < 0) tfs_req_fail(span->req, errno);
+	else span->req->result = n;
+}
+
+/* spans[0..count) as one preadv, they are sorted and do not overlap */
+static void tfs_span_run(const struct tfs_archive* arc, struct tfs_span* spans, size_t count, char* sink){
+	/* in a union, neighbours are always in the same tar, which may not be a plain one */
+	uint64_t at = spans[0].off;
+	const struct tfs_archive* src = tfs_archive_layer(arc, &at);
+	if(src->map || src->z){
+		for(size_t i = 0; i < count; ++i) tfs_span_read(arc, &spans[i]);
+		return;
+	}
+	struct iovec iov[TFS_BATCH_IOV];
+	int niov = 0;
+	uint64_t pos = spans[0].off;
+	for(size_t i = 0; i < count; ++i){
+		if(spans[i].off > pos) iov[niov++] = (struct iovec){ sink, spans[i].off - pos };
+		iov[niov++] = (struct iovec){ spans[i].req->dest, spans[i].len };
+		pos = spans[i].off + spans[i].len;
+	}
+	size_t total = pos - spans[0].off;
+	ssize_t got;
+	do got = preadv(src->fd, iov, niov, at);
+	while(got < 0 && errno == EINTR);
+	if(got == (ssize_t) total){
+		for(size_t i = 0; i < count; ++i) spans[i].req->result = spans[i].len;
+		return;
+	}
+	/* short or failed, let the ordinary path sort it out */
+	for(size_t i = 0; i < count; ++i) tfs_span_read(arc, &spans[i]);
+}
+
+int tfs_readbatch(tfs_req* reqs, size_t n){
+	if(!reqs){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_archive* arc = tfs_archive_acquire();
+	if(!arc){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_span* spans = malloc((n? n: 1) * sizeof(*spans));
+	if(!spans){
+		tfs_archive_release(arc);
+		return -1;
+	}
+	const struct tfs_index* idx = &arc->idx;
+	size_t count = 0;
+	int failed = 0;
+
+	for(size_t i = 0; i < n; ++i){
+		tfs_req* req = &reqs[i];
+		req->result = 0;
+		req->error = 0;
+		tfs_entry_id id = req->path? tfs_archive_lookup(arc, req->path): req->id;
+		if(id < 0 || id >= idx->count){
+			tfs_req_fail(req, ENOENT);
+			++failed;
+			continue;
+		}
+		uint8_t type = idx->types[id];
+		if(type == HARDLINK || type == SYMLINK){
+			/* read what the link names, as fopen would */
+			uint32_t target = idx->targets[id];
+			if(!target || target >= TFS_TARGET_DANGLING){
+				tfs_req_fail(req, target == TFS_TARGET_LOOP? ELOOP: ENOENT);
+				++failed;
+				continue;
+			}
+			id = target - 1;
+			type = idx->types[id];
+		}
+		if(type != REGULAR && type != NORMAL && type != CONTIGUOUS){
+			tfs_req_fail(req, type == DIRECTORY? EISDIR: ENOENT);
+			++failed;
+			continue;
+		}
+		if(!req->dest && req->len){
+			tfs_req_fail(req, EFAULT);
+			++failed;
+			continue;
+		}
+		uint64_t size = idx->sizes[id];
+		if(req->offset >= size || !req->len) continue;
+		size_t len = size - req->offset < req->len? size - req->offset: req->len;
+		spans[count++] = (struct tfs_span){ idx->offsets[id] + req->offset, len, req, id };
+	}
+
+	/* mapped and memory archives are a memcpy each, order is irrelevant */
+	if(arc->map){
+		for(size_t i = 0; i < count; ++i) tfs_span_read(arc, &spans[i]);
+		goto out;
+	}
+	qsort(spans, count, sizeof(*spans), tfs_span_cmp);
+
+	/* compressed archives decompress forward, so sorted is the whole win */
+	char* sink = arc->z? NULL: malloc(TFS_BATCH_GAP);
+	if(!sink){
+		for(size_t i = 0; i < count; ++i) tfs_span_read(arc, &spans[i]);
+	}else{
+		for(size_t first = 0; first < count; ){
+			size_t last = first + 1;
+			uint64_t end = spans[first].off + spans[first].len;
+			int niov = 1;
+			while(last < count){
+				const struct tfs_span* next = &spans[last];
+				/* overlapping ranges would need two copies of the same bytes */
+				if(next->off < end || next->off - end > TFS_BATCH_GAP
+					|| next->off + next->len - spans[first].off > TFS_BATCH_MAX_RUN
+					|| niov + 2 > TFS_BATCH_IOV)
+					break;
+				niov += next->off > end? 2: 1;
+				end = next->off + next->len;
+				++last;
+			}
+			if(last - first == 1 || spans[first].len >= TFS_BATCH_MAX_RUN) tfs_span_read(arc, &spans[first]);
+			else tfs_span_run(arc, spans + first, last - first, sink);
+			first = last;
+		}
+	}
+	free(sink);
+out:
+	for(size_t i = 0; i < count; ++i){
+		if(spans[i].req->result < 0) ++failed;
+		else tfs_stats_read(arc, spans[i].id, spans[i].req->result);
+	}
+	free(spans);
+	tfs_archive_release(arc);
+	return failed;
+}
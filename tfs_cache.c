@@ -0,0 +1,325 @@
+/*
+	shared block cache for archives read through a descriptor
+
+	blocks are keyed by (archive serial, offset) so every handle, and every
+	member sharing a block, hits the same copy. the cache is split into
+	shards by key hash, each with its own lock and CLOCK hand. the cache
+	itself is one published pointer: readers take a reference on it
+	between tfs_archive_enter and leave, so tfs_cache_config can swap it
+	like an archive generation without waiting on their reads
+*/
+
+#include "tfs_internal.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "pthread.h"
+#include "stdatomic.h"
+#include "unistd.h"
+
+#define TFS_CACHE_SHARDS 8
+/* largest single read issued, demand plus read-ahead */
+#define TFS_CACHE_MAX_RUN (1 << 20)
+
+struct tfs_cblock {
+	uint64_t serial;
+	uint64_t off;
+	uint32_t len;
+	/* CLOCK reference bit */
+	uint8_t ref;
+	uint8_t valid;
+	int32_t hnext;
+	char* data;
+};
+
+struct tfs_cshard {
+	pthread_mutex_t lock;
+	struct tfs_cblock* blocks;
+	uint32_t nblocks;
+	uint32_t hand;
+	int32_t* buckets;
+	uint32_t mask;
+};
+
+struct tfs_cache {
+	/* the published one holds one, every read in flight another */
+	atomic_uint refs;
+	size_t block_size;
+	size_t budget;
+	struct tfs_cshard shards[TFS_CACHE_SHARDS];
+};
+
+static _Atomic(struct tfs_cache*) tfs_cache = NULL;
+static pthread_once_t tfs_cache_once = PTHREAD_ONCE_INIT;
+
+static atomic_uint_fast64_t tfs_cache_hits;
+static atomic_uint_fast64_t tfs_cache_misses;
+static atomic_uint_fast64_t tfs_cache_readahead;
+static atomic_uint_fast64_t tfs_cache_evictions;
+static atomic_uint_fast64_t tfs_cache_bypass;
+static atomic_size_t tfs_cache_used;
+
+static void tfs_cache_destroy(struct tfs_cache* cache){
+	if(!cache) return;
+	for(int i = 0; i < TFS_CACHE_SHARDS; ++i){
+		struct tfs_cshard* shard = &cache->shards[i];
+		for(uint32_t k = 0; k < shard->nblocks; ++k){
+			if(!shard->blocks[k].data) continue;
+			free(shard->blocks[k].data);
+			atomic_fetch_sub_explicit(&tfs_cache_used, cache->block_size, memory_order_relaxed);
+		}
+		free(shard->blocks);
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache);
+}
+
+static struct tfs_cache* tfs_cache_create(size_t budget, size_t block_size){
+	if(!budget) return NULL;
+	struct tfs_cache* cache = calloc(1, sizeof(*cache));
+	if(!cache) return NULL;
+	atomic_init(&cache->refs, 1);
+	cache->budget = budget;
+	cache->block_size = block_size;
+	uint32_t per_shard = budget / block_size / TFS_CACHE_SHARDS;
+	if(per_shard < 2) per_shard = 2;
+	for(int i = 0; i < TFS_CACHE_SHARDS; ++i){
+		struct tfs_cshard* shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		uint32_t nbuckets = 4;
+		while(nbuckets < per_shard * 2) nbuckets <<= 1;
+		shard->nblocks = per_shard;
+		shard->blocks = calloc(per_shard, sizeof(*shard->blocks));
+		shard->buckets = malloc(nbuckets * sizeof(*shard->buckets));
+		shard->mask = nbuckets - 1;
+		if(!shard->blocks || !shard->buckets){
+			tfs_cache_destroy(cache);
+			return NULL;
+		}
+		memset(shard->buckets, 0xff, nbuckets * sizeof(*shard->buckets));
+	}
+	return cache;
+}
+
+static struct tfs_cache* tfs_cache_acquire(void){
+	unsigned token;
+	tfs_archive_enter(&token);
+	struct tfs_cache* cache = atomic_load(&tfs_cache);
+	if(cache) atomic_fetch_add(&cache->refs, 1);
+	tfs_archive_leave(token);
+	return cache;
+}
+
+static void tfs_cache_release(struct tfs_cache* cache){
+	if(cache && atomic_fetch_sub(&cache->refs, 1) == 1) tfs_cache_destroy(cache);
+}
+
+static void tfs_cache_default(void){
+	tfs_cache = tfs_cache_create(TFS_CACHE_DEFAULT_BUDGET, TFS_CACHE_DEFAULT_BLOCK);
+}
+
+void tfs_cache_config(size_t budget, size_t block_size){
+	pthread_once(&tfs_cache_once, tfs_cache_default);
+	if(!block_size) block_size = TFS_CACHE_DEFAULT_BLOCK;
+	/* whole pages, a power of two so offsets split with a mask */
+	size_t bs = 4096;
+	while(bs < block_size && bs < TFS_CACHE_MAX_RUN) bs <<= 1;
+	struct tfs_cache* old = atomic_exchange(&tfs_cache, tfs_cache_create(budget, bs));
+	/* no reader can take a new reference once this returns, the last one frees it */
+	tfs_archive_synchronize();
+	tfs_cache_release(old);
+}
+
+void tfs_cache_getstats(struct tfs_cache_stats* stats){
+	if(!stats) return;
+	pthread_once(&tfs_cache_once, tfs_cache_default);
+	stats->hits = atomic_load(&tfs_cache_hits);
+	stats->misses = atomic_load(&tfs_cache_misses);
+	stats->readahead = atomic_load(&tfs_cache_readahead);
+	stats->evictions = atomic_load(&tfs_cache_evictions);
+	stats->bypass = atomic_load(&tfs_cache_bypass);
+	stats->used = atomic_load(&tfs_cache_used);
+	struct tfs_cache* cache = tfs_cache_acquire();
+	stats->budget = cache? cache->budget: 0;
+	stats->block_size = cache? cache->block_size: 0;
+	tfs_cache_release(cache);
+}
+
+static uint32_t tfs_cache_hashkey(uint64_t serial, uint64_t off){
+	uint64_t h = (serial * 0x9e3779b97f4a7c15ull) ^ (off * 0xc2b2ae3d27d4eb4full);
+	return (uint32_t) (h ^ (h >> 29));
+}
+
+static struct tfs_cshard* tfs_cache_shard(struct tfs_cache* cache, uint32_t h){
+	return &cache->shards[(h >> 24) % TFS_CACHE_SHARDS];
+}
+
+/* shard locked */
+static struct tfs_cblock* tfs_cache_find(struct tfs_cshard* shard, uint32_t h, uint64_t serial, uint64_t off){
+	for(int32_t i = shard->buckets[h & shard->mask]; i >= 0; i = shard->blocks[i].hnext){
+		struct tfs_cblock* block = &shard->blocks[i];
+		if(block->serial == serial && block->off == off) return block;
+	}
+	return NULL;
+}
+
+/* shard locked, a block to refill: free ones first, then the CLOCK victim */
+static struct tfs_cblock* tfs_cache_victim(struct tfs_cshard* shard, size_t block_size){
+	for(;;){
+		struct tfs_cblock* block = &shard->blocks[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->nblocks;
+		if(block->valid && block->ref){
+			block->ref = 0;
+			continue;
+		}
+		if(block->valid){
+			/* unlink from its chain */
+			int32_t self = block - shard->blocks;
+			uint32_t h = tfs_cache_hashkey(block->serial, block->off);
+			int32_t* link = &shard->buckets[h & shard->mask];
+			while(*link != self) link = &shard->blocks[*link].hnext;
+			*link = block->hnext;
+			block->valid = 0;
+			atomic_fetch_add_explicit(&tfs_cache_evictions, 1, memory_order_relaxed);
+		}
+		if(!block->data){
+			block->data = malloc(block_size);
+			if(!block->data) return NULL;
+			atomic_fetch_add_explicit(&tfs_cache_used, block_size, memory_order_relaxed);
+		}
+		return block;
+	}
+}
+
+static void tfs_cache_insert(struct tfs_cache* cache, uint64_t serial, uint64_t off, const char* data, size_t len){
+	uint32_t h = tfs_cache_hashkey(serial, off);
+	struct tfs_cshard* shard = tfs_cache_shard(cache, h);
+	pthread_mutex_lock(&shard->lock);
+	if(!tfs_cache_find(shard, h, serial, off)){
+		struct tfs_cblock* block = tfs_cache_victim(shard, cache->block_size);
+		if(block){
+			memcpy(block->data, data, len);
+			block->serial = serial;
+			block->off = off;
+			block->len = len;
+			block->ref = 0;
+			block->valid = 1;
+			block->hnext = shard->buckets[h & shard->mask];
+			shard->buckets[h & shard->mask] = block - shard->blocks;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* copy a cached block out, -1 on a miss */
+static ssize_t tfs_cache_copy(struct tfs_cache* cache, uint64_t serial, uint64_t off, char* dst,
+	size_t skip, size_t len){
+
+	uint32_t h = tfs_cache_hashkey(serial, off);
+	struct tfs_cshard* shard = tfs_cache_shard(cache, h);
+	ssize_t res = -1;
+	pthread_mutex_lock(&shard->lock);
+	struct tfs_cblock* block = tfs_cache_find(shard, h, serial, off);
+	if(block){
+		block->ref = 1;
+		if(skip >= block->len) res = 0;
+		else{
+			if(len > block->len - skip) len = block->len - skip;
+			memcpy(dst, block->data + skip, len);
+			res = len;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+static ssize_t tfs_cache_pread(int fd, char* buf, size_t len, uint64_t off){
+	size_t got = 0;
+	while(got < len){
+		ssize_t n = pread(fd, buf + got, len - got, off + got);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return got? (ssize_t) got: -1;
+		if(n == 0) break;
+		got += n;
+	}
+	return got;
+}
+
+/*
+	sequential handles double their read-ahead on every read that starts
+	where the previous one ended, anything else resets it
+*/
+static size_t tfs_cache_readahead_size(struct tfs_readahead* ra, uint64_t off, size_t len, size_t block_size){
+	if(!ra) return 0;
+	if(off == ra->next && ra->next){
+		ra->size = ra->size? ra->size * 2: 2 * block_size;
+		if(ra->size > TFS_CACHE_MAX_RUN) ra->size = TFS_CACHE_MAX_RUN;
+	}else ra->size = 0;
+	ra->next = off + len;
+	return ra->size;
+}
+
+ssize_t tfs_cache_read(const struct tfs_archive* arc, void* _buf, size_t len, uint64_t off,
+	struct tfs_readahead* ra){
+
+	pthread_once(&tfs_cache_once, tfs_cache_default);
+	struct tfs_cache* cache = tfs_cache_acquire();
+	char* buf = _buf;
+	if(!cache || len >= TFS_CACHE_MAX_RUN){
+		tfs_cache_release(cache);
+		if(cache) atomic_fetch_add_explicit(&tfs_cache_bypass, 1, memory_order_relaxed);
+		if(ra) ra->next = 0;
+		return tfs_cache_pread(arc->fd, buf, len, off);
+	}
+	size_t bs = cache->block_size;
+	uint64_t end = off + len;
+	uint64_t ahead = tfs_cache_readahead_size(ra, off, len, bs);
+	size_t done = 0;
+	int failed = 0;
+
+	for(uint64_t pos = off; pos < end; ){
+		uint64_t boff = pos & ~(uint64_t) (bs - 1);
+		ssize_t n = tfs_cache_copy(cache, arc->serial, boff, buf + done, pos - boff, end - pos);
+		if(n > 0){
+			atomic_fetch_add_explicit(&tfs_cache_hits, 1, memory_order_relaxed);
+			pos += n;
+			done += n;
+			continue;
+		}
+		if(n == 0) break;
+
+		/* miss: fetch up to the end of the request plus read-ahead in one go */
+		atomic_fetch_add_explicit(&tfs_cache_misses, 1, memory_order_relaxed);
+		uint64_t run_end = end + ahead;
+		if(run_end > arc->size) run_end = arc->size;
+		run_end = (run_end + bs - 1) & ~(uint64_t) (bs - 1);
+		if(run_end - boff > TFS_CACHE_MAX_RUN) run_end = boff + TFS_CACHE_MAX_RUN;
+		if(run_end <= boff) run_end = boff + bs;
+		char* run = malloc(run_end - boff);
+		if(!run) TFS_SETERRNO(ENOMEM);
+		ssize_t got = run? tfs_cache_pread(arc->fd, run, run_end - boff, boff): -1;
+		if(got <= 0){
+			free(run);
+			failed = got < 0;
+			break;
+		}
+		for(uint64_t b = 0; b < (uint64_t) got; b += bs){
+			size_t blen = (uint64_t) got - b < bs? got - b: bs;
+			tfs_cache_insert(cache, arc->serial, boff + b, run + b, blen);
+			if(boff + b >= end)
+				atomic_fetch_add_explicit(&tfs_cache_readahead, 1, memory_order_relaxed);
+		}
+		size_t take = (uint64_t) got > pos - boff? got - (pos - boff): 0;
+		if(take > end - pos) take = end - pos;
+		memcpy(buf + done, run + (pos - boff), take);
+		free(run);
+		pos += take;
+		done += take;
+		if(take == 0) break;
+	}
+	tfs_cache_release(cache);
+	/* what was copied before a failure is still a short read */
+	return failed && !done? -1: (ssize_t) done;
+}
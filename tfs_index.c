@@ -0,0 +1,729 @@
+/* mkostemp */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+/*
+	normalize a member path into out (at most size bytes including '\0'):
+	leading '/' and "./" are dropped, "//" and "/./" collapsed, ".." folded
+	and trailing '/' removed. returns the length, or -1 if it does not fit
+*/
+int tfs_normpath(const char* path, size_t len, char* out, size_t size){
+	size_t n = 0;
+	const char* end = path + len;
+	while(path < end){
+		const char* comp = path;
+		while(path < end && *path != '/') ++path;
+		size_t clen = path - comp;
+		if(path < end) ++path;
+		if(clen == 0 || (clen == 1 && comp[0] == '.')) continue;
+		if(clen == 2 && comp[0] == '.' && comp[1] == '.'){
+			while(n > 0 && out[n - 1] != '/') --n;
+			if(n > 0) --n;
+			continue;
+		}
+		if(n + (n? 1: 0) + clen + 1 > size) return -1;
+		if(n) out[n++] = '/';
+		memcpy(out + n, comp, clen);
+		n += clen;
+	}
+	if(size == 0) return -1;
+	out[n] = '\0';
+	return n;
+}
+
+/* FNV-1a */
+uint32_t tfs_hash(const char* str){
+	uint32_t h = 2166136261u;
+	while(*str) h = (h ^ (unsigned char) *str++) * 16777619u;
+	return h;
+}
+
+/* the same over the first len bytes */
+static uint32_t tfs_hashn(const char* str, size_t len){
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; ++i) h = (h ^ (unsigned char) str[i]) * 16777619u;
+	return h;
+}
+
+
+/* builder */
+
+#define TFS_GROW(arr, cap) do{ \
+		void* grown_ = realloc(arr, (cap) * sizeof(*(arr))); \
+		if(grown_) arr = grown_; \
+		else ok = 0; \
+	}while(0)
+
+/*
+	a link target as a path from the root: symlinks are relative to their
+	directory unless absolute, hardlinks name a member. -1 if it does not fit
+*/
+static int tfs_link_target(const char* path, const char* link, uint8_t type, char* out){
+	char joined[TFS_PATH_MAX];
+	const char* slash = strrchr(path, '/');
+	if(type == SYMLINK && link[0] != '/' && slash){
+		if(snprintf(joined, sizeof(joined), "%.*s/%s", (int) (slash - path), path, link) >= (int) sizeof(joined))
+			return -1;
+		link = joined;
+	}
+	return tfs_normpath(link, strlen(link), out, TFS_PATH_MAX);
+}
+
+int tfs_builder_add(struct tfs_builder* b, const char* path, const char* link, uint64_t offset,
+	uint64_t size, int64_t mtime, uint8_t type){
+
+	/* "./", the tar's own top, is the root every index has anyway */
+	if(!*path) return 0;
+	char target[TFS_PATH_MAX];
+	int target_len = -1;
+	if((type == SYMLINK || type == HARDLINK) && link && *link) target_len = tfs_link_target(path, link, type, target);
+
+	if(b->count == b->cap){
+		uint32_t cap = b->cap? b->cap * 2: 1024;
+		int ok = 1;
+		TFS_GROW(b->offsets, cap);
+		TFS_GROW(b->sizes, cap);
+		TFS_GROW(b->mtimes, cap);
+		TFS_GROW(b->names, cap);
+		TFS_GROW(b->types, cap);
+		TFS_GROW(b->links, cap);
+		TFS_GROW(b->hashes, cap);
+		TFS_GROW(b->parents, cap);
+		TFS_GROW(b->canon, cap);
+		if(!ok) return -1;
+		b->cap = cap;
+	}
+	size_t len = strlen(path) + 1;
+	size_t need = len + (target_len < 0? 0: target_len + 1);
+	if(b->pool_len + need > b->pool_cap){
+		size_t cap = b->pool_cap? b->pool_cap * 2: 64 << 10;
+		while(cap < b->pool_len + need) cap *= 2;
+		char* pool = realloc(b->pool, cap);
+		if(!pool) return -1;
+		b->pool = pool;
+		b->pool_cap = cap;
+	}
+	memcpy(b->pool + b->pool_len, path, len);
+
+	uint32_t i = b->count++;
+	b->offsets[i] = offset;
+	b->sizes[i] = size;
+	b->mtimes[i] = mtime;
+	b->names[i] = b->pool_len;
+	b->types[i] = type;
+	b->hashes[i] = tfs_hashn(path, len - 1);
+	b->pool_len += len;
+	/* a target that does not fit is left dangling */
+	b->links[i] = 0;
+	if(target_len >= 0){
+		memcpy(b->pool + b->pool_len, target, target_len + 1);
+		b->links[i] = b->pool_len + 1;
+		b->pool_len += target_len + 1;
+	}
+	return 0;
+}
+
+void tfs_builder_free(struct tfs_builder* b){
+	free(b->offsets);
+	free(b->sizes);
+	free(b->mtimes);
+	free(b->names);
+	free(b->types);
+	free(b->links);
+	free(b->hashes);
+	free(b->parents);
+	free(b->canon);
+	free(b->pool);
+	memset(b, 0, sizeof(*b));
+}
+
+/*
+	open addressing over builder entries, the path hash in the high half of
+	a slot and entry + 1 in the low one, so probes rarely touch the pool
+	and growing never hashes a path again
+*/
+struct tfs_pathset {
+	uint64_t* slots;
+	uint32_t mask;
+	uint32_t used;
+};
+
+static uint64_t* tfs_pathset_find(struct tfs_pathset* set, const struct tfs_builder* b,
+	const char* path, size_t len, uint32_t h){
+
+	for(uint32_t slot = h & set->mask;; slot = (slot + 1) & set->mask){
+		uint64_t v = set->slots[slot];
+		if(!v) return &set->slots[slot];
+		if((uint32_t) (v >> 32) == h){
+			const char* other = b->pool + b->names[(uint32_t) v - 1];
+			if(!memcmp(other, path, len) && other[len] == '\0') return &set->slots[slot];
+		}
+	}
+}
+
+static int tfs_pathset_grow(struct tfs_pathset* set, uint32_t slot_count){
+	uint64_t* slots = calloc(slot_count, sizeof(*slots));
+	if(!slots) return -1;
+	uint32_t mask = slot_count - 1;
+	for(uint32_t i = 0; set->slots && i <= set->mask; ++i){
+		uint64_t v = set->slots[i];
+		if(!v) continue;
+		uint32_t slot = (uint32_t) (v >> 32) & mask;
+		while(slots[slot]) slot = (slot + 1) & mask;
+		slots[slot] = v;
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->mask = mask;
+	return 0;
+}
+
+/* entry i goes in, replacing an earlier one of the same path */
+static int tfs_pathset_put(struct tfs_pathset* set, struct tfs_builder* b, uint32_t i, uint32_t len){
+	uint32_t h = b->hashes[i];
+	uint64_t* slot = tfs_pathset_find(set, b, b->pool + b->names[i], len, h);
+	if(*slot) b->canon[i] = b->canon[(uint32_t) *slot - 1];
+	else{
+		b->canon[i] = i;
+		++set->used;
+	}
+	*slot = (uint64_t) h << 32 | (i + 1);
+	if(set->used * 2 > set->mask) return tfs_pathset_grow(set, (set->mask + 1) * 2);
+	return 0;
+}
+
+/*
+	the entry of directory path[0..len), which when missing is added, as
+	extraction would create it, along with whatever ancestors it lacks
+*/
+static int64_t tfs_builder_dir(struct tfs_builder* b, struct tfs_pathset* set, const char* path,
+	uint32_t len, int64_t mtime){
+
+	/* up to the nearest ancestor there is */
+	uint32_t have = len;
+	int64_t parent = UINT32_MAX;
+	while(have){
+		uint64_t* slot = tfs_pathset_find(set, b, path, have, tfs_hashn(path, have));
+		if(*slot){
+			parent = (uint32_t) *slot - 1;
+			break;
+		}
+		while(have && path[have - 1] != '/') --have;
+		if(have) --have;
+	}
+	if(have == len) return parent;
+
+	/* then down again adding the rest; path may be in the pool, which adding moves */
+	char dir[TFS_PATH_MAX];
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+	for(uint32_t end = have? have + 1: 0; end < len; ++end){
+		while(end < len && dir[end] != '/') ++end;
+		dir[end] = '\0';
+		if(tfs_builder_add(b, dir, NULL, 0, 0, mtime, DIRECTORY) != 0) return -1;
+		uint32_t id = b->count - 1;
+		b->parents[id] = parent;
+		if(tfs_pathset_put(set, b, id, end) != 0) return -1;
+		if(end < len) dir[end] = '/';
+		parent = id;
+	}
+	return parent;
+}
+
+/*
+	dedupe paths, add the implicit directories and find every entry's
+	parent, the root being UINT32_MAX until the count is final. returns
+	the number of members, -1 on error
+*/
+static int64_t tfs_builder_resolve(struct tfs_builder* b, struct tfs_pathset* set){
+	uint32_t members = b->count;
+	uint32_t slot_count = 16;
+	while(slot_count < (uint64_t) members * 2) slot_count <<= 1;
+	if(tfs_pathset_grow(set, slot_count) != 0) return -1;
+	for(uint32_t i = 0; i < members; ++i){
+		if(tfs_pathset_put(set, b, i, strlen(b->pool + b->names[i])) != 0) return -1;
+	}
+
+	/* members come grouped by directory, so the last parent is usually the next one's too */
+	const char* last = NULL;
+	uint32_t last_len = 0;
+	int64_t last_parent = UINT32_MAX;
+	for(uint32_t i = 0; i < members; ++i){
+		const char* path = b->pool + b->names[i];
+		const char* slash = strrchr(path, '/');
+		uint32_t len = slash? slash - path: 0;
+		if(!last || len != last_len || memcmp(path, last, len)){
+			last_parent = tfs_builder_dir(b, set, path, len, b->mtimes[i]);
+			if(last_parent < 0) return -1;
+			/* the pool may have moved */
+			path = b->pool + b->names[i];
+		}
+		b->parents[i] = last_parent;
+		last = path;
+		last_len = len;
+	}
+	return members;
+}
+
+static uint32_t tfs_slots_find(const uint32_t* slots, uint32_t mask, const char* pool,
+	const uint32_t* names, const char* path, uint32_t h){
+
+	uint32_t slot = h & mask;
+	for(uint32_t n; (n = slots[slot]); slot = (slot + 1) & mask){
+		if(!strcmp(pool + names[n - 1], path)) return n;
+	}
+	return 0;
+}
+
+/*
+	the bloom filter: a path sets three bits in the one word its hash
+	picks, so ruling it out costs one load. with a word per eight paths
+	about 3% of misses still probe the slots
+*/
+#define TFS_BLOOM_PER_WORD 8
+
+static uint64_t tfs_bloom_bits(uint32_t h){
+	/* the word comes from the low bits, these from a mix of all of them */
+	uint64_t x = h * 0x9e3779b97f4a7c15ull;
+	return 1ull << (x >> 58) | 1ull << (x >> 52 & 63) | 1ull << (x >> 46 & 63);
+}
+
+/* counting sort of the visible entries by parent directory */
+static void tfs_arena_dirs(struct tfs_arena* arena, const struct tfs_builder* b, const uint8_t* visible){
+	char* base = (char*) arena;
+	uint32_t* dirs = (uint32_t*) (base + arena->dirs);
+	uint32_t* children = (uint32_t*) (base + arena->children);
+	uint32_t count = arena->count;
+	for(uint32_t i = 0; i < count; ++i){
+		if(visible[i]) ++dirs[(b->parents[i] == UINT32_MAX? count: b->parents[i]) + 1];
+	}
+	for(uint32_t d = 1; d < count + 2; ++d) dirs[d] += dirs[d - 1];
+	for(uint32_t i = 0; i < count; ++i){
+		if(visible[i]) children[dirs[b->parents[i] == UINT32_MAX? count: b->parents[i]]++] = i;
+	}
+	/* the fill moved every start onto the next one */
+	memmove(dirs + 1, dirs, (count + 1) * sizeof(*dirs));
+	dirs[0] = 0;
+}
+
+/* links */
+
+#define tfs_index_islink(idx, id) ((idx)->types[id] == SYMLINK || (idx)->types[id] == HARDLINK)
+
+static tfs_entry_id tfs_target(uint32_t target){
+	if(target == TFS_TARGET_LOOP || target == TFS_TARGET_DANGLING){
+		TFS_SETERRNO(target == TFS_TARGET_LOOP? ELOOP: ENOENT);
+		return TFS_ENTRY_NONE;
+	}
+	return target - 1;
+}
+
+/*
+	the slow way, one component at a time: whenever a prefix of the path
+	is a symlink, its target takes its place and the lookup starts over
+*/
+static tfs_entry_id tfs_index_walk(const struct tfs_index* idx, const char* path, int follow){
+	char buf[2][TFS_PATH_MAX];
+	int cur = 0;
+	if(snprintf(buf[0], sizeof(buf[0]), "%s", path) >= (int) sizeof(buf[0])){
+		TFS_SETERRNO(ENAMETOOLONG);
+		return TFS_ENTRY_NONE;
+	}
+	for(int hops = 0; hops <= TFS_LINK_MAX; ++hops){
+		char* p = buf[cur];
+		/* the link is at p[0..rest), the part after it is kept */
+		size_t rest = strlen(p);
+		tfs_entry_id id = tfs_index_lookup(idx, p);
+		if(id != TFS_ENTRY_NONE){
+			if(!tfs_index_islink(idx, id) || (!follow && idx->types[id] == SYMLINK)) return id;
+			if(idx->targets[id]) return tfs_target(idx->targets[id]);
+		}else{
+			char* slash = p;
+			for(;;){
+				slash = strchr(slash, '/');
+				if(slash){
+					*slash = '\0';
+					id = tfs_index_lookup(idx, p);
+					*slash = '/';
+				}
+				if(!slash || id == TFS_ENTRY_NONE){
+					TFS_SETERRNO(ENOENT);
+					return TFS_ENTRY_NONE;
+				}
+				if(idx->types[id] == SYMLINK) break;
+				++slash;
+			}
+			rest = slash - p;
+		}
+
+		const char* target;
+		uint32_t cached = idx->targets[id];
+		if(cached && cached < TFS_TARGET_DANGLING) target = tfs_index_path(idx, cached - 1);
+		else if(cached) return tfs_target(cached);
+		else if(idx->links[id] != UINT32_MAX) target = idx->pool + idx->links[id];
+		else{
+			TFS_SETERRNO(ENOENT);
+			return TFS_ENTRY_NONE;
+		}
+		/* a link to the root leaves the rest with its '/' in front */
+		const char* tail = p + rest + (!*target && p[rest] == '/');
+		if(snprintf(buf[!cur], sizeof(buf[0]), "%s%s", target, tail) >= (int) sizeof(buf[0])){
+			TFS_SETERRNO(ENAMETOOLONG);
+			return TFS_ENTRY_NONE;
+		}
+		cur = !cur;
+	}
+	TFS_SETERRNO(ELOOP);
+	return TFS_ENTRY_NONE;
+}
+
+tfs_entry_id tfs_index_resolve(const struct tfs_index* idx, const char* path, int follow){
+	tfs_entry_id id = tfs_index_lookup(idx, path);
+	/* the usual case, no links involved */
+	if(id != TFS_ENTRY_NONE && (!tfs_index_islink(idx, id) || (!follow && idx->types[id] == SYMLINK))) return id;
+	if(id != TFS_ENTRY_NONE && idx->targets[id]) return tfs_target(idx->targets[id]);
+	if(id == TFS_ENTRY_NONE && !idx->symlinks){
+		TFS_SETERRNO(ENOENT);
+		return TFS_ENTRY_NONE;
+	}
+	return tfs_index_walk(idx, path, follow);
+}
+
+/* resolve every link once, so following one later is a single load */
+static void tfs_index_link(struct tfs_index* idx){
+	uint32_t* targets = (uint32_t*) idx->targets;
+	for(uint32_t i = 0; i < idx->count; ++i){
+		if(!tfs_index_islink(idx, i)) continue;
+		tfs_entry_id id = TFS_ENTRY_NONE;
+		if(idx->links[i] != UINT32_MAX && idx->types[i] == HARDLINK){
+			/* a hard link names the latest member of that path before it, as tar extracts it */
+			id = tfs_index_resolve(idx, idx->pool + idx->links[i], 0);
+			for(uint32_t j = i; id > i && j-- > 0; ){
+				if(idx->names[j] == idx->names[id]) id = j;
+			}
+			if(id != TFS_ENTRY_NONE && id < i && tfs_index_islink(idx, id)){
+				targets[i] = targets[id];
+				continue;
+			}
+			if(id != TFS_ENTRY_NONE && tfs_index_islink(idx, id)) id = tfs_index_resolve(idx, idx->pool + idx->links[i], 1);
+		}else if(idx->links[i] != UINT32_MAX) id = tfs_index_resolve(idx, idx->pool + idx->links[i], 1);
+		if(id != TFS_ENTRY_NONE) targets[i] = id + 1;
+		else targets[i] = errno == ELOOP? TFS_TARGET_LOOP: TFS_TARGET_DANGLING;
+	}
+}
+
+#define TFS_ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+int tfs_builder_finish(struct tfs_builder* b, struct tfs_index* idx){
+	struct tfs_pathset set = {};
+	int64_t members = tfs_builder_resolve(b, &set);
+	uint8_t* visible = members < 0? NULL: calloc(b->count? b->count: 1, 1);
+	if(!visible){
+		free(set.slots);
+		tfs_builder_free(b);
+		return -1;
+	}
+	/* the set holds the last entry of every path, earlier ones are shadowed */
+	for(uint32_t i = 0; i <= set.mask; ++i){
+		if(set.slots[i]) visible[(uint32_t) set.slots[i] - 1] = 1;
+	}
+	free(set.slots);
+
+	uint32_t count = b->count;
+	uint32_t slot_count = 16;
+	while(slot_count < (uint64_t) count * 2) slot_count <<= 1;
+	uint32_t bloom_words = 1;
+	while((uint64_t) bloom_words * TFS_BLOOM_PER_WORD < count) bloom_words <<= 1;
+
+	struct tfs_arena layout = {
+		.magic = TFS_ARENA_MAGIC,
+		.version = TFS_ARENA_VERSION,
+		.count = count,
+		.members = members,
+		.slot_count = slot_count,
+		.bloom_words = bloom_words,
+	};
+	uint64_t len = TFS_ALIGN8(sizeof(layout));
+	layout.offsets = len; len += TFS_ALIGN8((uint64_t) count * sizeof(uint64_t));
+	layout.sizes = len;   len += TFS_ALIGN8((uint64_t) count * sizeof(uint64_t));
+	layout.mtimes = len;  len += TFS_ALIGN8((uint64_t) count * sizeof(int64_t));
+	layout.names = len;   len += TFS_ALIGN8((uint64_t) count * sizeof(uint32_t));
+	layout.types = len;   len += TFS_ALIGN8((uint64_t) count * sizeof(uint8_t));
+	layout.links = len;   len += TFS_ALIGN8((uint64_t) count * sizeof(uint32_t));
+	layout.targets = len; len += TFS_ALIGN8((uint64_t) count * sizeof(uint32_t));
+	layout.slots = len;   len += TFS_ALIGN8((uint64_t) slot_count * sizeof(uint32_t));
+	layout.bloom = len;   len += (uint64_t) bloom_words * sizeof(uint64_t);
+	layout.dirs = len;    len += TFS_ALIGN8(((uint64_t) count + 2) * sizeof(uint32_t));
+	layout.children = len; len += TFS_ALIGN8((uint64_t) count * sizeof(uint32_t));
+	layout.pool = len;
+	/* upper bound, duplicates are interned below */
+	len += TFS_ALIGN8(b->pool_len);
+	struct tfs_arena* arena = b->pool_len > UINT32_MAX? NULL: calloc(1, len);
+	if(!arena){
+		if(b->pool_len > UINT32_MAX) TFS_SETERRNO(EFBIG);
+		free(visible);
+		tfs_builder_free(b);
+		return -1;
+	}
+	*arena = layout;
+	char* base = (char*) arena;
+	memcpy(base + arena->offsets, b->offsets, count * sizeof(uint64_t));
+	memcpy(base + arena->sizes, b->sizes, count * sizeof(uint64_t));
+	memcpy(base + arena->mtimes, b->mtimes, count * sizeof(int64_t));
+	memcpy(base + arena->types, b->types, count * sizeof(uint8_t));
+
+	uint32_t* names = (uint32_t*) (base + arena->names);
+	uint32_t* links = (uint32_t*) (base + arena->links);
+	uint32_t* slots = (uint32_t*) (base + arena->slots);
+	uint64_t* bloom = (uint64_t*) (base + arena->bloom);
+	char* pool = base + arena->pool;
+	uint64_t pool_len = 0;
+	uint32_t mask = slot_count - 1;
+	for(uint32_t i = 0; i < count; ++i){
+		if(b->canon[i] != i){
+			/* later members replace earlier ones, as on extraction, and share their name */
+			names[i] = names[b->canon[i]];
+		}else{
+			const char* path = b->pool + b->names[i];
+			size_t plen = strlen(path) + 1;
+			memcpy(pool + pool_len, path, plen);
+			names[i] = pool_len;
+			pool_len += plen;
+		}
+		links[i] = UINT32_MAX;
+		if(b->links[i]){
+			const char* target = b->pool + b->links[i] - 1;
+			size_t tlen = strlen(target) + 1;
+			memcpy(pool + pool_len, target, tlen);
+			links[i] = pool_len;
+			pool_len += tlen;
+		}
+		if(b->types[i] == SYMLINK) ++arena->symlinks;
+		/* paths of visible entries are unique, no need to compare */
+		if(visible[i]){
+			uint32_t slot = b->hashes[i] & mask;
+			while(slots[slot]) slot = (slot + 1) & mask;
+			slots[slot] = i + 1;
+			bloom[b->hashes[i] & (bloom_words - 1)] |= tfs_bloom_bits(b->hashes[i]);
+		}
+	}
+	arena->pool_len = pool_len;
+	arena->length = arena->pool + TFS_ALIGN8(pool_len);
+	tfs_arena_dirs(arena, b, visible);
+	free(visible);
+	tfs_builder_free(b);
+
+	/* give back what interning saved */
+	struct tfs_arena* shrunk = realloc(arena, arena->length);
+	if(shrunk) arena = shrunk;
+	if(tfs_index_attach(idx, arena, 0) != 0) return -1;
+	tfs_index_link(idx);
+	return 0;
+}
+
+
+/* index */
+
+/* every section has to lie inside the block, a saved index may be stale or truncated */
+static int tfs_arena_valid(const struct tfs_arena* arena, size_t len){
+	if(len < sizeof(*arena) || arena->magic != TFS_ARENA_MAGIC
+		|| arena->version != TFS_ARENA_VERSION || arena->length != len
+		|| arena->members > arena->count
+		|| !arena->slot_count || (arena->slot_count & (arena->slot_count - 1))
+		|| !arena->bloom_words || (arena->bloom_words & (arena->bloom_words - 1)))
+		return 0;
+	uint64_t count = arena->count;
+	const uint64_t sections[][2] = {
+		{ arena->offsets, count * sizeof(uint64_t) },
+		{ arena->sizes, count * sizeof(uint64_t) },
+		{ arena->mtimes, count * sizeof(int64_t) },
+		{ arena->names, count * sizeof(uint32_t) },
+		{ arena->types, count * sizeof(uint8_t) },
+		{ arena->links, count * sizeof(uint32_t) },
+		{ arena->targets, count * sizeof(uint32_t) },
+		{ arena->slots, (uint64_t) arena->slot_count * sizeof(uint32_t) },
+		{ arena->bloom, (uint64_t) arena->bloom_words * sizeof(uint64_t) },
+		{ arena->dirs, (count + 2) * sizeof(uint32_t) },
+		{ arena->children, count * sizeof(uint32_t) },
+		{ arena->pool, arena->pool_len },
+	};
+	for(size_t i = 0; i < sizeof(sections) / sizeof(*sections); ++i){
+		if(sections[i][0] % 8 || sections[i][0] > len || sections[i][1] > len - sections[i][0])
+			return 0;
+	}
+	return 1;
+}
+
+/*
+	every id and pool offset inside the arena too, for an index read from
+	a file: lookups and walks follow them without checking
+*/
+static int tfs_arena_consistent(const struct tfs_arena* arena){
+	const char* base = (const char*) arena;
+	uint32_t count = arena->count;
+	const uint32_t* names = (const uint32_t*) (base + arena->names);
+	const uint32_t* links = (const uint32_t*) (base + arena->links);
+	const uint32_t* targets = (const uint32_t*) (base + arena->targets);
+	const uint32_t* slots = (const uint32_t*) (base + arena->slots);
+	const uint32_t* dirs = (const uint32_t*) (base + arena->dirs);
+	const uint32_t* children = (const uint32_t*) (base + arena->children);
+	const char* pool = base + arena->pool;
+	/* the root is id count and has dirs[count + 1] */
+	if(count >= UINT32_MAX - 2 || (count && (!arena->pool_len || pool[arena->pool_len - 1] != '\0')))
+		return 0;
+	for(uint32_t i = 0; i < count; ++i){
+		uint32_t t = targets[i];
+		if(names[i] >= arena->pool_len || (links[i] != UINT32_MAX && links[i] >= arena->pool_len)
+			|| (t != TFS_TARGET_DANGLING && t != TFS_TARGET_LOOP && t > count))
+			return 0;
+	}
+	/* a probe stops at an empty slot, and only the last entry of a path has one */
+	if(arena->slot_count <= count) return 0;
+	uint8_t* visible = calloc(count? count: 1, 1);
+	uint8_t* named = calloc(arena->pool_len / 8 + 1, 1);
+	int ok = visible && named;
+	for(uint32_t i = count; ok && i-- > 0; ){
+		uint32_t name = names[i];
+		visible[i] = !(named[name / 8] & 1 << name % 8);
+		named[name / 8] |= 1 << name % 8;
+	}
+	for(uint32_t i = 0; ok && i < arena->slot_count; ++i){
+		uint32_t n = slots[i];
+		if(!n) continue;
+		if(n > count || !visible[n - 1]) ok = 0;
+		else visible[n - 1] = 0;
+	}
+	free(visible);
+	free(named);
+	if(!ok) return 0;
+	for(uint32_t d = 0; d <= count; ++d){
+		if(dirs[d] > dirs[d + 1]) return 0;
+	}
+	if(dirs[count + 1] > count) return 0;
+	for(uint32_t i = dirs[0]; i < dirs[count + 1]; ++i){
+		if(children[i] >= count) return 0;
+	}
+	return 1;
+}
+
+int tfs_index_attach(struct tfs_index* idx, struct tfs_arena* arena, size_t mapped){
+	if(!tfs_arena_valid(arena, arena->length)){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	const char* base = (const char*) arena;
+	idx->arena = arena;
+	idx->arena_mapped = mapped;
+	idx->count = arena->count;
+	idx->members = arena->members;
+	idx->mask = arena->slot_count - 1;
+	idx->bloom_mask = arena->bloom_words - 1;
+	idx->offsets = (const uint64_t*) (base + arena->offsets);
+	idx->sizes = (const uint64_t*) (base + arena->sizes);
+	idx->mtimes = (const int64_t*) (base + arena->mtimes);
+	idx->names = (const uint32_t*) (base + arena->names);
+	idx->types = (const uint8_t*) (base + arena->types);
+	idx->links = (const uint32_t*) (base + arena->links);
+	idx->targets = (const uint32_t*) (base + arena->targets);
+	idx->symlinks = arena->symlinks;
+	idx->slots = (const uint32_t*) (base + arena->slots);
+	idx->bloom = (const uint64_t*) (base + arena->bloom);
+	idx->dirs = (const uint32_t*) (base + arena->dirs);
+	idx->children = (const uint32_t*) (base + arena->children);
+	idx->pool = base + arena->pool;
+	return 0;
+}
+
+void tfs_index_free(struct tfs_index* idx){
+	if(idx->arena_mapped) munmap(idx->arena, idx->arena_mapped);
+	else free(idx->arena);
+	memset(idx, 0, sizeof(*idx));
+}
+
+tfs_entry_id tfs_index_lookup(const struct tfs_index* idx, const char* path){
+	if(!idx->arena) return TFS_ENTRY_NONE;
+	uint32_t h = tfs_hash(path);
+	uint64_t bits = tfs_bloom_bits(h);
+	if((idx->bloom[h & idx->bloom_mask] & bits) != bits) return TFS_ENTRY_NONE;
+	uint32_t n = tfs_slots_find(idx->slots, idx->mask, idx->pool, idx->names, path, h);
+	return n? (tfs_entry_id) n - 1: TFS_ENTRY_NONE;
+}
+
+int tfs_index_save(const struct tfs_index* idx, const char* pathname, mode_t mode){
+	if(!idx->arena || !pathname){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	/* write beside the target under a fresh name and rename, readers never see half an index */
+	char tmp[TFS_PATH_MAX];
+	if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", pathname) >= (int) sizeof(tmp)){
+		TFS_SETERRNO(ENAMETOOLONG);
+		return -1;
+	}
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if(fd < 0) return -1;
+	if(fchmod(fd, mode) != 0){
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	const char* data = (const char*) idx->arena;
+	size_t len = idx->arena->length;
+	while(len > 0){
+		ssize_t n = write(fd, data, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0){
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	if(close(fd) != 0 || rename(tmp, pathname) != 0){
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+int tfs_index_load(struct tfs_index* idx, const char* pathname, int owned){
+	int fd = open(pathname, O_RDONLY | O_CLOEXEC | (owned? O_NOFOLLOW: 0));
+	if(fd < 0) return -1;
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return -1;
+	}
+	/* anyone else could have written it */
+	if(owned && (!S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_mode & 022)){
+		close(fd);
+		TFS_SETERRNO(EPERM);
+		return -1;
+	}
+	if((size_t) st.st_size < sizeof(struct tfs_arena)){
+		close(fd);
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	if(!tfs_arena_valid(map, st.st_size) || !tfs_arena_consistent(map) || tfs_index_attach(idx, map, st.st_size) != 0){
+		munmap(map, st.st_size);
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	return 0;
+}
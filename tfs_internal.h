@@ -0,0 +1,328 @@
+/*
+	shared between the libtfs translation units, not installed
+*/
+
+#ifndef __TFS_INTERNAL_H__
+#define __TFS_INTERNAL_H__
+
+#ifndef TFS_NO_OVERRIDE
+#define TFS_NO_OVERRIDE
+#endif
+#include "tfs.h"
+
+#include "errno.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "stdatomic.h"
+#include "sys/types.h"
+
+#define TFS_PATH_MAX 4096
+
+#define TFS_SETERRNO(no) errno = no
+#define TFS_STREAM_SETERRNO(no) stream->_errno = TFS_SETERRNO(no)
+
+#define TFS_ARENA_MAGIC 0x78736674u /* "tfsx" */
+#define TFS_ARENA_VERSION 5
+
+/*
+	the whole index lives in one block: this header followed by the
+	sections it names. sections are referenced by offset from the start
+	of the block, so it can be written out or mapped back unchanged
+*/
+struct tfs_arena {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t length;
+	uint32_t count;
+	/* entries read from the tar, the rest are implicit directories */
+	uint32_t members;
+	uint32_t slot_count;
+	/* a power of two */
+	uint32_t bloom_words;
+	/* symlink members, none means a miss needs no walk through the path */
+	uint32_t symlinks;
+	uint64_t pool_len;
+	/* the tar this was built from, checked before a saved index is used */
+	uint64_t tar_size;
+	int64_t tar_mtime_ns;
+	uint64_t tar_check;
+	/* section offsets */
+	uint64_t offsets;   /* uint64_t[count], member data offset in the tar */
+	uint64_t sizes;     /* uint64_t[count] */
+	uint64_t mtimes;    /* int64_t[count] */
+	uint64_t names;     /* uint32_t[count], offset of the path in pool */
+	uint64_t types;     /* uint8_t[count], ustar type flag */
+	uint64_t links;     /* uint32_t[count], offset in pool of a link's target path from the root, UINT32_MAX if none */
+	uint64_t targets;   /* uint32_t[count], what a link resolves to, see TFS_TARGET_* */
+	uint64_t slots;     /* uint32_t[slot_count], entry + 1, 0 is empty */
+	uint64_t bloom;     /* uint64_t[bloom_words], three bits per path in the word its hash picks */
+	uint64_t dirs;      /* uint32_t[count + 2], children of d are children[dirs[d]..dirs[d + 1]), the root is d = count */
+	uint64_t children;  /* uint32_t[count], entry ids grouped by parent in archive order */
+	uint64_t pool;      /* char[pool_len], unique '\0' terminated paths */
+};
+
+/* decoded view of an arena */
+struct tfs_index {
+	struct tfs_arena* arena;
+	/* non-zero when arena is a mapping rather than malloc'd */
+	size_t arena_mapped;
+	uint32_t count;
+	uint32_t members;
+	uint32_t mask;
+	uint32_t bloom_mask;
+	const uint64_t* offsets;
+	const uint64_t* sizes;
+	const int64_t* mtimes;
+	const uint32_t* names;
+	const uint8_t* types;
+	const uint32_t* links;
+	const uint32_t* targets;
+	uint32_t symlinks;
+	const uint32_t* slots;
+	const uint64_t* bloom;
+	const uint32_t* dirs;
+	const uint32_t* children;
+	const char* pool;
+};
+
+/* growable scratch lists filled while scanning, see tfs_builder_finish */
+struct tfs_builder {
+	uint32_t count;
+	uint32_t cap;
+	uint64_t* offsets;
+	uint64_t* sizes;
+	int64_t* mtimes;
+	uint64_t* names;
+	uint8_t* types;
+	/* offset in pool + 1 of the normalized link target, 0 for none */
+	uint64_t* links;
+	uint32_t* hashes;
+	/* filled by tfs_builder_finish */
+	uint32_t* parents;
+	uint32_t* canon;
+	char* pool;
+	size_t pool_len;
+	size_t pool_cap;
+};
+
+/* pax (x, g) and gnu (L, K) values overriding the headers that follow */
+struct tfs_meta {
+	char path[TFS_PATH_MAX];
+	char linkpath[TFS_PATH_MAX];
+	uint64_t size;
+	int64_t mtime;
+	/* TFS_META_* bits of the fields set */
+	int set;
+};
+
+#define TFS_META_PATH     0x1
+#define TFS_META_LINKPATH 0x2
+#define TFS_META_SIZE     0x4
+#define TFS_META_MTIME    0x8
+/* a path was given but does not fit TFS_PATH_MAX */
+#define TFS_META_TOOLONG  0x10
+
+/* one member header with the extended values folded in */
+struct tfs_member {
+	char path[TFS_PATH_MAX];
+	char linkpath[TFS_PATH_MAX];
+	uint64_t size;
+	int64_t mtime;
+	uint8_t type;
+};
+
+struct ctar_t;
+
+#define tfs_header_isext(type) ((type) == 'x' || (type) == 'g' || (type) == 'L' || (type) == 'K')
+/* extended headers larger than this are skipped */
+#define TFS_EXT_MAX (1 << 20)
+
+/* take in the data of an extended header of the given type */
+void tfs_meta_ext(struct tfs_meta* meta, char type, const char* data, size_t len);
+/* meta[0] holds per-member values and is reset, meta[1] global ones; -1 if the path is unusable */
+int tfs_member_decode(struct tfs_member* m, const struct ctar_t* header, struct tfs_meta meta[2]);
+
+/* header blocks, see tfs_scan.c */
+int tfs_hdr_iszero(const char* block);
+/* 0 when the check field matches */
+int tfs_hdr_checksum(const char* block);
+uint64_t tfs_hdr_num(const char* field, unsigned int size);
+/* EBADMSG, with off left for tfs_corrupt_offset */
+int tfs_corrupt(uint64_t off);
+
+int tfs_normpath(const char* path, size_t len, char* out, size_t size);
+uint32_t tfs_hash(const char* str);
+
+/* link is the linkpath of a HARDLINK or SYMLINK member, ignored otherwise */
+int tfs_builder_add(struct tfs_builder* b, const char* path, const char* link, uint64_t offset,
+	uint64_t size, int64_t mtime, uint8_t type);
+/* adds the implicit directories, compacts b into a single arena and releases b */
+int tfs_builder_finish(struct tfs_builder* b, struct tfs_index* idx);
+void tfs_builder_free(struct tfs_builder* b);
+
+int tfs_index_attach(struct tfs_index* idx, struct tfs_arena* arena, size_t mapped);
+void tfs_index_free(struct tfs_index* idx);
+tfs_entry_id tfs_index_lookup(const struct tfs_index* idx, const char* path);
+
+/* targets[] of a link entry: entry + 1, or one of these; 0 only while building */
+#define TFS_TARGET_DANGLING (UINT32_MAX - 1)
+#define TFS_TARGET_LOOP UINT32_MAX
+/* links followed in one lookup before ELOOP, as SYMLOOP_MAX */
+#define TFS_LINK_MAX 40
+
+/*
+	lookup following symlinks in every directory of path, and hardlinks
+	and, with follow set, symlinks at its end. TFS_ENTRY_NONE with errno
+	ENOENT or ELOOP
+*/
+tfs_entry_id tfs_index_resolve(const struct tfs_index* idx, const char* path, int follow);
+/*
+	sidecar file, the arena byte for byte. with owned set the file must be
+	one this user wrote and no one else can, EPERM otherwise
+*/
+int tfs_index_save(const struct tfs_index* idx, const char* pathname, mode_t mode);
+int tfs_index_load(struct tfs_index* idx, const char* pathname, int owned);
+
+#define tfs_index_path(idx, id) ((idx)->pool + (idx)->names[id])
+/* the root directory has no entry, it takes the id one past the last */
+#define tfs_index_root(idx) ((idx)->count)
+
+/* compressed input, see tfs_z.c */
+#define TFS_Z_NONE 0
+#define TFS_Z_GZIP 1
+#define TFS_Z_ZSTD 2
+
+struct tfs_zsrc;
+
+int tfs_z_detect(int fd);
+/* loads the checkpoints from zindexpath when they match, builds them otherwise */
+struct tfs_zsrc* tfs_z_open(int fd, int kind, uint64_t in_size, int64_t mtime_ns, const char* zindexpath);
+void tfs_z_close(struct tfs_zsrc* z);
+uint64_t tfs_z_size(const struct tfs_zsrc* z);
+ssize_t tfs_z_read(struct tfs_zsrc* z, void* buf, size_t len, uint64_t off);
+int tfs_z_save(const struct tfs_zsrc* z, const char* pathname, int64_t mtime_ns);
+
+/* largest stdio buffer of a TFS_INIT_COOKIE member */
+#define TFS_COOKIE_BUFSIZE (64 << 10)
+
+/* per entry counters of a mount, see tfs_stats.c */
+struct tfs_mstat {
+	atomic_uint_fast64_t opens;
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t bytes;
+};
+
+/* one mounted generation of a tar */
+struct tfs_archive {
+	/* one for being current, one per open handle, directory and async read */
+	atomic_uint refs;
+	/* what tfs_reload opens again, NULL for memory mounts */
+	char* pathname;
+	uint64_t ino;
+	int fd;
+	/* TFS_INIT_* given at mount */
+	int flags;
+	/* unique per mount, keys the block cache */
+	uint64_t serial;
+	/* of the tar, decompressed when z is set */
+	uint64_t size;
+	struct tfs_zsrc* z;
+	int64_t mtime_ns;
+	/* whole archive when mounted with TFS_INIT_MMAP or from memory */
+	const char* map;
+	/* map is the caller's buffer, see tfs_inittarmem */
+	int borrowed;
+	struct tfs_index idx;
+	/* idx.count of them */
+	struct tfs_mstat* mstats;
+	/*
+		set on a union of mounted tars, which has no descriptor or mapping
+		of its own: member offsets carry the index of their tar in the bits
+		from TFS_LAYER_SHIFT up, see tfs_archive_layer
+	*/
+	struct tfs_archive** layers;
+	uint32_t layer_count;
+};
+
+#define TFS_LAYER_SHIFT 48
+#define TFS_LAYER_MAX ((uint64_t) 1 << (64 - TFS_LAYER_SHIFT))
+
+/*
+	the current generation. short accesses run between enter and leave,
+	which tfs_reload waits out before dropping the old one; whatever
+	outlives the call takes a reference instead. both return NULL when
+	nothing is mounted
+*/
+struct tfs_archive* tfs_archive_enter(unsigned* token);
+void tfs_archive_leave(unsigned token);
+struct tfs_archive* tfs_archive_acquire(void);
+/* NULL is fine */
+void tfs_archive_release(struct tfs_archive* arc);
+/* "@/path" in arc, errno set when absent */
+tfs_entry_id tfs_archive_lookup(const struct tfs_archive* arc, const char* pathname);
+/* the tar holding offset off of arc, with off made relative to it; arc itself unless a union */
+const struct tfs_archive* tfs_archive_layer(const struct tfs_archive* arc, uint64_t* off);
+
+/* a new generation of the tar at pathname, NULL with errno set */
+struct tfs_archive* tfs_archive_new(const char* pathname, int flags);
+/* make arc (NULL to unmount) current, dropping the current slot's reference to the old one */
+void tfs_archive_publish(struct tfs_archive* arc);
+/* waits out every reader between enter and leave now, before freeing something else they may see */
+void tfs_archive_synchronize(void);
+
+/* mount table, see tfs_mount.c */
+/* arc alone at the root, NULL for none; takes over the reference */
+int tfs_mounts_reset(struct tfs_archive* arc);
+/* pathnames of the mounted tars, NULL terminated; the caller frees each and the array */
+char** tfs_mounts_paths(void);
+
+/* behind the DIR* of an archive directory, told apart by magic like TFS_FILE */
+typedef struct {
+	TFS_MAGIC_T magic;
+	struct tfs_archive* arc;
+	uint32_t next;
+	uint32_t end;
+	struct dirent ent;
+} TFS_DIR;
+
+/* record every member into b, EBADMSG at a header that fails its checksum */
+int tfs_archive_scan(const struct tfs_archive* arc, struct tfs_builder* b);
+ssize_t tfs_archive_read(const struct tfs_archive* arc, void* buf, size_t len, uint64_t off);
+/* same, with the read-ahead state of a handle */
+ssize_t tfs_archive_read_ra(const struct tfs_archive* arc, void* buf, size_t len, uint64_t off,
+	struct tfs_readahead* ra);
+ssize_t tfs_cache_read(const struct tfs_archive* arc, void* buf, size_t len, uint64_t off,
+	struct tfs_readahead* ra);
+
+struct stat;
+/* stat of entry id, which may be the root */
+void tfs_stat_entry(const struct tfs_index* idx, tfs_entry_id id, struct stat* statbuf);
+/* tfs_stat, following a symlink when asked */
+int tfs_stat_follow(const char* pathname, struct stat* statbuf, int follow);
+/* as readlink(2), the target given from the root of the mount */
+ssize_t tfs_readlink(const char* pathname, char* buf, size_t size);
+
+/* counters, id is TFS_ENTRY_NONE for an open that found nothing */
+int tfs_stats_attach(struct tfs_archive* arc);
+void tfs_stats_open(const struct tfs_archive* arc, tfs_entry_id id);
+void tfs_stats_read(const struct tfs_archive* arc, tfs_entry_id id, size_t bytes);
+void tfs_stats_seek(void);
+void tfs_stats_close(void);
+
+#ifdef TFS_WITH_TRACE
+extern _Atomic(tfs_trace_cb) tfs_trace_hook;
+uint64_t tfs_trace_now(void);
+void tfs_trace_emit(tfs_trace_cb cb, int type, tfs_entry_id id, const char* path, uint64_t offset,
+	size_t len, uint64_t ns);
+/* starts the clock of a timed event, only while a hook is set */
+#define TFS_TRACE_BEGIN(t0) uint64_t t0 = atomic_load_explicit(&tfs_trace_hook, memory_order_relaxed)? tfs_trace_now(): 0
+#define TFS_TRACE(type, id, path, offset, len, t0) do{ \
+		tfs_trace_cb trace_ = atomic_load_explicit(&tfs_trace_hook, memory_order_acquire); \
+		if(trace_) tfs_trace_emit(trace_, type, id, path, offset, len, (t0)? tfs_trace_now() - (t0): 0); \
+	}while(0)
+#else
+#define TFS_TRACE_BEGIN(t0) ((void) 0)
+#define TFS_TRACE(type, id, path, offset, len, t0) ((void) 0)
+#endif
+
+#endif // __TFS_INTERNAL_H__
@@ -0,0 +1,282 @@
+/*
+	mount table
+
+	any number of tars can be mounted, each under a directory of "@/" and
+	with a priority. a lone tar at the root is published as it is, more
+	become one union archive whose index merges all of theirs, so a
+	lookup is a single probe however many tars are stacked. the merge
+	adds the tars lowest priority first and a later path replaces an
+	earlier one, as it does inside one tar; equal priorities go by mount
+	order, the later mount winning
+*/
+
+#include "tfs_internal.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "pthread.h"
+#include "sys/stat.h"
+
+struct tfs_layer {
+	struct tfs_archive* arc;
+	/* normalized, "" for the root */
+	char* mountpoint;
+	int priority;
+	uint64_t seq;
+};
+
+/* changes to the table and publishing serialize on lock, lookups never take it */
+static struct {
+	pthread_mutex_t lock;
+	/* lowest priority first */
+	struct tfs_layer* layers;
+	size_t count;
+	uint64_t seq;
+} tfs_mounts = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void tfs_layers_free(struct tfs_layer* layers, size_t count){
+	for(size_t i = 0; i < count; ++i){
+		tfs_archive_release(layers[i].arc);
+		free(layers[i].mountpoint);
+	}
+	free(layers);
+}
+
+/* the table as it is, plus room for extra more; every layer referenced again */
+static struct tfs_layer* tfs_layers_copy(size_t extra){
+	struct tfs_layer* layers = malloc((tfs_mounts.count + extra? tfs_mounts.count + extra: 1) * sizeof(*layers));
+	if(!layers) return NULL;
+	for(size_t i = 0; i < tfs_mounts.count; ++i){
+		layers[i] = tfs_mounts.layers[i];
+		layers[i].mountpoint = strdup(layers[i].mountpoint);
+		if(!layers[i].mountpoint){
+			tfs_layers_free(layers, i);
+			return NULL;
+		}
+		atomic_fetch_add(&layers[i].arc->refs, 1);
+	}
+	return layers;
+}
+
+/* the union of layers, their member offsets tagged with their position */
+static struct tfs_archive* tfs_union_new(const struct tfs_layer* layers, size_t count){
+	if(count > TFS_LAYER_MAX){
+		TFS_SETERRNO(EMFILE);
+		return NULL;
+	}
+	struct tfs_archive* arc = calloc(1, sizeof(*arc));
+	struct tfs_archive** refs = calloc(count, sizeof(*refs));
+	if(!arc || !refs){
+		free(arc);
+		free(refs);
+		return NULL;
+	}
+	*arc = (struct tfs_archive){ .fd = -1, .layers = refs };
+	atomic_init(&arc->refs, 1);
+
+	struct tfs_builder b = {};
+	char path[TFS_PATH_MAX], link[TFS_PATH_MAX];
+	int res = 0;
+	for(size_t l = 0; l < count && res == 0; ++l){
+		const struct tfs_archive* src = layers[l].arc;
+		const struct tfs_index* idx = &src->idx;
+		const char* mountpoint = layers[l].mountpoint;
+		if(src->size >> TFS_LAYER_SHIFT){
+			TFS_SETERRNO(EFBIG);
+			res = -1;
+			break;
+		}
+		refs[l] = layers[l].arc;
+		atomic_fetch_add(&refs[l]->refs, 1);
+		arc->layer_count = l + 1;
+		/* implicit directories are left out, the merge makes its own */
+		for(uint32_t i = 0; i < idx->members && res == 0; ++i){
+			const char* name = tfs_index_path(idx, i);
+			if(*mountpoint && !*name) name = mountpoint;
+			else if(*mountpoint){
+				if(snprintf(path, sizeof(path), "%s/%s", mountpoint, name) >= (int) sizeof(path)) continue;
+				name = path;
+			}
+			/* targets are from the root of their tar, which is the mountpoint now */
+			const char* target = NULL;
+			if(idx->links[i] != UINT32_MAX){
+				snprintf(link, sizeof(link), "/%s/%s", mountpoint, idx->pool + idx->links[i]);
+				target = link;
+			}
+			res = tfs_builder_add(&b, name, target, (uint64_t) l << TFS_LAYER_SHIFT | idx->offsets[i], idx->sizes[i],
+				idx->mtimes[i], idx->types[i]);
+		}
+	}
+	if(res != 0 || tfs_builder_finish(&b, &arc->idx) != 0 || tfs_stats_attach(arc) != 0){
+		int err = errno;
+		tfs_builder_free(&b);
+		tfs_archive_release(arc);
+		TFS_SETERRNO(err);
+		return NULL;
+	}
+	return arc;
+}
+
+/* table locked; publishes layers and makes them the table, or leaves everything as it was */
+static int tfs_mounts_commit(struct tfs_layer* layers, size_t count){
+	struct tfs_archive* arc = NULL;
+	if(count == 1 && !layers[0].mountpoint[0]){
+		arc = layers[0].arc;
+		atomic_fetch_add(&arc->refs, 1);
+	}else if(count){
+		arc = tfs_union_new(layers, count);
+		if(!arc) return -1;
+	}
+	tfs_archive_publish(arc);
+	tfs_layers_free(tfs_mounts.layers, tfs_mounts.count);
+	tfs_mounts.layers = layers;
+	tfs_mounts.count = count;
+	return 0;
+}
+
+int tfs_mounts_reset(struct tfs_archive* arc){
+	struct tfs_layer* layers = arc? malloc(sizeof(*layers)): NULL;
+	char* root = arc? strdup(""): NULL;
+	if(arc && (!layers || !root)){
+		free(layers);
+		free(root);
+		tfs_archive_release(arc);
+		return -1;
+	}
+	pthread_mutex_lock(&tfs_mounts.lock);
+	if(arc) layers[0] = (struct tfs_layer){ arc, root, 0, ++tfs_mounts.seq };
+	/* a single tar at the root never needs a union, this cannot fail */
+	tfs_mounts_commit(layers, arc? 1: 0);
+	pthread_mutex_unlock(&tfs_mounts.lock);
+	return 0;
+}
+
+int tfs_mount(const char* pathname, const char* mountpoint, int priority){
+	return tfs_mount_ex(pathname, mountpoint, priority, 0);
+}
+
+int tfs_mount_ex(const char* pathname, const char* mountpoint, int priority, int flags){
+	char dir[TFS_PATH_MAX];
+	if(!pathname){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	if(!mountpoint) mountpoint = "";
+	if(mountpoint[0] == TFS_PATH_PREFIX && mountpoint[1] == '/') ++mountpoint;
+	if(tfs_normpath(mountpoint, strlen(mountpoint), dir, sizeof(dir)) < 0){
+		TFS_SETERRNO(ENAMETOOLONG);
+		return -1;
+	}
+	struct tfs_archive* arc = tfs_archive_new(pathname, flags);
+	char* mp = arc? strdup(dir): NULL;
+	if(!mp){
+		tfs_archive_release(arc);
+		return -1;
+	}
+
+	pthread_mutex_lock(&tfs_mounts.lock);
+	struct tfs_layer* layers = tfs_layers_copy(1);
+	int res = -1;
+	if(layers){
+		/* after every layer it outranks or ties with */
+		size_t at = tfs_mounts.count;
+		while(at > 0 && layers[at - 1].priority > priority) --at;
+		memmove(layers + at + 1, layers + at, (tfs_mounts.count - at) * sizeof(*layers));
+		layers[at] = (struct tfs_layer){ arc, mp, priority, ++tfs_mounts.seq };
+		res = tfs_mounts_commit(layers, tfs_mounts.count + 1);
+		if(res != 0){
+			int err = errno;
+			tfs_layers_free(layers, tfs_mounts.count + 1);
+			TFS_SETERRNO(err);
+		}
+	}else{
+		tfs_archive_release(arc);
+		free(mp);
+	}
+	pthread_mutex_unlock(&tfs_mounts.lock);
+	return res;
+}
+
+int tfs_unmount(const char* pathname){
+	if(!pathname){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	pthread_mutex_lock(&tfs_mounts.lock);
+	struct tfs_layer* layers = tfs_layers_copy(0);
+	size_t count = 0;
+	int res = -1;
+	if(layers){
+		for(size_t i = 0; i < tfs_mounts.count; ++i){
+			const char* path = layers[i].arc->pathname;
+			if(path && !strcmp(path, pathname)){
+				tfs_archive_release(layers[i].arc);
+				free(layers[i].mountpoint);
+			}else layers[count++] = layers[i];
+		}
+		if(count == tfs_mounts.count) TFS_SETERRNO(ENOENT);
+		else res = tfs_mounts_commit(layers, count);
+		if(res != 0){
+			int err = errno;
+			tfs_layers_free(layers, count);
+			TFS_SETERRNO(err);
+		}
+	}
+	pthread_mutex_unlock(&tfs_mounts.lock);
+	return res;
+}
+
+int tfs_reload(void){
+	pthread_mutex_lock(&tfs_mounts.lock);
+	struct tfs_layer* layers = tfs_layers_copy(0);
+	int files = 0, changed = 0, res = layers? 0: -1;
+	for(size_t i = 0; layers && i < tfs_mounts.count && res == 0; ++i){
+		const struct tfs_archive* cur = layers[i].arc;
+		if(!cur->pathname) continue;
+		++files;
+		/* nothing to do while the tar is the same file, unmodified */
+		struct stat st;
+		if(stat(cur->pathname, &st) == 0 && (uint64_t) st.st_ino == cur->ino
+			&& st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec == cur->mtime_ns)
+			continue;
+		/* every tar that changed or none */
+		struct tfs_archive* arc = tfs_archive_new(cur->pathname, cur->flags);
+		if(!arc){
+			res = -1;
+			break;
+		}
+		tfs_archive_release(layers[i].arc);
+		layers[i].arc = arc;
+		++changed;
+	}
+	if(res == 0 && !files){
+		/* nothing mounted, or only memory */
+		TFS_SETERRNO(EINVAL);
+		res = -1;
+	}
+	if(res == 0 && changed) res = tfs_mounts_commit(layers, tfs_mounts.count);
+	if(layers && (res != 0 || !changed)){
+		int err = errno;
+		tfs_layers_free(layers, tfs_mounts.count);
+		TFS_SETERRNO(err);
+	}
+	pthread_mutex_unlock(&tfs_mounts.lock);
+	return res;
+}
+
+char** tfs_mounts_paths(void){
+	pthread_mutex_lock(&tfs_mounts.lock);
+	char** paths = calloc(tfs_mounts.count + 1, sizeof(*paths));
+	size_t n = 0;
+	for(size_t i = 0; paths && i < tfs_mounts.count; ++i){
+		const char* path = tfs_mounts.layers[i].arc->pathname;
+		if(path && !(paths[n++] = strdup(path))){
+			while(n) free(paths[--n]);
+			free(paths);
+			paths = NULL;
+		}
+	}
+	pthread_mutex_unlock(&tfs_mounts.lock);
+	return paths;
+}
@@ -0,0 +1,398 @@
+/*
+	archive packer
+
+	rewrites a tar so that the data of large members starts on an aligned
+	offset, which mmap and O_DIRECT reads want, and optionally so that
+	members read together lie together. the padding is a run of pax
+	headers of its own before the member's headers, each holding only a
+	comment record and none over TFS_EXT_MAX; every reader ignores
+	comments, so the result is an ordinary tar. a repack drops the padding
+	it finds before padding again
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "stdio.h"
+#include "string.h"
+#include "stdlib.h"
+
+#include "fcntl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#define TFS_PAD_KEY "comment=tfs-pad"
+/* data blocks of one padding header, readers skip larger pax headers whole */
+#define TFS_PAD_BLOCKS (TFS_EXT_MAX / 512)
+
+#define tfs_blocks(n) (((n) + 511) / 512)
+
+struct tfs_pack_member {
+	/* its first header, extended ones included */
+	uint64_t begin;
+	/* its last local pax header, UINT64_MAX for none */
+	uint64_t pax;
+	uint64_t pax_size;
+	uint64_t header;
+	/* past its data and the padding to the next block */
+	uint64_t end;
+	uint64_t size;
+	/* normalized, NULL when it cannot be represented */
+	char* path;
+	/* place in the access order, UINT32_MAX when not in it */
+	uint32_t rank;
+	uint32_t seq;
+	uint8_t type;
+};
+
+/*
+	with an order, global headers go first, then directories so that they
+	exist before their files, then regular files and last everything else,
+	which keeps hard links behind their targets
+*/
+static int tfs_pack_class(uint8_t type){
+	if(type == 'g') return 0;
+	if(type == DIRECTORY) return 1;
+	if(type == REGULAR || type == NORMAL || type == CONTIGUOUS) return 2;
+	return 3;
+}
+
+static int tfs_pack_cmp(const void* a, const void* b){
+	const struct tfs_pack_member* x = a, * y = b;
+	int cx = tfs_pack_class(x->type), cy = tfs_pack_class(y->type);
+	if(cx != cy) return cx - cy;
+	if(x->rank != y->rank) return x->rank < y->rank? -1: 1;
+	return x->seq < y->seq? -1: 1;
+}
+
+struct tfs_pack_name {
+	const char* path;
+	struct tfs_pack_member* member;
+};
+
+static int tfs_pack_name_cmp(const void* a, const void* b){
+	return strcmp(((const struct tfs_pack_name*) a)->path, ((const struct tfs_pack_name*) b)->path);
+}
+
+/* a pax header of nothing but padding records, or of nothing at all */
+static int tfs_pax_ispad(const char* data, uint64_t len){
+	const char* end = data + len;
+	while(data < end){
+		size_t rec = 0;
+		const char* p = data;
+		while(p < end && *p >= '0' && *p <= '9') rec = rec * 10 + (*p++ - '0');
+		if(p >= end || *p != ' ' || rec == 0 || rec > (size_t) (end - data)
+			|| rec - (p + 1 - data) < sizeof(TFS_PAD_KEY) - 1 || memcmp(p + 1, TFS_PAD_KEY, sizeof(TFS_PAD_KEY) - 1))
+			return 0;
+		data += rec;
+	}
+	return 1;
+}
+
+static int tfs_pack_walk(const char* map, uint64_t size, struct tfs_pack_member** out, uint32_t* count){
+	struct tfs_meta* meta = calloc(2, sizeof(*meta));
+	struct tfs_member* m = malloc(sizeof(*m));
+	struct tfs_pack_member* members = NULL;
+	uint32_t n = 0, cap = 0;
+	struct ctar_t header;
+	int res = -1;
+	if(!meta || !m) goto out;
+
+	uint64_t off = 0, begin = 0, pax = UINT64_MAX, pax_size = 0;
+	while(size >= 512 && off <= size - 512){
+		const char* block = map + off;
+		if(tfs_hdr_iszero(block)){
+			/* two zero blocks end the archive, a lone one is dropped */
+			if(off + 1024 > size || tfs_hdr_iszero(block + 512)) break;
+			if(begin == off) begin += 512;
+			off += 512;
+			continue;
+		}
+		if(tfs_hdr_checksum(block) != 0){
+			TFS_SETERRNO(EBADMSG);
+			goto out;
+		}
+		memcpy(header.block, block, sizeof(header.block));
+		uint64_t data = off + 512;
+		uint64_t len = tfs_hdr_num(header.size, sizeof(header.size));
+		char type = header.type;
+		int ext = tfs_header_isext(type);
+		if(ext){
+			if(len > size - data){
+				TFS_SETERRNO(EBADMSG);
+				goto out;
+			}
+			/* padding in front of the member, dropped */
+			if(type == 'x' && begin == off && tfs_pax_ispad(map + data, len)){
+				off = begin = data + tfs_blocks(len) * 512;
+				continue;
+			}
+			if(len <= TFS_EXT_MAX) tfs_meta_ext(&meta[type == 'g'? 1: 0], type, map + data, len);
+			if(type == 'x'){
+				pax = off;
+				pax_size = len;
+			}
+			/* a global header on its own is kept as a member of its own */
+			if(type != 'g' || begin != off){
+				off = data + tfs_blocks(len) * 512;
+				continue;
+			}
+		}else{
+			int usable = tfs_member_decode(m, &header, meta) == 0;
+			len = m->size;
+			if(len > size - data){
+				TFS_SETERRNO(EBADMSG);
+				goto out;
+			}
+			if(!usable) m->path[0] = '\0';
+		}
+		if(n == cap){
+			cap = cap? cap * 2: 256;
+			struct tfs_pack_member* grown = realloc(members, cap * sizeof(*members));
+			if(!grown) goto out;
+			members = grown;
+		}
+		struct tfs_pack_member* pm = &members[n];
+		*pm = (struct tfs_pack_member){
+			.begin = begin,
+			.pax = ext? UINT64_MAX: pax,
+			.pax_size = ext? 0: pax_size,
+			.header = off,
+			.end = data + tfs_blocks(len) * 512,
+			.size = len,
+			.rank = UINT32_MAX,
+			.seq = n,
+			.type = type,
+		};
+		if(!ext && m->path[0] && !(pm->path = strdup(m->path))) goto out;
+		++n;
+		off = begin = pm->end;
+		pax = UINT64_MAX;
+	}
+	res = 0;
+out:
+	if(res != 0){
+		for(uint32_t i = 0; i < n; ++i) free(members[i].path);
+		free(members);
+	}else{
+		*out = members;
+		*count = n;
+	}
+	free(meta);
+	free(m);
+	return res;
+}
+
+/* ranks the members named in the order file, the first mention counting */
+static int tfs_pack_rank(struct tfs_pack_member* members, uint32_t count, const char* order){
+	FILE* fp = fopen(order, "r");
+	struct tfs_pack_name* byname = malloc((count? count: 1) * sizeof(*byname));
+	if(!fp || !byname){
+		if(fp) fclose(fp);
+		free(byname);
+		return -1;
+	}
+	uint32_t named = 0;
+	for(uint32_t i = 0; i < count; ++i){
+		if(members[i].path) byname[named++] = (struct tfs_pack_name){ members[i].path, &members[i] };
+	}
+	qsort(byname, named, sizeof(*byname), tfs_pack_name_cmp);
+
+	char* line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	uint32_t rank = 0;
+	char path[TFS_PATH_MAX];
+	while((len = getline(&line, &cap, fp)) >= 0){
+		while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+		const char* p = line;
+		if(*p == TFS_PATH_PREFIX) ++p;
+		if(!*p || tfs_normpath(p, strlen(p), path, sizeof(path)) < 0) continue;
+		/* every member of that path, a later copy replaces an earlier one anyway */
+		uint32_t lo = 0, hi = named;
+		while(lo < hi){
+			uint32_t mid = lo + (hi - lo) / 2;
+			if(strcmp(byname[mid].path, path) < 0) lo = mid + 1;
+			else hi = mid;
+		}
+		for(; lo < named && !strcmp(byname[lo].path, path); ++lo){
+			if(byname[lo].member->rank == UINT32_MAX) byname[lo].member->rank = rank;
+		}
+		++rank;
+	}
+	free(line);
+	free(byname);
+	fclose(fp);
+	return 0;
+}
+
+/* the records of a pax header but padding, into out; their length */
+static size_t tfs_pax_strip(const char* data, size_t len, char* out){
+	const char* end = data + len;
+	size_t n = 0;
+	while(data < end){
+		size_t rec = 0;
+		const char* p = data;
+		while(p < end && *p >= '0' && *p <= '9') rec = rec * 10 + (*p++ - '0');
+		/* unparsable from here on, kept as it is */
+		if(p >= end || *p != ' ' || rec == 0 || rec > (size_t) (end - data)) rec = end - data;
+		else if(rec - (p + 1 - data) >= sizeof(TFS_PAD_KEY) - 1
+			&& !memcmp(p + 1, TFS_PAD_KEY, sizeof(TFS_PAD_KEY) - 1)){
+			data += rec;
+			continue;
+		}
+		memcpy(out + n, data, rec);
+		n += rec;
+		data += rec;
+	}
+	return n;
+}
+
+/* a padding record exactly len long, len a whole number of blocks */
+static void tfs_pax_pad(char* out, size_t len){
+	int n = sprintf(out, "%zu " TFS_PAD_KEY, len);
+	memset(out + n, ' ', len - n - 1);
+	out[len - 1] = '\n';
+}
+
+/* the member's own pax header, or a new one, for size bytes of records */
+static void tfs_pax_header(struct ctar_t* h, const char* from, uint64_t size){
+	if(from) memcpy(h->block, from, sizeof(h->block));
+	else{
+		memset(h->block, 0, sizeof(h->block));
+		strcpy(h->name, "././@PaxHeader");
+		strcpy(h->mode, "0000644");
+		strcpy(h->uid, "0000000");
+		strcpy(h->gid, "0000000");
+		strcpy(h->mtime, "00000000000");
+		h->type = 'x';
+		memcpy(h->ustar, "ustar\0" "00", 8);
+	}
+	snprintf(h->size, sizeof(h->size), "%011llo", (unsigned long long) size);
+	memset(h->check, ' ', sizeof(h->check));
+	unsigned sum = 0;
+	for(int i = 0; i < 512; ++i) sum += (unsigned char) h->block[i];
+	snprintf(h->check, sizeof(h->check), "%06o", sum);
+	h->check[7] = ' ';
+}
+
+static int tfs_pack_put(FILE* out, uint64_t* pos, const void* data, uint64_t len){
+	if(len && fwrite(data, 1, len, out) != len) return -1;
+	*pos += len;
+	return 0;
+}
+
+/* a padding header taking blocks blocks, the header alone for one */
+static int tfs_pack_pad(FILE* out, uint64_t* pos, uint64_t blocks, char* buf){
+	struct ctar_t h;
+	size_t len = (blocks - 1) * 512;
+	tfs_pax_header(&h, NULL, len);
+	if(len) tfs_pax_pad(buf, len);
+	if(tfs_pack_put(out, pos, h.block, 512) != 0) return -1;
+	return tfs_pack_put(out, pos, buf, len);
+}
+
+static int tfs_pack_emit(FILE* out, uint64_t* pos, const char* map, const struct tfs_pack_member* m,
+	const struct tfs_pack_opts* opts, char* pax, char* padbuf){
+
+	int has_pax = m->pax != UINT64_MAX;
+	uint64_t pax_end = has_pax? m->pax + 512 + tfs_blocks(m->pax_size) * 512: m->header;
+	uint64_t pre = (has_pax? m->pax: m->header) - m->begin;
+	uint64_t post = m->header - pax_end;
+	size_t len = has_pax? tfs_pax_strip(map + m->pax + 512, m->pax_size, pax): 0;
+
+	/* blocks of pax header, none when there is nothing to carry */
+	uint64_t blocks = len? 1 + tfs_blocks(len): 0;
+	/* blocks of padding headers, which go first and leave the member's own as they are */
+	uint64_t pad = 0;
+	if(opts && opts->align > 512 && tfs_pack_class(m->type) == 2 && m->size >= opts->min_size){
+		uint64_t unit = opts->align / 512;
+		uint64_t data = (*pos + pre + post) / 512 + blocks + 1;
+		pad = (unit - data % unit) % unit;
+	}
+	if(!pad && (!has_pax || len == m->pax_size)){
+		/* untouched, copied as it is */
+		return tfs_pack_put(out, pos, map + m->begin, m->end - m->begin);
+	}
+	while(pad){
+		uint64_t n = pad < 1 + TFS_PAD_BLOCKS? pad: 1 + TFS_PAD_BLOCKS;
+		if(tfs_pack_pad(out, pos, n, padbuf) != 0) return -1;
+		pad -= n;
+	}
+
+	struct ctar_t h;
+	if(tfs_pack_put(out, pos, map + m->begin, pre) != 0) return -1;
+	if(blocks){
+		tfs_pax_header(&h, map + m->pax, len);
+		memset(pax + len, 0, (blocks - 1) * 512 - len);
+		if(tfs_pack_put(out, pos, h.block, 512) != 0 || tfs_pack_put(out, pos, pax, (blocks - 1) * 512) != 0) return -1;
+	}
+	if(tfs_pack_put(out, pos, map + pax_end, post) != 0) return -1;
+	return tfs_pack_put(out, pos, map + m->header, m->end - m->header);
+}
+
+int tfs_pack(const char* in, const char* out, const struct tfs_pack_opts* opts){
+	if(!in || !out || (opts && opts->align && (opts->align < 512 || (opts->align & (opts->align - 1))))){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	int fd = open(in, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0) return -1;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return -1;
+	}
+	uint64_t size = st.st_size;
+	const char* map = size? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0): NULL;
+	close(fd);
+	if(map == MAP_FAILED) return -1;
+	if(map) madvise((void*) map, size, MADV_SEQUENTIAL);
+
+	struct tfs_pack_member* members = NULL;
+	uint32_t count = 0;
+	/* written aside and renamed over out, which may be in */
+	size_t tmplen = strlen(out) + 5;
+	char* tmp = malloc(tmplen);
+	char* pax = NULL, * padbuf = NULL;
+	FILE* fp = NULL;
+	int res = -1;
+	if(!tmp || tfs_pack_walk(map, size, &members, &count) != 0) goto out;
+	if(opts && opts->order){
+		if(tfs_pack_rank(members, count, opts->order) != 0) goto out;
+		qsort(members, count, sizeof(*members), tfs_pack_cmp);
+	}
+	uint64_t pax_max = 0;
+	for(uint32_t i = 0; i < count; ++i) if(members[i].pax_size > pax_max) pax_max = members[i].pax_size;
+	pax = malloc(tfs_blocks(pax_max) * 512 + 512);
+	if(opts && opts->align > 512) padbuf = malloc(TFS_PAD_BLOCKS * 512);
+	snprintf(tmp, tmplen, "%s.tmp", out);
+	fp = pax && (padbuf || !opts || opts->align <= 512)? fopen(tmp, "wb"): NULL;
+	if(!fp) goto out;
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	uint64_t pos = 0;
+	for(uint32_t i = 0; i < count; ++i){
+		if(tfs_pack_emit(fp, &pos, map, &members[i], opts, pax, padbuf) != 0) goto out;
+	}
+	static const char zero[1024];
+	if(tfs_pack_put(fp, &pos, zero, sizeof(zero)) != 0) goto out;
+	res = fclose(fp);
+	fp = NULL;
+	if(res == 0) res = rename(tmp, out);
+out:
+	if(res != 0){
+		int err = errno;
+		if(fp) fclose(fp);
+		if(tmp) unlink(tmp);
+		TFS_SETERRNO(err);
+	}
+	for(uint32_t i = 0; i < count; ++i) free(members[i].path);
+	free(members);
+	free(pax);
+	free(padbuf);
+	free(tmp);
+	if(map) munmap((void*) map, size);
+	return res;
+}
@@ -0,0 +1,471 @@
+/*
+	parallel traversal and extraction
+
+	the members to visit are sorted by archive offset and cut into tasks:
+	runs of neighbouring small members read in one go, and pieces of
+	TFS_PAR_CHUNK of the large ones. each worker starts with an equal
+	share of the bytes, a contiguous stretch of the tar it reads front to
+	back with positional reads that go around the block cache. a worker
+	that runs dry steals the second half of what the busiest one has left,
+	so both keep reading sequentially. mappings are handed out in place
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "fcntl.h"
+#include "pthread.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+/* largest read of a task, and of a piece of a member */
+#define TFS_PAR_CHUNK (4 << 20)
+/* largest hole inside a run, as TFS_BATCH_GAP */
+#define TFS_PAR_GAP (64 << 10)
+#define TFS_PAR_THREADS_MAX 256
+
+#define tfs_par_isfile(type) ((type) == REGULAR || (type) == NORMAL || (type) == CONTIGUOUS)
+/* the member its path opens: not replaced by a later copy or a higher layer */
+#define tfs_par_visible(idx, id) (tfs_index_lookup(idx, tfs_index_path(idx, id)) == (id))
+
+struct tfs_par_task {
+	/* sorted[first..first + count) lie in the range */
+	uint32_t first;
+	uint32_t count;
+	/* offset of the piece inside its member when count is 1 and it is split */
+	uint64_t from;
+	uint64_t off;
+	size_t len;
+};
+
+/*
+	tasks[head..tail) are left to a worker, it takes from the head and
+	thieves from the tail. changed under lock, peeked at without it
+*/
+struct tfs_par_queue {
+	pthread_mutex_t lock;
+	size_t head;
+	size_t tail;
+};
+
+struct tfs_par {
+	const struct tfs_archive* arc;
+	const tfs_entry_id* sorted;
+	struct tfs_par_task* tasks;
+	struct tfs_par_queue* queues;
+	unsigned nthreads;
+	tfs_foreach_cb cb;
+	void* user;
+	/* nonzero once a callback asked to stop or a read failed */
+	atomic_int stop;
+	int error;
+};
+
+struct tfs_par_key {
+	uint64_t off;
+	tfs_entry_id id;
+};
+
+static int tfs_par_key_cmp(const void* a, const void* b){
+	uint64_t x = ((const struct tfs_par_key*) a)->off, y = ((const struct tfs_par_key*) b)->off;
+	return x < y? -1: x > y;
+}
+
+/* len bytes at off, in place from a mapping or read into buf */
+static const char* tfs_par_read(const struct tfs_archive* arc, char* buf, size_t len, uint64_t off){
+	uint64_t at = off;
+	const struct tfs_archive* src = tfs_archive_layer(arc, &at);
+	if(at > src->size || len > src->size - at){
+		TFS_SETERRNO(EIO);
+		return NULL;
+	}
+	if(src->map) return src->map + at;
+	if(src->z) return tfs_archive_read(src, buf, len, at) == (ssize_t) len? buf: NULL;
+	size_t got = 0;
+	while(got < len){
+		ssize_t n = pread(src->fd, buf + got, len - got, at + got);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0){
+			if(n == 0) TFS_SETERRNO(EIO);
+			return NULL;
+		}
+		got += n;
+	}
+	return buf;
+}
+
+static int tfs_par_take(struct tfs_par* p, unsigned self, size_t* task){
+	struct tfs_par_queue* q = &p->queues[self];
+	pthread_mutex_lock(&q->lock);
+	int found = q->head < q->tail;
+	if(found){
+		*task = q->head;
+		__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+	if(found) return 1;
+
+	/* the busiest worker gives up the back half of its stretch */
+	for(;;){
+		unsigned victim = self;
+		size_t most = 0;
+		for(unsigned w = 0; w < p->nthreads; ++w){
+			size_t left = __atomic_load_n(&p->queues[w].tail, __ATOMIC_RELAXED)
+				- __atomic_load_n(&p->queues[w].head, __ATOMIC_RELAXED);
+			if(w != self && left > most && left < SIZE_MAX / 2){
+				most = left;
+				victim = w;
+			}
+		}
+		if(victim == self) return 0;
+		struct tfs_par_queue* v = &p->queues[victim];
+		size_t from = 0, to = 0;
+		pthread_mutex_lock(&v->lock);
+		if(v->head < v->tail){
+			to = v->tail;
+			from = v->tail - (v->tail - v->head + 1) / 2;
+			__atomic_store_n(&v->tail, from, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&v->lock);
+		if(from == to) continue;
+		pthread_mutex_lock(&q->lock);
+		__atomic_store_n(&q->head, from + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&q->tail, to, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->lock);
+		*task = from;
+		return 1;
+	}
+}
+
+static void tfs_par_fail(struct tfs_par* p, int res, int error){
+	int none = 0;
+	if(atomic_compare_exchange_strong(&p->stop, &none, res)) p->error = error;
+}
+
+static void tfs_par_task_run(struct tfs_par* p, const struct tfs_par_task* t, char* buf){
+	const struct tfs_index* idx = &p->arc->idx;
+	const char* data = t->len? tfs_par_read(p->arc, buf, t->len, t->off): "";
+	if(!data){
+		tfs_par_fail(p, -1, errno);
+		return;
+	}
+	for(uint32_t i = t->first; i < t->first + t->count && !atomic_load_explicit(&p->stop, memory_order_relaxed); ++i){
+		tfs_entry_id id = p->sorted[i];
+		tfs_chunk chunk = {
+			.id = id,
+			.path = tfs_index_path(idx, id),
+			.size = idx->sizes[id],
+			.offset = t->from,
+			.data = data + (idx->offsets[id] + t->from - t->off),
+			.len = t->count == 1? t->len: idx->sizes[id],
+		};
+		tfs_stats_read(p->arc, id, chunk.len);
+		int res = p->cb(p->user, &chunk);
+		if(res) tfs_par_fail(p, res, 0);
+	}
+}
+
+static void* tfs_par_worker(void* arg){
+	struct tfs_par* p = ((void**) arg)[0];
+	unsigned self = (unsigned) (uintptr_t) ((void**) arg)[1];
+	const struct tfs_archive* src = p->arc->layers? NULL: p->arc;
+	/* only a mapped tar can do without a buffer */
+	char* buf = src && src->map? NULL: malloc(TFS_PAR_CHUNK);
+	if(!buf && !(src && src->map)){
+		tfs_par_fail(p, -1, ENOMEM);
+		return NULL;
+	}
+	size_t task;
+	while(!atomic_load_explicit(&p->stop, memory_order_relaxed) && tfs_par_take(p, self, &task))
+		tfs_par_task_run(p, &p->tasks[task], buf);
+	free(buf);
+	return NULL;
+}
+
+/* ids[0..n) are regular files of arc; sorts them */
+static int tfs_par_run(const struct tfs_archive* arc, tfs_entry_id* ids, size_t n, unsigned nthreads,
+	tfs_foreach_cb cb, void* user){
+
+	const struct tfs_index* idx = &arc->idx;
+	struct tfs_par_key* keys = malloc((n? n: 1) * sizeof(*keys));
+	if(!keys) return -1;
+	for(size_t i = 0; i < n; ++i) keys[i] = (struct tfs_par_key){ idx->offsets[ids[i]], ids[i] };
+	qsort(keys, n, sizeof(*keys), tfs_par_key_cmp);
+	for(size_t i = 0; i < n; ++i) ids[i] = keys[i].id;
+	free(keys);
+	size_t ntasks = 0, cap = n + 1;
+	struct tfs_par_task* tasks = malloc(cap * sizeof(*tasks));
+	if(!tasks) return -1;
+	uint64_t total = 0;
+	for(size_t i = 0; i < n; ){
+		tfs_entry_id id = ids[i];
+		uint64_t off = idx->offsets[id], size = idx->sizes[id];
+		if(ntasks + (size + TFS_PAR_CHUNK - 1) / TFS_PAR_CHUNK + 1 > cap){
+			cap = (ntasks + (size + TFS_PAR_CHUNK - 1) / TFS_PAR_CHUNK + 1) * 2;
+			struct tfs_par_task* grown = realloc(tasks, cap * sizeof(*tasks));
+			if(!grown){
+				free(tasks);
+				return -1;
+			}
+			tasks = grown;
+		}
+		if(size > TFS_PAR_CHUNK){
+			for(uint64_t from = 0; from < size; from += TFS_PAR_CHUNK){
+				size_t len = size - from < TFS_PAR_CHUNK? size - from: TFS_PAR_CHUNK;
+				tasks[ntasks++] = (struct tfs_par_task){ i, 1, from, off + from, len };
+			}
+			total += size;
+			++i;
+			continue;
+		}
+		/* neighbours join the run while it stays one read of at most a chunk */
+		size_t last = i + 1;
+		uint64_t end = off + size;
+		while(last < n){
+			uint64_t next = idx->offsets[ids[last]], next_end = next + idx->sizes[ids[last]];
+			if(next < end || next - end > TFS_PAR_GAP || next_end - off > TFS_PAR_CHUNK) break;
+			end = next_end;
+			++last;
+		}
+		tasks[ntasks++] = (struct tfs_par_task){ i, last - i, 0, off, end - off };
+		total += end - off;
+		i = last;
+	}
+
+	if(!nthreads){
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0? ncpu: 1;
+	}
+	if(nthreads > TFS_PAR_THREADS_MAX) nthreads = TFS_PAR_THREADS_MAX;
+	if(nthreads > ntasks) nthreads = ntasks? ntasks: 1;
+	struct tfs_par p = { .arc = arc, .sorted = ids, .tasks = tasks, .nthreads = nthreads, .cb = cb, .user = user };
+	p.queues = calloc(nthreads, sizeof(*p.queues));
+	pthread_t* threads = calloc(nthreads, sizeof(*threads));
+	void* (*args)[2] = calloc(nthreads, sizeof(*args));
+	if(!p.queues || !threads || !args){
+		free(tasks);
+		free(p.queues);
+		free(threads);
+		free(args);
+		return -1;
+	}
+	/* equal shares of the bytes, not of the tasks */
+	uint64_t acc = 0;
+	size_t t = 0;
+	for(unsigned w = 0; w < nthreads; ++w){
+		pthread_mutex_init(&p.queues[w].lock, NULL);
+		p.queues[w].head = t;
+		while(t < ntasks && (w == nthreads - 1 || acc < total / nthreads * (w + 1))) acc += tasks[t++].len;
+		p.queues[w].tail = t;
+	}
+	/* the caller is worker 0 */
+	unsigned started = 1;
+	for(unsigned w = 0; w < nthreads; ++w){
+		args[w][0] = &p;
+		args[w][1] = (void*) (uintptr_t) w;
+		if(w && pthread_create(&threads[w], NULL, tfs_par_worker, args[w]) == 0) ++started;
+		else if(w) break;
+	}
+	tfs_par_worker(args[0]);
+	for(unsigned w = 1; w < started; ++w) pthread_join(threads[w], NULL);
+	for(unsigned w = 0; w < nthreads; ++w) pthread_mutex_destroy(&p.queues[w].lock);
+
+	int res = atomic_load(&p.stop);
+	if(res == -1) TFS_SETERRNO(p.error);
+	free(tasks);
+	free(p.queues);
+	free(threads);
+	free(args);
+	return res;
+}
+
+int tfs_foreach_parallel(tfs_filter_cb filter, tfs_foreach_cb cb, void* user, unsigned nthreads){
+	if(!cb){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_archive* arc = tfs_archive_acquire();
+	if(!arc){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	const struct tfs_index* idx = &arc->idx;
+	tfs_entry_id* ids = malloc((idx->members? idx->members: 1) * sizeof(*ids));
+	int res = -1;
+	if(ids){
+		size_t n = 0;
+		for(uint32_t i = 0; i < idx->members; ++i){
+			if(tfs_par_isfile(idx->types[i]) && tfs_par_visible(idx, i) && (!filter || filter(user, i, tfs_index_path(idx, i)))) ids[n++] = i;
+		}
+		res = tfs_par_run(arc, ids, n, nthreads, cb, user);
+	}
+	int err = errno;
+	free(ids);
+	tfs_archive_release(arc);
+	TFS_SETERRNO(err);
+	return res;
+}
+
+/* extraction */
+
+struct tfs_extract {
+	const struct tfs_index* idx;
+	int dirfd;
+	atomic_int failed;
+	int error;
+};
+
+static void tfs_extract_fail(struct tfs_extract* x){
+	x->error = errno;
+	atomic_fetch_add(&x->failed, 1);
+}
+
+
+/* pieces of large members go into files made at full size beforehand */
+static int tfs_extract_write(void* user, const tfs_chunk* chunk){
+	struct tfs_extract* x = user;
+	int whole = chunk->len == chunk->size;
+	int fd = openat(x->dirfd, chunk->path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC | (whole? O_CREAT | O_TRUNC: 0), 0644);
+	if(fd < 0){
+		tfs_extract_fail(x);
+		return 0;
+	}
+	size_t done = 0;
+	while(done < chunk->len){
+		ssize_t n = pwrite(fd, (const char*) chunk->data + done, chunk->len - done, chunk->offset + done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0){
+			if(n == 0) TFS_SETERRNO(EIO);
+			tfs_extract_fail(x);
+			break;
+		}
+		done += n;
+	}
+	if(whole){
+		int64_t mtime = x->idx->mtimes[chunk->id];
+		futimens(fd, (struct timespec[2]){ { mtime, 0 }, { mtime, 0 } });
+	}
+	close(fd);
+	return 0;
+}
+
+/* a symlink's target from the root, made relative to the directory holding it */
+static int tfs_extract_symlink(int dirfd, const char* path, const char* target){
+	/* the directories both start with are left out */
+	size_t common = 0, i = 0;
+	while(path[i] && path[i] == target[i]){
+		if(path[i] == '/') common = i + 1;
+		++i;
+	}
+	const char* rest = target + common;
+	if(path[i] == '/' && !target[i]){
+		common = i + 1;
+		rest = "";
+	}
+	char rel[TFS_PATH_MAX];
+	size_t n = 0;
+	for(const char* c = path + common; *c; ++c){
+		if(*c != '/') continue;
+		if(n + 3 >= sizeof(rel)) return -1;
+		memcpy(rel + n, "../", 3);
+		n += 3;
+	}
+	if(*rest) n += snprintf(rel + n, sizeof(rel) - n, "%s", rest);
+	else if(n) --n;
+	else rel[n++] = '.';
+	if(n >= sizeof(rel)){
+		TFS_SETERRNO(ENAMETOOLONG);
+		return -1;
+	}
+	rel[n] = '\0';
+	unlinkat(dirfd, path, 0);
+	return symlinkat(rel, dirfd, path);
+}
+
+int tfs_extract(const char* dest_dir, unsigned nthreads){
+	if(!dest_dir){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_archive* arc = tfs_archive_acquire();
+	if(!arc){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	const struct tfs_index* idx = &arc->idx;
+	struct tfs_extract x = { .idx = idx, .dirfd = -1 };
+	tfs_entry_id* ids = malloc((idx->count + 1) * sizeof(*ids));
+	if(!ids || (mkdir(dest_dir, 0755) != 0 && errno != EEXIST)
+		|| (x.dirfd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0){
+		int err = errno;
+		free(ids);
+		tfs_archive_release(arc);
+		TFS_SETERRNO(err);
+		return -1;
+	}
+
+	/* directories breadth first from the root, so every parent comes before its children */
+	size_t head = 0, tail = 0;
+	ids[tail++] = tfs_index_root(idx);
+	while(head < tail){
+		tfs_entry_id d = ids[head++];
+		for(uint32_t c = idx->dirs[d]; c < idx->dirs[d + 1]; ++c){
+			tfs_entry_id id = idx->children[c];
+			if(idx->types[id] != DIRECTORY) continue;
+			if(mkdirat(x.dirfd, tfs_index_path(idx, id), 0755) != 0 && errno != EEXIST) tfs_extract_fail(&x);
+			else ids[tail++] = id;
+		}
+	}
+
+	size_t n = 0;
+	for(uint32_t i = 0; i < idx->members; ++i){
+		if(!tfs_par_isfile(idx->types[i]) || !tfs_par_visible(idx, i)) continue;
+		if(idx->sizes[i] > TFS_PAR_CHUNK){
+			int fd = openat(x.dirfd, tfs_index_path(idx, i), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+			if(fd < 0 || ftruncate(fd, idx->sizes[i]) != 0){
+				tfs_extract_fail(&x);
+				if(fd >= 0) close(fd);
+				continue;
+			}
+			close(fd);
+		}
+		ids[n++] = i;
+	}
+	int res = tfs_par_run(arc, ids, n, nthreads, tfs_extract_write, &x);
+	if(res != 0) tfs_extract_fail(&x);
+
+	/* links once every file is in place, so none is written through one */
+	for(uint32_t i = 0; i < idx->members; ++i){
+		if(!tfs_par_visible(idx, i)) continue;
+		const char* path = tfs_index_path(idx, i);
+		uint32_t target = idx->targets[i];
+		if(idx->types[i] == SYMLINK && idx->links[i] != UINT32_MAX){
+			if(tfs_extract_symlink(x.dirfd, path, idx->pool + idx->links[i]) != 0) tfs_extract_fail(&x);
+		}else if(idx->types[i] == HARDLINK){
+			if(target == TFS_TARGET_DANGLING || target == TFS_TARGET_LOOP || !target){
+				TFS_SETERRNO(ENOENT);
+				tfs_extract_fail(&x);
+				continue;
+			}
+			unlinkat(x.dirfd, path, 0);
+			if(linkat(x.dirfd, tfs_index_path(idx, target - 1), x.dirfd, path, 0) != 0) tfs_extract_fail(&x);
+		}
+	}
+	/* times of pieced files and directories last, writing into a directory changes its own */
+	for(uint32_t i = 0; i < idx->members; ++i){
+		if(idx->types[i] != DIRECTORY && !(tfs_par_isfile(idx->types[i]) && idx->sizes[i] > TFS_PAR_CHUNK)) continue;
+		if(!tfs_par_visible(idx, i)) continue;
+		int64_t mtime = idx->mtimes[i];
+		utimensat(x.dirfd, tfs_index_path(idx, i), (struct timespec[2]){ { mtime, 0 }, { mtime, 0 } }, AT_SYMLINK_NOFOLLOW);
+	}
+
+	close(x.dirfd);
+	free(ids);
+	tfs_archive_release(arc);
+	int failed = atomic_load(&x.failed);
+	if(failed) TFS_SETERRNO(x.error);
+	return failed;
+}
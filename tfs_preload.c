@@ -0,0 +1,674 @@
+/*
+	LD_PRELOAD shim
+
+	serves programs never built against libtfs: POSIX calls on paths under
+	the prefixes named in TFS_PRELOAD, as
+
+		TFS_PRELOAD=/opt/assets=/srv/assets.tar:/opt/data=/srv/data.tar
+
+	are answered from the tar mounted there, later ones over earlier, and
+	everything else goes on to libc. an open member is a real descriptor,
+	an O_PATH one of /dev/null, that the shim knows by its number: read,
+	readv, pread, preadv, lseek, fstat, mmap, fdopen and close on it are
+	served from the archive. a mapping whose data starts on a page
+	boundary of the tar maps the tar itself (see tfs-pack), any other is a
+	private copy. members are read-only, directories are listed through
+	opendir, and reads the shim does not see, on a descriptor made by dup
+	or passed to a child say, fail with EBADF rather than read nothing.
+	TFS_PRELOAD_SHARED=1 mounts with TFS_INIT_SHARED
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tfs_internal.h"
+
+#include "dirent.h"
+#include "dlfcn.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "stdarg.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+
+#include "pthread.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/uio.h"
+#include "unistd.h"
+
+#define TFS_PRELOAD_PREFIXES 16
+/* descriptors from here up are never members */
+#define TFS_PRELOAD_FDS 65536
+
+_Static_assert(sizeof(struct stat) == sizeof(struct stat64), "stat64 differs from stat");
+_Static_assert(sizeof(struct dirent) == sizeof(struct dirent64), "dirent64 differs from dirent");
+
+struct tfs_pfd {
+	TFS_FILE* file;
+	/* read and lseek share the position */
+	pthread_mutex_t lock;
+};
+
+static struct {
+	/* normalized, as member paths */
+	char* prefixes[TFS_PRELOAD_PREFIXES];
+	size_t lens[TFS_PRELOAD_PREFIXES];
+	/* zero until every tar is mounted, the shim passes everything on till then */
+	int count;
+	_Atomic(struct tfs_pfd*)* fds;
+} tfs_preload;
+
+/* the libc functions, looked up on first use */
+static struct {
+	int (*openat)(int, const char*, int, ...);
+	ssize_t (*read)(int, void*, size_t);
+	ssize_t (*readv)(int, const struct iovec*, int);
+	ssize_t (*pread)(int, void*, size_t, off_t);
+	ssize_t (*preadv)(int, const struct iovec*, int, off_t);
+	ssize_t (*preadv2)(int, const struct iovec*, int, off_t, int);
+	off_t (*lseek)(int, off_t, int);
+	int (*close)(int);
+	int (*fstat)(int, struct stat*);
+	int (*fstatat)(int, const char*, struct stat*, int);
+	int (*statx)(int, const char*, int, unsigned int, struct statx*);
+	int (*faccessat)(int, const char*, int, int);
+	ssize_t (*readlinkat)(int, const char*, char*, size_t);
+	void* (*mmap)(void*, size_t, int, int, int, off_t);
+	FILE* (*fopen)(const char*, const char*);
+	FILE* (*fdopen)(int, const char*);
+	DIR* (*opendir)(const char*);
+	struct dirent* (*readdir)(DIR*);
+	int (*closedir)(DIR*);
+	ssize_t (*copy_file_range)(int, off64_t*, int, off64_t*, size_t, unsigned int);
+	ssize_t (*sendfile)(int, int, off_t*, size_t);
+} real;
+
+static pthread_once_t tfs_real_once = PTHREAD_ONCE_INIT;
+
+#define TFS_RESOLVE(name) real.name = (__typeof__(real.name)) dlsym(RTLD_NEXT, #name)
+
+static void tfs_real_resolve(void){
+	TFS_RESOLVE(openat);
+	TFS_RESOLVE(read);
+	TFS_RESOLVE(readv);
+	TFS_RESOLVE(pread);
+	TFS_RESOLVE(preadv);
+	TFS_RESOLVE(preadv2);
+	TFS_RESOLVE(lseek);
+	TFS_RESOLVE(close);
+	TFS_RESOLVE(fstat);
+	TFS_RESOLVE(fstatat);
+	TFS_RESOLVE(statx);
+	TFS_RESOLVE(faccessat);
+	TFS_RESOLVE(readlinkat);
+	TFS_RESOLVE(mmap);
+	TFS_RESOLVE(fopen);
+	TFS_RESOLVE(fdopen);
+	TFS_RESOLVE(opendir);
+	TFS_RESOLVE(readdir);
+	TFS_RESOLVE(closedir);
+	TFS_RESOLVE(copy_file_range);
+	TFS_RESOLVE(sendfile);
+}
+
+/* other libraries' constructors may get here before ours */
+#define TFS_REAL(name) (pthread_once(&tfs_real_once, tfs_real_resolve), real.name)
+
+/* the member path, "@/..." into out, of a path under one of the prefixes; 0 for any other */
+static int tfs_preload_path(int dirfd, const char* path, char* out, size_t size){
+	if(!tfs_preload.count || !path || !*path) return 0;
+	char joined[TFS_PATH_MAX];
+	if(path[0] != '/'){
+		if(dirfd != AT_FDCWD || !getcwd(joined, sizeof(joined))) return 0;
+		size_t n = strlen(joined);
+		if(snprintf(joined + n, sizeof(joined) - n, "/%s", path) >= (int) (sizeof(joined) - n)) return 0;
+		path = joined;
+	}
+	out[0] = TFS_PATH_PREFIX;
+	out[1] = '/';
+	int n = tfs_normpath(path, strlen(path), out + 2, size - 2);
+	for(int i = 0; n >= 0 && i < tfs_preload.count; ++i){
+		size_t len = tfs_preload.lens[i];
+		if((size_t) n >= len && !memcmp(out + 2, tfs_preload.prefixes[i], len) && (out[2 + len] == '\0' || out[2 + len] == '/'))
+			return 1;
+	}
+	return 0;
+}
+
+static struct tfs_pfd* tfs_pfd(int fd){
+	if(fd < 0 || fd >= TFS_PRELOAD_FDS || !tfs_preload.fds) return NULL;
+	return atomic_load_explicit(&tfs_preload.fds[fd], memory_order_acquire);
+}
+
+/* up to len bytes of the member from pos, leaving the position alone */
+static ssize_t tfs_pfd_pread(const TFS_FILE* f, void* buf, size_t len, uint64_t pos){
+	if(pos >= f->data_len) return 0;
+	if(len > f->data_len - pos) len = f->data_len - pos;
+	ssize_t got = len;
+	if(f->data) memcpy(buf, f->data + pos, len);
+	else got = tfs_archive_read(f->arc, buf, len, f->data_begin + pos);
+	if(got > 0) tfs_stats_read(f->arc, f->id, got);
+	return got;
+}
+
+static int tfs_preload_open(int dirfd, const char* path, int flags, mode_t mode){
+	char tpath[TFS_PATH_MAX];
+	if(!tfs_preload_path(dirfd, path, tpath, sizeof(tpath))) return TFS_REAL(openat)(dirfd, path, flags, mode);
+	if((flags & O_ACCMODE) != O_RDONLY || flags & (O_CREAT | O_TRUNC)){
+		TFS_SETERRNO(EROFS);
+		return -1;
+	}
+	FILE* fp = tfs_fopen(tpath, "r");
+	/* there is no descriptor to list a directory with, opendir is served instead */
+	if(!fp && errno == EISDIR) return TFS_REAL(openat)(dirfd, path, flags, mode);
+	if(!fp) return -1;
+	struct tfs_pfd* p = malloc(sizeof(*p));
+	/* nothing can be read through it but by the shim */
+	int fd = p? TFS_REAL(openat)(AT_FDCWD, "/dev/null", O_PATH | (flags & O_CLOEXEC)): -1;
+	if(fd < 0 || fd >= TFS_PRELOAD_FDS){
+		int err = fd < 0? errno: EMFILE;
+		if(fd >= 0) TFS_REAL(close)(fd);
+		free(p);
+		tfs_fclose(fp);
+		TFS_SETERRNO(err);
+		return -1;
+	}
+	p->file = (TFS_FILE*) fp;
+	pthread_mutex_init(&p->lock, NULL);
+	atomic_store_explicit(&tfs_preload.fds[fd], p, memory_order_release);
+	return fd;
+}
+
+#define tfs_open_mode(flags, mode) do{ \
+		if((flags) & O_CREAT || ((flags) & O_TMPFILE) == O_TMPFILE){ \
+			va_list ap; \
+			va_start(ap, flags); \
+			mode = va_arg(ap, int); \
+			va_end(ap); \
+		} \
+	}while(0)
+
+int open(const char* path, int flags, ...){
+	mode_t mode = 0;
+	tfs_open_mode(flags, mode);
+	return tfs_preload_open(AT_FDCWD, path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...){
+	mode_t mode = 0;
+	tfs_open_mode(flags, mode);
+	return tfs_preload_open(AT_FDCWD, path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, ...){
+	mode_t mode = 0;
+	tfs_open_mode(flags, mode);
+	return tfs_preload_open(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char* path, int flags, ...){
+	mode_t mode = 0;
+	tfs_open_mode(flags, mode);
+	return tfs_preload_open(dirfd, path, flags, mode);
+}
+
+/* what _FORTIFY_SOURCE builds call */
+int __open_2(const char* path, int flags){
+	return tfs_preload_open(AT_FDCWD, path, flags, 0);
+}
+
+int __open64_2(const char* path, int flags){
+	return tfs_preload_open(AT_FDCWD, path, flags, 0);
+}
+
+int __openat_2(int dirfd, const char* path, int flags){
+	return tfs_preload_open(dirfd, path, flags, 0);
+}
+
+int __openat64_2(int dirfd, const char* path, int flags){
+	return tfs_preload_open(dirfd, path, flags, 0);
+}
+
+ssize_t read(int fd, void* buf, size_t len){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(read)(fd, buf, len);
+	pthread_mutex_lock(&p->lock);
+	ssize_t got = tfs_pfd_pread(p->file, buf, len, p->file->now_pos);
+	if(got > 0) p->file->now_pos += got;
+	pthread_mutex_unlock(&p->lock);
+	return got;
+}
+
+ssize_t __read_chk(int fd, void* buf, size_t len, size_t buflen){
+	if(len > buflen) abort();
+	return read(fd, buf, len);
+}
+
+ssize_t pread(int fd, void* buf, size_t len, off_t off){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(pread)(fd, buf, len, off);
+	if(off < 0){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	return tfs_pfd_pread(p->file, buf, len, off);
+}
+
+ssize_t pread64(int fd, void* buf, size_t len, off_t off){
+	return pread(fd, buf, len, off);
+}
+
+ssize_t __pread_chk(int fd, void* buf, size_t len, off_t off, size_t buflen){
+	if(len > buflen) abort();
+	return pread(fd, buf, len, off);
+}
+
+ssize_t __pread64_chk(int fd, void* buf, size_t len, off_t off, size_t buflen){
+	return __pread_chk(fd, buf, len, off, buflen);
+}
+
+/* into each buffer in turn from off, or from the position and moving it with off -1 */
+static ssize_t tfs_pfd_readv(struct tfs_pfd* p, const struct iovec* iov, int count, off_t off){
+	if(count < 0 || count > IOV_MAX || off < -1){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	if(off < 0) pthread_mutex_lock(&p->lock);
+	uint64_t pos = off < 0? p->file->now_pos: (uint64_t) off;
+	ssize_t done = 0;
+	for(int i = 0; i < count; ++i){
+		ssize_t got = tfs_pfd_pread(p->file, iov[i].iov_base, iov[i].iov_len, pos + done);
+		if(got < 0 && !done) done = -1;
+		if(got <= 0) break;
+		done += got;
+		if((size_t) got < iov[i].iov_len) break;
+	}
+	if(off < 0){
+		if(done > 0) p->file->now_pos += done;
+		pthread_mutex_unlock(&p->lock);
+	}
+	return done;
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int count){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(readv)(fd, iov, count);
+	return tfs_pfd_readv(p, iov, count, -1);
+}
+
+ssize_t preadv(int fd, const struct iovec* iov, int count, off_t off){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(preadv)(fd, iov, count, off);
+	if(off < 0){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	return tfs_pfd_readv(p, iov, count, off);
+}
+
+ssize_t preadv64(int fd, const struct iovec* iov, int count, off_t off){
+	return preadv(fd, iov, count, off);
+}
+
+/* the flags only hint at how to wait, a member never blocks */
+ssize_t preadv2(int fd, const struct iovec* iov, int count, off_t off, int flags){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(preadv2)(fd, iov, count, off, flags);
+	return tfs_pfd_readv(p, iov, count, off);
+}
+
+ssize_t preadv64v2(int fd, const struct iovec* iov, int count, off_t off, int flags){
+	return preadv2(fd, iov, count, off, flags);
+}
+
+off_t lseek(int fd, off_t off, int whence){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(lseek)(fd, off, whence);
+	pthread_mutex_lock(&p->lock);
+	TFS_FILE* f = p->file;
+	off_t base = whence == SEEK_SET || whence == SEEK_DATA? 0:
+		whence == SEEK_CUR? (off_t) f->now_pos:
+		whence == SEEK_END || whence == SEEK_HOLE? (off_t) f->data_len: -1;
+	off_t pos = base < 0 || (off > 0 && base > INT64_MAX - off)? -1: base + off;
+	/* the one hole is the end */
+	if(whence == SEEK_HOLE) pos = off < (off_t) f->data_len && off >= 0? (off_t) f->data_len: -1;
+	if(whence == SEEK_DATA && off >= (off_t) f->data_len) pos = -1;
+	if(pos < 0) TFS_SETERRNO(whence == SEEK_DATA || whence == SEEK_HOLE? ENXIO: EINVAL);
+	else f->now_pos = pos;
+	pthread_mutex_unlock(&p->lock);
+	return pos;
+}
+
+off_t lseek64(int fd, off_t off, int whence){
+	return lseek(fd, off, whence);
+}
+
+int close(int fd){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(p && (p = atomic_exchange(&tfs_preload.fds[fd], NULL))){
+		tfs_fclose((FILE*) p->file);
+		pthread_mutex_destroy(&p->lock);
+		free(p);
+	}
+	return TFS_REAL(close)(fd);
+}
+
+/* the rest the mapping covers past the member reads as zeros, as past the end of a file */
+static void* tfs_pfd_mmap(const TFS_FILE* f, void* addr, size_t len, int prot, int flags, off_t off){
+	if(off < 0 || len == 0){
+		TFS_SETERRNO(EINVAL);
+		return MAP_FAILED;
+	}
+	if(prot & PROT_WRITE && flags & MAP_SHARED){
+		TFS_SETERRNO(EACCES);
+		return MAP_FAILED;
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t span = (len + page - 1) & ~(page - 1);
+	uint64_t at = f->data_begin + off;
+	const struct tfs_archive* src = tfs_archive_layer(f->arc, &at);
+	uint64_t have = (uint64_t) off < f->data_len? f->data_len - off: 0;
+	/* pages wholly past the end of the tar would fault */
+	if(src->fd >= 0 && !src->z && at % page == 0 && at + span <= ((src->size + page - 1) & ~(page - 1))){
+		char* map = TFS_REAL(mmap)(addr, len, prot, flags, src->fd, at);
+		if(map == MAP_FAILED || have >= span) return map;
+		/* the page the member ends in, or any after, is a copy with zeros past the member */
+		size_t from = have & ~(page - 1);
+		char* tail = TFS_REAL(mmap)(map + from, span - from, PROT_READ | PROT_WRITE,
+			MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(tail == MAP_FAILED || (have > from && tfs_pfd_pread(f, tail, have - from, off + from) != (ssize_t) (have - from))){
+			int err = tail == MAP_FAILED? errno: EIO;
+			munmap(map, len);
+			TFS_SETERRNO(err);
+			return MAP_FAILED;
+		}
+		if(prot != (PROT_READ | PROT_WRITE)) mprotect(tail, span - from, prot);
+		return map;
+	}
+	/* a copy, nobody can tell it from sharing a file that never changes */
+	int keep = flags & (MAP_FIXED | MAP_FIXED_NOREPLACE | MAP_POPULATE | MAP_NORESERVE);
+	char* map = TFS_REAL(mmap)(addr, len, PROT_READ | PROT_WRITE, keep | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) return map;
+	for(size_t done = 0; done < have && done < len; ){
+		ssize_t got = tfs_pfd_pread(f, map + done, len - done, off + done);
+		if(got <= 0){
+			int err = got < 0? errno: EIO;
+			munmap(map, len);
+			TFS_SETERRNO(err);
+			return MAP_FAILED;
+		}
+		done += got;
+	}
+	if(prot != (PROT_READ | PROT_WRITE)) mprotect(map, len, prot);
+	return map;
+}
+
+void* mmap(void* addr, size_t len, int prot, int flags, int fd, off_t off){
+	struct tfs_pfd* p = flags & MAP_ANONYMOUS? NULL: tfs_pfd(fd);
+	if(!p) return TFS_REAL(mmap)(addr, len, prot, flags, fd, off);
+	return tfs_pfd_mmap(p->file, addr, len, prot, flags, off);
+}
+
+void* mmap64(void* addr, size_t len, int prot, int flags, int fd, off_t off){
+	return mmap(addr, len, prot, flags, fd, off);
+}
+
+/* the kernel cannot copy from a member, callers fall back to read */
+ssize_t copy_file_range(int in, off64_t* in_off, int out, off64_t* out_off, size_t len, unsigned int flags){
+	if(tfs_pfd(in)){
+		TFS_SETERRNO(EXDEV);
+		return -1;
+	}
+	return TFS_REAL(copy_file_range)(in, in_off, out, out_off, len, flags);
+}
+
+ssize_t sendfile(int out, int in, off_t* off, size_t len){
+	if(tfs_pfd(in)){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	return TFS_REAL(sendfile)(out, in, off, len);
+}
+
+ssize_t sendfile64(int out, int in, off_t* off, size_t len){
+	return sendfile(out, in, off, len);
+}
+
+
+/* stat */
+
+int fstat(int fd, struct stat* st){
+	struct tfs_pfd* p = tfs_pfd(fd);
+	if(!p) return TFS_REAL(fstat)(fd, st);
+	tfs_stat_entry(&p->file->arc->idx, p->file->id, st);
+	return 0;
+}
+
+/* NULL too, where the kernel allows it with AT_EMPTY_PATH; libc declares path nonnull */
+static int tfs_preload_empty(const char* path){
+	return !path || !*path;
+}
+
+int fstatat(int dirfd, const char* path, struct stat* st, int flags){
+	char tpath[TFS_PATH_MAX];
+	if(flags & AT_EMPTY_PATH && tfs_preload_empty(path) && tfs_pfd(dirfd)) return fstat(dirfd, st);
+	if(!tfs_preload_path(dirfd, path, tpath, sizeof(tpath))) return TFS_REAL(fstatat)(dirfd, path, st, flags);
+	return tfs_stat_follow(tpath, st, !(flags & AT_SYMLINK_NOFOLLOW));
+}
+
+int stat(const char* path, struct stat* st){
+	return fstatat(AT_FDCWD, path, st, 0);
+}
+
+int lstat(const char* path, struct stat* st){
+	return fstatat(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+int fstat64(int fd, struct stat64* st){
+	return fstat(fd, (struct stat*) st);
+}
+
+int fstatat64(int dirfd, const char* path, struct stat64* st, int flags){
+	return fstatat(dirfd, path, (struct stat*) st, flags);
+}
+
+int stat64(const char* path, struct stat64* st){
+	return fstatat(AT_FDCWD, path, (struct stat*) st, 0);
+}
+
+int lstat64(const char* path, struct stat64* st){
+	return fstatat(AT_FDCWD, path, (struct stat*) st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* what binaries built against glibc before 2.33 call */
+int __fxstat(int ver, int fd, struct stat* st){
+	(void) ver;
+	return fstat(fd, st);
+}
+
+int __xstat(int ver, const char* path, struct stat* st){
+	(void) ver;
+	return fstatat(AT_FDCWD, path, st, 0);
+}
+
+int __lxstat(int ver, const char* path, struct stat* st){
+	(void) ver;
+	return fstatat(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+int __fxstatat(int ver, int dirfd, const char* path, struct stat* st, int flags){
+	(void) ver;
+	return fstatat(dirfd, path, st, flags);
+}
+
+int __fxstat64(int ver, int fd, struct stat64* st){
+	return __fxstat(ver, fd, (struct stat*) st);
+}
+
+int __xstat64(int ver, const char* path, struct stat64* st){
+	return __xstat(ver, path, (struct stat*) st);
+}
+
+int __lxstat64(int ver, const char* path, struct stat64* st){
+	return __lxstat(ver, path, (struct stat*) st);
+}
+
+int __fxstatat64(int ver, int dirfd, const char* path, struct stat64* st, int flags){
+	return __fxstatat(ver, dirfd, path, (struct stat*) st, flags);
+}
+
+int statx(int dirfd, const char* path, int flags, unsigned int mask, struct statx* stx){
+	struct stat st;
+	char tpath[TFS_PATH_MAX];
+	int res;
+	if(flags & AT_EMPTY_PATH && tfs_preload_empty(path) && tfs_pfd(dirfd)) res = fstat(dirfd, &st);
+	else if(tfs_preload_path(dirfd, path, tpath, sizeof(tpath))) res = tfs_stat_follow(tpath, &st, !(flags & AT_SYMLINK_NOFOLLOW));
+	else return TFS_REAL(statx)(dirfd, path, flags, mask, stx);
+	if(res != 0) return res;
+	memset(stx, 0, sizeof(*stx));
+	stx->stx_mask = STATX_BASIC_STATS;
+	stx->stx_blksize = st.st_blksize;
+	stx->stx_nlink = st.st_nlink;
+	stx->stx_mode = st.st_mode;
+	stx->stx_ino = st.st_ino;
+	stx->stx_size = st.st_size;
+	stx->stx_blocks = st.st_blocks;
+	stx->stx_atime.tv_sec = st.st_atim.tv_sec;
+	stx->stx_mtime.tv_sec = st.st_mtim.tv_sec;
+	stx->stx_ctime.tv_sec = st.st_ctim.tv_sec;
+	return 0;
+}
+
+int faccessat(int dirfd, const char* path, int mode, int flags){
+	char tpath[TFS_PATH_MAX];
+	if(!tfs_preload_path(dirfd, path, tpath, sizeof(tpath))) return TFS_REAL(faccessat)(dirfd, path, mode, flags);
+	struct stat st;
+	if(tfs_stat_follow(tpath, &st, !(flags & AT_SYMLINK_NOFOLLOW)) != 0) return -1;
+	if(mode & W_OK){
+		TFS_SETERRNO(EROFS);
+		return -1;
+	}
+	if(mode & X_OK && !(st.st_mode & S_IXUSR)){
+		TFS_SETERRNO(EACCES);
+		return -1;
+	}
+	return 0;
+}
+
+int access(const char* path, int mode){
+	return faccessat(AT_FDCWD, path, mode, 0);
+}
+
+ssize_t readlinkat(int dirfd, const char* path, char* buf, size_t size){
+	char tpath[TFS_PATH_MAX];
+	if(!tfs_preload_path(dirfd, path, tpath, sizeof(tpath))) return TFS_REAL(readlinkat)(dirfd, path, buf, size);
+	return tfs_readlink(tpath, buf, size);
+}
+
+ssize_t readlink(const char* path, char* buf, size_t size){
+	return readlinkat(AT_FDCWD, path, buf, size);
+}
+
+
+/* stdio and directories, whose libc versions open and read underneath the shim */
+
+static ssize_t tfs_preload_cookie_read(void* cookie, char* buf, size_t len){
+	return read((int) (intptr_t) cookie, buf, len);
+}
+
+static int tfs_preload_cookie_seek(void* cookie, off64_t* off, int whence){
+	off_t pos = lseek((int) (intptr_t) cookie, *off, whence);
+	if(pos < 0) return -1;
+	*off = pos;
+	return 0;
+}
+
+static int tfs_preload_cookie_close(void* cookie){
+	return close((int) (intptr_t) cookie);
+}
+
+FILE* fopen(const char* path, const char* mode){
+	char tpath[TFS_PATH_MAX];
+	if(!mode || !tfs_preload_path(AT_FDCWD, path, tpath, sizeof(tpath))) return TFS_REAL(fopen)(path, mode);
+	if(mode[0] != 'r' || strchr(mode, '+')){
+		TFS_SETERRNO(EROFS);
+		return NULL;
+	}
+	int fd = tfs_preload_open(AT_FDCWD, path, O_RDONLY | (strchr(mode, 'e')? O_CLOEXEC: 0), 0);
+	if(fd < 0) return NULL;
+	FILE* fp = fdopen(fd, mode);
+	if(!fp) close(fd);
+	return fp;
+}
+
+FILE* fdopen(int fd, const char* mode){
+	/* a directory, opened by libc, is libc's */
+	if(!mode || !tfs_pfd(fd)) return TFS_REAL(fdopen)(fd, mode);
+	if(mode[0] != 'r' || strchr(mode, '+')){
+		TFS_SETERRNO(EINVAL);
+		return NULL;
+	}
+	cookie_io_functions_t io = { tfs_preload_cookie_read, NULL, tfs_preload_cookie_seek, tfs_preload_cookie_close };
+	return fopencookie((void*) (intptr_t) fd, "r", io);
+}
+
+FILE* fopen64(const char* path, const char* mode){
+	return fopen(path, mode);
+}
+
+DIR* opendir(const char* path){
+	char tpath[TFS_PATH_MAX];
+	if(!tfs_preload_path(AT_FDCWD, path, tpath, sizeof(tpath))) return TFS_REAL(opendir)(path);
+	return tfs_opendir(tpath);
+}
+
+struct dirent* readdir(DIR* dirp){
+	if(IS_TFS_FILE(dirp)) return tfs_readdir(dirp);
+	return TFS_REAL(readdir)(dirp);
+}
+
+struct dirent64* readdir64(DIR* dirp){
+	return (struct dirent64*) readdir(dirp);
+}
+
+int closedir(DIR* dirp){
+	if(IS_TFS_FILE(dirp)) return tfs_closedir(dirp);
+	return TFS_REAL(closedir)(dirp);
+}
+
+
+__attribute__((constructor)) static void tfs_preload_init(void){
+	const char* spec = getenv("TFS_PRELOAD");
+	char* copy = spec && *spec? strdup(spec): NULL;
+	tfs_preload.fds = copy? calloc(TFS_PRELOAD_FDS, sizeof(*tfs_preload.fds)): NULL;
+	if(!tfs_preload.fds){
+		free(copy);
+		return;
+	}
+	/* off unless asked for, it leaves an index behind in TFS_SHARED_DIR */
+	const char* shared = getenv("TFS_PRELOAD_SHARED");
+	int flags = shared && !strcmp(shared, "1")? TFS_INIT_SHARED: 0;
+	int count = 0;
+	char* save;
+	for(char* item = strtok_r(copy, ":", &save); item && count < TFS_PRELOAD_PREFIXES; item = strtok_r(NULL, ":", &save)){
+		char* tar = strchr(item, '=');
+		char prefix[TFS_PATH_MAX];
+		/* the root would take every path from the tar, the libraries it needs included */
+		if(!tar || tfs_normpath(item, tar - item, prefix, sizeof(prefix)) <= 0){
+			fprintf(stderr, "libtfs_preload: expected <prefix>=<tar>, got %s\n", item);
+			continue;
+		}
+		++tar;
+		if(tfs_mount_ex(tar, prefix, count, flags) != 0){
+			fprintf(stderr, "libtfs_preload: %s: %s\n", tar, strerror(errno));
+			continue;
+		}
+		tfs_preload.prefixes[count] = strdup(prefix);
+		tfs_preload.lens[count] = strlen(prefix);
+		if(tfs_preload.prefixes[count]) ++count;
+	}
+	free(copy);
+	tfs_preload.count = count;
+}
@@ -0,0 +1,232 @@
+/*
+	header scan
+
+	the archive is read forward through one window, large while headers
+	come densely and shrinking when members are big so their data is
+	skipped rather than read; a mapping is walked in place. reads go
+	around the block cache, which a one-off pass would only flush.
+	header checks work on a whole block at a time: SSE2 on x86-64,
+	64-bit words elsewhere
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "unistd.h"
+
+#ifdef __SSE2__
+#include "emmintrin.h"
+#endif
+
+/* largest and smallest window read */
+#define TFS_SCAN_CHUNK (1 << 20)
+#define TFS_SCAN_MIN (16 << 10)
+
+static _Thread_local int64_t tfs_corrupt_at = -1;
+
+int64_t tfs_corrupt_offset(void){
+	return tfs_corrupt_at;
+}
+
+int tfs_hdr_iszero(const char* block){
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	for(int i = 0; i < 512; i += 16) acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*) (block + i)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#else
+	uint64_t acc = 0, w;
+	for(int i = 0; i < 512; i += 8){
+		memcpy(&w, block + i, 8);
+		acc |= w;
+	}
+	return acc == 0;
+#endif
+}
+
+/*
+	the check field holds the sum of the header bytes with itself taken as
+	spaces. most writers sum unsigned bytes, some old ones signed, both pass
+*/
+int tfs_hdr_checksum(const char* block){
+	const unsigned char* p = (const unsigned char*) block;
+	uint32_t sum = 0, high = 0;
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+	for(int i = 0; i < 512; i += 16){
+		__m128i v = _mm_loadu_si128((const __m128i*) (block + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+		high += __builtin_popcount(_mm_movemask_epi8(v));
+	}
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#else
+	for(int i = 0; i < 512; ++i){
+		sum += p[i];
+		high += p[i] >> 7;
+	}
+#endif
+	for(int i = 148; i < 156; ++i){
+		sum += ' ' - p[i];
+		high -= p[i] >> 7;
+	}
+	uint64_t stored = ctar_oct2u64(block + 148, 8);
+	return stored == sum || stored == sum - 256 * high? 0: -1;
+}
+
+/* numeric header field: octal padded with spaces or NULs, or base-256 */
+uint64_t tfs_hdr_num(const char* field, unsigned int size){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* the usual shape, 11 digits and a terminator: the last 8 digits go in one word */
+	const unsigned char* p = (const unsigned char*) field;
+	uint64_t v;
+	if(size == 12 && (p[11] == '\0' || p[11] == ' ')
+		&& (unsigned) (p[0] - '0') < 8 && (unsigned) (p[1] - '0') < 8 && (unsigned) (p[2] - '0') < 8){
+		memcpy(&v, p + 3, 8);
+		v ^= 0x3030303030303030ull;
+		if(!(v & 0xf8f8f8f8f8f8f8f8ull)){
+			/* pairs of digits, then quads, then all eight, the earlier one weighing more */
+			v = (v * 8 + (v >> 8)) & 0x003f003f003f003full;
+			v = (v * 64 + (v >> 16)) & 0x00000fff00000fffull;
+			v = (v * 4096 + (v >> 32)) & 0xffffff;
+			return ((uint64_t) ((p[0] - '0') * 64 + (p[1] - '0') * 8 + (p[2] - '0')) << 24) | v;
+		}
+	}
+#endif
+	return ctar_oct2u64(field, size);
+}
+
+struct tfs_window {
+	const struct tfs_archive* arc;
+	/* owned, NULL while walking a mapping */
+	char* buf;
+	const char* data;
+	/* archive offset of data[0] */
+	uint64_t off;
+	size_t len;
+	size_t want;
+	/* headers taken from the current window */
+	unsigned used;
+};
+
+static ssize_t tfs_window_read(const struct tfs_archive* arc, char* buf, size_t len, uint64_t off){
+	if(arc->z) return tfs_archive_read(arc, buf, len, off);
+	size_t got = 0;
+	while(got < len){
+		ssize_t n = pread(arc->fd, buf + got, len - got, off + got);
+		if(n < 0 && errno == EINTR) continue;
+		if(n < 0) return -1;
+		if(n == 0) break;
+		got += n;
+	}
+	return got;
+}
+
+int tfs_corrupt(uint64_t off){
+	tfs_corrupt_at = off;
+	TFS_SETERRNO(EBADMSG);
+	return -1;
+}
+
+_Static_assert(TFS_EXT_MAX <= TFS_SCAN_CHUNK, "an extended header must fit a window");
+
+/* len bytes at off into *out: 1, 0 when off is past the end, -1 with errno when they cannot be read */
+static int tfs_window_at(struct tfs_window* w, uint64_t off, size_t len, const char** out){
+	if(off >= w->off && off - w->off + len <= w->len){
+		*out = w->data + (off - w->off);
+		return 1;
+	}
+	if(off >= w->arc->size) return 0;
+	if(len > w->arc->size - off) return tfs_corrupt(off);
+	/* a window that held a single header was mostly member data nobody needed */
+	if(w->used <= 1 && w->want > TFS_SCAN_MIN) w->want /= 2;
+	else if(w->used > 1 && w->want < TFS_SCAN_CHUNK) w->want *= 2;
+	size_t n = w->want < len? len: w->want;
+	if(n > w->arc->size - off) n = w->arc->size - off;
+	errno = 0;
+	ssize_t got = tfs_window_read(w->arc, w->buf, n, off);
+	w->off = off;
+	w->len = got < 0? 0: got;
+	w->used = 0;
+	if(w->len < len){
+		/* the tar shrank under us, or decompression failed */
+		if(got >= 0 || !errno) TFS_SETERRNO(EIO);
+		return -1;
+	}
+	*out = w->data;
+	return 1;
+}
+
+int tfs_archive_scan(const struct tfs_archive* arc, struct tfs_builder* b){
+	struct tfs_window w = { .arc = arc, .want = TFS_SCAN_CHUNK };
+	struct ctar_t header;
+	if(arc->map){
+		w.data = arc->map;
+		w.len = arc->size;
+	}else{
+		w.buf = malloc(TFS_SCAN_CHUNK);
+		w.data = w.buf;
+	}
+	struct tfs_meta* meta = calloc(2, sizeof(*meta));
+	struct tfs_member* m = malloc(sizeof(*m));
+	char* ext = malloc(TFS_EXT_MAX + 1);
+	int res = -1;
+	tfs_corrupt_at = -1;
+	if((!arc->map && !w.buf) || !meta || !m || !ext) goto out;
+
+	uint64_t off = 0;
+	for(;;){
+		const char* block;
+		int at = tfs_window_at(&w, off, 512, &block);
+		if(at < 0) goto out;
+		if(at == 0) break;
+		if(tfs_hdr_iszero(block)){
+			/* two zero blocks end the archive, a lone one is skipped */
+			at = tfs_window_at(&w, off + 512, 512, &block);
+			if(at < 0) goto out;
+			if(at == 0 || tfs_hdr_iszero(block)) break;
+			off += 512;
+		}
+		++w.used;
+		if(tfs_hdr_checksum(block) != 0){
+			tfs_corrupt(off);
+			goto out;
+		}
+		/* block is only good until the window moves */
+		memcpy(header.block, block, sizeof(header.block));
+		uint64_t data = off + 512;
+		uint64_t size = tfs_hdr_num(header.size, sizeof(header.size));
+		char type = header.type;
+		if(tfs_header_isext(type)){
+			if(size > arc->size - data){
+				tfs_corrupt(off);
+				goto out;
+			}
+			if(size <= TFS_EXT_MAX){
+				const char* src = "";
+				if(size && tfs_window_at(&w, data, size, &src) < 0) goto out;
+				memcpy(ext, src, size);
+				ext[size] = '\0';
+				tfs_meta_ext(&meta[type == 'g'? 1: 0], type, ext, size);
+			}
+			off = data + ((size + 511) & ~(uint64_t) 511);
+			continue;
+		}
+		/* members whose path cannot be represented are skipped, not fatal */
+		int usable = tfs_member_decode(m, &header, meta) == 0;
+		if(m->size > arc->size - data){
+			tfs_corrupt(off);
+			goto out;
+		}
+		if(usable && tfs_builder_add(b, m->path, m->linkpath, data, m->size, m->mtime, m->type) != 0) goto out;
+		off = data + ((m->size + 511) & ~(uint64_t) 511);
+	}
+	res = 0;
+out:
+	free(w.buf);
+	free(meta);
+	free(m);
+	free(ext);
+	return res;
+}
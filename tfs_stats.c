@@ -0,0 +1,203 @@
+/*
+	runtime counters and trace hooks
+
+	process-wide counters are relaxed atomics, like the cache's. every
+	mount also carries one set of counters per entry, so the hot members
+	of the current archive can be listed. trace hooks only exist when
+	built with TFS_WITH_TRACE, otherwise TFS_TRACE expands to nothing
+*/
+
+#include "tfs_internal.h"
+
+#include "string.h"
+#include "stdlib.h"
+#include "time.h"
+
+static atomic_uint_fast64_t tfs_stats_opens;
+static atomic_uint_fast64_t tfs_stats_misses;
+static atomic_uint_fast64_t tfs_stats_closes;
+static atomic_uint_fast64_t tfs_stats_reads;
+static atomic_uint_fast64_t tfs_stats_bytes;
+static atomic_uint_fast64_t tfs_stats_seeks;
+
+#define tfs_stats_inc(counter, n) atomic_fetch_add_explicit(&(counter), n, memory_order_relaxed)
+
+int tfs_stats_attach(struct tfs_archive* arc){
+	arc->mstats = calloc(arc->idx.count? arc->idx.count: 1, sizeof(*arc->mstats));
+	return arc->mstats? 0: -1;
+}
+
+void tfs_stats_open(const struct tfs_archive* arc, tfs_entry_id id){
+	if(id == TFS_ENTRY_NONE){
+		tfs_stats_inc(tfs_stats_misses, 1);
+		return;
+	}
+	tfs_stats_inc(tfs_stats_opens, 1);
+	if(arc->mstats) tfs_stats_inc(arc->mstats[id].opens, 1);
+}
+
+void tfs_stats_read(const struct tfs_archive* arc, tfs_entry_id id, size_t bytes){
+	tfs_stats_inc(tfs_stats_reads, 1);
+	tfs_stats_inc(tfs_stats_bytes, bytes);
+	if(!arc->mstats || id < 0 || id >= arc->idx.count) return;
+	tfs_stats_inc(arc->mstats[id].reads, 1);
+	tfs_stats_inc(arc->mstats[id].bytes, bytes);
+}
+
+void tfs_stats_seek(void){
+	tfs_stats_inc(tfs_stats_seeks, 1);
+}
+
+void tfs_stats_close(void){
+	tfs_stats_inc(tfs_stats_closes, 1);
+}
+
+void tfs_stats_snapshot(struct tfs_stats* stats){
+	if(!stats) return;
+	stats->opens = atomic_load(&tfs_stats_opens);
+	stats->open_misses = atomic_load(&tfs_stats_misses);
+	stats->closes = atomic_load(&tfs_stats_closes);
+	stats->reads = atomic_load(&tfs_stats_reads);
+	stats->bytes_read = atomic_load(&tfs_stats_bytes);
+	stats->seeks = atomic_load(&tfs_stats_seeks);
+	tfs_cache_getstats(&stats->cache);
+}
+
+int tfs_stats_member(tfs_entry_id id, struct tfs_member_stats* stats){
+	unsigned token;
+	const struct tfs_archive* arc = tfs_archive_enter(&token);
+	int res = -1;
+	if(!stats || !arc || !arc->mstats || id < 0 || id >= arc->idx.count) TFS_SETERRNO(ENOENT);
+	else{
+		const struct tfs_mstat* m = &arc->mstats[id];
+		stats->opens = atomic_load(&m->opens);
+		stats->reads = atomic_load(&m->reads);
+		stats->bytes_read = atomic_load(&m->bytes);
+		res = 0;
+	}
+	tfs_archive_leave(token);
+	return res;
+}
+
+void tfs_stats_reset(void){
+	atomic_store(&tfs_stats_opens, 0);
+	atomic_store(&tfs_stats_misses, 0);
+	atomic_store(&tfs_stats_closes, 0);
+	atomic_store(&tfs_stats_reads, 0);
+	atomic_store(&tfs_stats_bytes, 0);
+	atomic_store(&tfs_stats_seeks, 0);
+	unsigned token;
+	struct tfs_archive* arc = tfs_archive_enter(&token);
+	for(uint32_t i = 0; arc && arc->mstats && i < arc->idx.count; ++i){
+		atomic_store(&arc->mstats[i].opens, 0);
+		atomic_store(&arc->mstats[i].reads, 0);
+		atomic_store(&arc->mstats[i].bytes, 0);
+	}
+	tfs_archive_leave(token);
+}
+
+
+/* json */
+
+static void tfs_json_str(FILE* fp, const char* s){
+	fputc('"', fp);
+	for(; *s; ++s){
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+		else if(c < 0x20) fprintf(fp, "\\u%04x", c);
+		else fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+struct tfs_hot {
+	uint32_t id;
+	uint64_t bytes;
+	uint64_t opens;
+	uint64_t reads;
+};
+
+/* most bytes first, then most opens */
+static int tfs_hot_cmp(const void* a, const void* b){
+	const struct tfs_hot* x = a, * y = b;
+	if(x->bytes != y->bytes) return x->bytes < y->bytes? 1: -1;
+	if(x->opens != y->opens) return x->opens < y->opens? 1: -1;
+	return x->id > y->id? 1: -1;
+}
+
+int tfs_stats_dump(FILE* fp, size_t top){
+	if(!fp){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	struct tfs_stats s;
+	tfs_stats_snapshot(&s);
+	fprintf(fp, "{\"opens\":%llu,\"open_misses\":%llu,\"closes\":%llu,\"reads\":%llu,"
+		"\"bytes_read\":%llu,\"seeks\":%llu,",
+		(unsigned long long) s.opens, (unsigned long long) s.open_misses, (unsigned long long) s.closes,
+		(unsigned long long) s.reads, (unsigned long long) s.bytes_read, (unsigned long long) s.seeks);
+	fprintf(fp, "\"cache\":{\"hits\":%llu,\"misses\":%llu,\"readahead\":%llu,\"evictions\":%llu,"
+		"\"bypass\":%llu,\"used\":%zu,\"budget\":%zu,\"block_size\":%zu},",
+		(unsigned long long) s.cache.hits, (unsigned long long) s.cache.misses,
+		(unsigned long long) s.cache.readahead, (unsigned long long) s.cache.evictions,
+		(unsigned long long) s.cache.bypass, s.cache.used, s.cache.budget, s.cache.block_size);
+
+	/* members that were touched at all, hottest first */
+	fputs("\"members\":[", fp);
+	struct tfs_archive* arc = tfs_archive_acquire();
+	const struct tfs_index* idx = arc? &arc->idx: NULL;
+	struct tfs_hot* hot = top && arc && arc->mstats? malloc(idx->count * sizeof(*hot)): NULL;
+	size_t n = 0;
+	for(uint32_t i = 0; hot && i < idx->count; ++i){
+		const struct tfs_mstat* m = &arc->mstats[i];
+		struct tfs_hot h = { i, atomic_load(&m->bytes), atomic_load(&m->opens), atomic_load(&m->reads) };
+		if(h.opens || h.reads) hot[n++] = h;
+	}
+	if(n) qsort(hot, n, sizeof(*hot), tfs_hot_cmp);
+	for(size_t i = 0; i < n && i < top; ++i){
+		fputs(i? ",{\"path\":": "{\"path\":", fp);
+		tfs_json_str(fp, tfs_index_path(idx, hot[i].id));
+		fprintf(fp, ",\"opens\":%llu,\"reads\":%llu,\"bytes_read\":%llu}", (unsigned long long) hot[i].opens,
+			(unsigned long long) hot[i].reads, (unsigned long long) hot[i].bytes);
+	}
+	free(hot);
+	tfs_archive_release(arc);
+	fputs("]}\n", fp);
+	return ferror(fp)? -1: 0;
+}
+
+
+/* tracing */
+
+#ifdef TFS_WITH_TRACE
+_Atomic(tfs_trace_cb) tfs_trace_hook = NULL;
+void* _Atomic tfs_trace_user = NULL;
+
+uint64_t tfs_trace_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int tfs_trace(tfs_trace_cb cb, void* user){
+	/* the user pointer is in place before a callback can see it */
+	atomic_store(&tfs_trace_hook, NULL);
+	atomic_store(&tfs_trace_user, user);
+	atomic_store(&tfs_trace_hook, cb);
+	return 0;
+}
+
+void tfs_trace_emit(tfs_trace_cb cb, int type, tfs_entry_id id, const char* path, uint64_t offset,
+	size_t len, uint64_t ns){
+
+	struct tfs_trace_event ev = { type, id, path, offset, len, ns };
+	cb(atomic_load(&tfs_trace_user), &ev);
+}
+#else
+int tfs_trace(tfs_trace_cb cb, void* user){
+	(void) cb;
+	(void) user;
+	TFS_SETERRNO(ENOTSUP);
+	return -1;
+}
+#endif
@@ -0,0 +1,298 @@
+/*
+	streaming reader
+
+	walks a tar arriving on a pipe, socket or stdin in a single forward
+	pass: no seeks, no index, memory bounded by one chunk. input comes in
+	large reads through one buffer, taking whatever has arrived; member data the caller asks for in
+	large pieces skips the buffer and lands in the caller's memory
+	directly, data it never asks for is read and dropped. gzip input is
+	inflated on the way when built with zlib
+*/
+
+#include "tfs_internal.h"
+#include "ctar.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "unistd.h"
+
+#ifdef TFS_WITH_ZLIB
+#include "zlib.h"
+#endif
+
+/* buffered read size, and the read size at which data bypasses the buffer */
+#define TFS_STREAM_CHUNK (1 << 20)
+#define TFS_STREAM_DIRECT (64 << 10)
+
+struct tfs_stream {
+	FILE* fp;
+	/* descriptor under fp, -1 for streams without one */
+	int fd;
+	/* decoded input, pos..len still unread */
+	char* buf;
+	size_t pos;
+	size_t len;
+	/* data of the current member not read yet, and the padding after it */
+	uint64_t left;
+	uint64_t pad;
+	/* sticky errno once a call failed, -1 after the end of the archive */
+	int failed;
+	struct tfs_meta meta[2];
+	struct tfs_member m;
+	char* ext;
+#ifdef TFS_WITH_ZLIB
+	/* compressed input, NULL for a plain tar */
+	char* in;
+	z_stream zs;
+	int zend;
+#endif
+};
+
+/* up to len bytes of input, as soon as any have arrived; 0 at its end */
+static ssize_t tfs_stream_raw(struct tfs_stream* s, char* dst, size_t len){
+	if(s->fd >= 0){
+		/* stdio would wait for all of len: what it holds already, then the descriptor (glibc FILE) */
+		size_t held = s->fp->_IO_read_end - s->fp->_IO_read_ptr;
+		if(held) return fread(dst, 1, held < len? held: len, s->fp);
+		ssize_t n;
+		while((n = read(s->fd, dst, len)) < 0 && errno == EINTR);
+		return n;
+	}
+	size_t n = tfs_fread(dst, 1, len, s->fp);
+	if(n == 0 && tfs_ferror(s->fp)){
+		if(!errno) TFS_SETERRNO(EIO);
+		return -1;
+	}
+	return n;
+}
+
+/* up to len decoded bytes, 0 at the end of the input */
+static ssize_t tfs_stream_fill(struct tfs_stream* s, char* dst, size_t len){
+#ifdef TFS_WITH_ZLIB
+	if(s->in){
+		s->zs.next_out = (Bytef*) dst;
+		s->zs.avail_out = len;
+		while(s->zs.avail_out == len){
+			if(!s->zs.avail_in){
+				ssize_t n = tfs_stream_raw(s, s->in, TFS_STREAM_CHUNK);
+				if(n < 0) return -1;
+				if(n == 0){
+					if(s->zend) return 0;
+					TFS_SETERRNO(EBADMSG);
+					return -1;
+				}
+				s->zs.next_in = (Bytef*) s->in;
+				s->zs.avail_in = n;
+			}
+			/* concatenated gzip members make one stream */
+			if(s->zend){
+				inflateReset(&s->zs);
+				s->zend = 0;
+			}
+			int rc = inflate(&s->zs, Z_NO_FLUSH);
+			if(rc == Z_STREAM_END) s->zend = 1;
+			else if(rc != Z_OK && rc != Z_BUF_ERROR){
+				TFS_SETERRNO(rc == Z_MEM_ERROR? ENOMEM: EBADMSG);
+				return -1;
+			}
+		}
+		return len - s->zs.avail_out;
+	}
+#endif
+	return tfs_stream_raw(s, dst, len);
+}
+
+static int tfs_stream_fail(struct tfs_stream* s, int err){
+	s->failed = err;
+	TFS_SETERRNO(err);
+	return -1;
+}
+
+/* refill an empty buffer; a short input inside a member is a truncated archive */
+static int tfs_stream_refill(struct tfs_stream* s){
+	ssize_t got = tfs_stream_fill(s, s->buf, TFS_STREAM_CHUNK);
+	if(got <= 0) return tfs_stream_fail(s, got < 0? errno: EBADMSG);
+	s->pos = 0;
+	s->len = got;
+	return 0;
+}
+
+/* the next n bytes into dst, or dropped with a NULL dst */
+static int tfs_stream_take(struct tfs_stream* s, char* dst, uint64_t n){
+	while(n){
+		if(s->pos == s->len && tfs_stream_refill(s) != 0) return -1;
+		size_t k = s->len - s->pos < n? s->len - s->pos: n;
+		if(dst){
+			memcpy(dst, s->buf + s->pos, k);
+			dst += k;
+		}
+		s->pos += k;
+		n -= k;
+	}
+	return 0;
+}
+
+/* one header block at pos; 1 when the input ends first */
+static int tfs_stream_block(struct tfs_stream* s){
+	if(s->len - s->pos >= 512) return 0;
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+	s->len -= s->pos;
+	s->pos = 0;
+	while(s->len < 512){
+		ssize_t got = tfs_stream_fill(s, s->buf + s->len, TFS_STREAM_CHUNK - s->len);
+		if(got < 0) return tfs_stream_fail(s, errno);
+		if(got == 0) return 1;
+		s->len += got;
+	}
+	return 0;
+}
+
+struct tfs_stream* tfs_stream_open(FILE* fp){
+	if(!fp){
+		TFS_SETERRNO(EINVAL);
+		return NULL;
+	}
+	struct tfs_stream* s = calloc(1, sizeof(*s));
+	char* buf = malloc(TFS_STREAM_CHUNK);
+	char* ext = malloc(TFS_EXT_MAX + 1);
+	if(!s || !buf || !ext){
+		free(s);
+		free(buf);
+		free(ext);
+		return NULL;
+	}
+	s->fp = fp;
+	s->fd = IS_TFS_FILE(fp)? -1: fileno(fp);
+	s->buf = buf;
+	s->ext = ext;
+	/* a block, enough to tell gzip from tar */
+	ssize_t got = 0, n = 1;
+	while(got < 512 && n > 0){
+		n = tfs_stream_raw(s, buf + got, TFS_STREAM_CHUNK - got);
+		if(n < 0){
+			tfs_stream_close(s);
+			return NULL;
+		}
+		got += n;
+	}
+	s->len = got;
+#ifdef TFS_WITH_ZLIB
+	/* what was read is compressed input, the buffer starts over for its output */
+	if(got >= 2 && (unsigned char) buf[0] == 0x1f && (unsigned char) buf[1] == 0x8b){
+		s->in = buf;
+		s->buf = malloc(TFS_STREAM_CHUNK);
+		s->len = 0;
+		if(!s->buf || inflateInit2(&s->zs, 31) != Z_OK){
+			free(s->buf);
+			s->buf = NULL;
+			tfs_stream_close(s);
+			TFS_SETERRNO(ENOMEM);
+			return NULL;
+		}
+		s->zs.next_in = (Bytef*) s->in;
+		s->zs.avail_in = got;
+	}
+#endif
+	return s;
+}
+
+int tfs_stream_next(struct tfs_stream* s, struct tfs_stream_entry* entry){
+	if(!s || !entry){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	if(s->failed > 0) return tfs_stream_fail(s, s->failed);
+	if(s->failed < 0) return 0;
+	/* whatever the caller left of the last member */
+	if(tfs_stream_take(s, NULL, s->left + s->pad) != 0) return -1;
+	s->left = s->pad = 0;
+
+	struct ctar_t header;
+	for(;;){
+		int res = tfs_stream_block(s);
+		if(res < 0) return -1;
+		if(res == 0 && tfs_hdr_iszero(s->buf + s->pos)){
+			/* two zero blocks end the archive, a lone one is skipped */
+			s->pos += 512;
+			res = tfs_stream_block(s);
+			if(res < 0) return -1;
+			if(res == 0 && !tfs_hdr_iszero(s->buf + s->pos)) continue;
+		}
+		if(res != 0 || tfs_hdr_iszero(s->buf + s->pos)){
+			s->failed = -1;
+			return 0;
+		}
+		if(tfs_hdr_checksum(s->buf + s->pos) != 0) return tfs_stream_fail(s, EBADMSG);
+		memcpy(header.block, s->buf + s->pos, sizeof(header.block));
+		s->pos += 512;
+		uint64_t size = tfs_hdr_num(header.size, sizeof(header.size));
+		char type = header.type;
+		if(tfs_header_isext(type)){
+			uint64_t pad = ((size + 511) & ~(uint64_t) 511) - size;
+			if(size <= TFS_EXT_MAX){
+				if(tfs_stream_take(s, s->ext, size) != 0) return -1;
+				s->ext[size] = '\0';
+				tfs_meta_ext(&s->meta[type == 'g'? 1: 0], type, s->ext, size);
+				size = 0;
+			}
+			if(tfs_stream_take(s, NULL, size + pad) != 0) return -1;
+			continue;
+		}
+		/* members whose path cannot be represented are skipped, not fatal */
+		int usable = tfs_member_decode(&s->m, &header, s->meta) == 0;
+		s->left = s->m.size;
+		s->pad = ((s->m.size + 511) & ~(uint64_t) 511) - s->m.size;
+		if(!usable){
+			if(tfs_stream_take(s, NULL, s->left + s->pad) != 0) return -1;
+			s->left = s->pad = 0;
+			continue;
+		}
+		*entry = (struct tfs_stream_entry){
+			.path = s->m.path,
+			.linkpath = s->m.linkpath,
+			.size = s->m.size,
+			.mtime = s->m.mtime,
+			.mode = (uint32_t) tfs_hdr_num(header.mode, sizeof(header.mode)) & 07777,
+			.type = (char) s->m.type,
+		};
+		return 1;
+	}
+}
+
+ssize_t tfs_stream_read(struct tfs_stream* s, void* buf, size_t len){
+	if(!s || (!buf && len)){
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	if(s->failed > 0) return tfs_stream_fail(s, s->failed);
+	if(len > s->left) len = s->left;
+	if(!len) return 0;
+	size_t n;
+	if(s->pos == s->len && len >= TFS_STREAM_DIRECT){
+		/* never past the member, the buffer stays empty */
+		ssize_t got = tfs_stream_fill(s, buf, len);
+		if(got <= 0) return tfs_stream_fail(s, got < 0? errno: EBADMSG);
+		n = got;
+	}else{
+		if(s->pos == s->len && tfs_stream_refill(s) != 0) return -1;
+		n = s->len - s->pos < len? s->len - s->pos: len;
+		memcpy(buf, s->buf + s->pos, n);
+		s->pos += n;
+	}
+	s->left -= n;
+	return n;
+}
+
+void tfs_stream_close(struct tfs_stream* s){
+	if(!s) return;
+#ifdef TFS_WITH_ZLIB
+	if(s->in){
+		inflateEnd(&s->zs);
+		free(s->in);
+	}
+#endif
+	free(s->buf);
+	free(s->ext);
+	free(s);
+}
@@ -0,0 +1,141 @@
+/*
+	reload on change
+
+	the tar is usually replaced by renaming a new file over it, which a
+	watch on the file itself would not survive, so the directory is
+	watched and events are matched by name. a burst of events (a copy
+	written in pieces) is let settle before the reload. every tar mounted
+	from a file when the watch starts is covered
+*/
+
+#include "tfs_internal.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "poll.h"
+#include "pthread.h"
+#include "sys/eventfd.h"
+#include "sys/inotify.h"
+#include "unistd.h"
+
+/* quiet time after the last event before reloading */
+#define TFS_WATCH_SETTLE_MS 100
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int running;
+	int ifd;
+	/* wakes the thread to stop */
+	int efd;
+	/* base names of the tars, NULL terminated */
+	char** names;
+} tfs_watcher = { .lock = PTHREAD_MUTEX_INITIALIZER, .ifd = -1, .efd = -1 };
+
+static void tfs_watch_free(char** names){
+	for(size_t i = 0; names && names[i]; ++i) free(names[i]);
+	free(names);
+}
+
+/* drains ifd, whether any event was about one of the tars */
+static int tfs_watch_drain(int ifd, char* const* names){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int hit = 0;
+	ssize_t len;
+	while((len = read(ifd, buf, sizeof(buf))) > 0){
+		for(char* p = buf; p < buf + len; ){
+			const struct inotify_event* ev = (const struct inotify_event*) p;
+			for(size_t i = 0; ev->len && names[i]; ++i){
+				if(!strcmp(ev->name, names[i])) hit = 1;
+			}
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+	return hit;
+}
+
+static void* tfs_watch_thread(void* arg){
+	(void) arg;
+	struct pollfd pfd[2] = { { tfs_watcher.ifd, POLLIN, 0 }, { tfs_watcher.efd, POLLIN, 0 } };
+	int pending = 0;
+	for(;;){
+		int n = poll(pfd, 2, pending? TFS_WATCH_SETTLE_MS: -1);
+		if(n < 0 && errno != EINTR) break;
+		if(pfd[1].revents) break;
+		if(n > 0 && pfd[0].revents){
+			pending |= tfs_watch_drain(tfs_watcher.ifd, tfs_watcher.names);
+			continue;
+		}
+		/* a half written tar fails to mount and the old one stays, the next write retries */
+		if(n == 0 && pending){
+			pending = 0;
+			tfs_reload();
+		}
+	}
+	return NULL;
+}
+
+int tfs_watch(void){
+	char** paths = tfs_mounts_paths();
+	if(!paths || !paths[0]){
+		tfs_watch_free(paths);
+		TFS_SETERRNO(EINVAL);
+		return -1;
+	}
+	pthread_mutex_lock(&tfs_watcher.lock);
+	if(tfs_watcher.running){
+		pthread_mutex_unlock(&tfs_watcher.lock);
+		tfs_watch_free(paths);
+		TFS_SETERRNO(EBUSY);
+		return -1;
+	}
+	tfs_watcher.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	tfs_watcher.efd = eventfd(0, EFD_CLOEXEC);
+	int res = tfs_watcher.ifd >= 0 && tfs_watcher.efd >= 0? 0: -1;
+	/* paths become their base names, the directories are watched; a directory twice is one watch */
+	for(size_t i = 0; res == 0 && paths[i]; ++i){
+		char* slash = strrchr(paths[i], '/');
+		char* base = strdup(slash? slash + 1: paths[i]);
+		if(!base){
+			res = -1;
+			break;
+		}
+		if(slash == paths[i]) slash[1] = '\0';
+		else if(slash) *slash = '\0';
+		if(inotify_add_watch(tfs_watcher.ifd, slash? paths[i]: ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) res = -1;
+		free(paths[i]);
+		paths[i] = base;
+	}
+	tfs_watcher.names = paths;
+	if(res == 0 && pthread_create(&tfs_watcher.thread, NULL, tfs_watch_thread, NULL) == 0){
+		tfs_watcher.running = 1;
+	}else{
+		int err = errno;
+		if(tfs_watcher.ifd >= 0) close(tfs_watcher.ifd);
+		if(tfs_watcher.efd >= 0) close(tfs_watcher.efd);
+		tfs_watch_free(tfs_watcher.names);
+		tfs_watcher.ifd = tfs_watcher.efd = -1;
+		tfs_watcher.names = NULL;
+		TFS_SETERRNO(err);
+		res = -1;
+	}
+	pthread_mutex_unlock(&tfs_watcher.lock);
+	return res;
+}
+
+void tfs_unwatch(void){
+	pthread_mutex_lock(&tfs_watcher.lock);
+	if(tfs_watcher.running){
+		uint64_t one = 1;
+		while(write(tfs_watcher.efd, &one, sizeof(one)) < 0 && errno == EINTR);
+		pthread_join(tfs_watcher.thread, NULL);
+		close(tfs_watcher.ifd);
+		close(tfs_watcher.efd);
+		tfs_watch_free(tfs_watcher.names);
+		tfs_watcher.ifd = tfs_watcher.efd = -1;
+		tfs_watcher.names = NULL;
+		tfs_watcher.running = 0;
+	}
+	pthread_mutex_unlock(&tfs_watcher.lock);
+}
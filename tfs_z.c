@@ -0,0 +1,673 @@
+/*
+	random access into gzip and zstd tarballs
+
+	one sequential pass records checkpoints roughly every span bytes of
+	output: for gzip the bit position at a deflate block boundary plus the
+	32 KiB window before it, for zstd the start of a frame. a zstd decoder
+	cannot be resumed inside a frame, so zstd archives want many small
+	frames; those in the seekable format carry a seek table listing them,
+	which places the checkpoints without the pass. a read then
+	decompresses from the nearest checkpoint, or from a decoder already
+	parked just before it, into fixed size windows kept in a small LRU
+*/
+
+#include "tfs_internal.h"
+
+#include "string.h"
+#include "stdlib.h"
+
+#include "fcntl.h"
+#include "pthread.h"
+#include "sys/stat.h"
+#include "unistd.h"
+
+#ifdef TFS_WITH_ZLIB
+#include "zlib.h"
+#endif
+#ifdef TFS_WITH_ZSTD
+#include "zstd.h"
+#endif
+
+#define TFS_Z_WINSIZE 32768
+#define TFS_Z_INBUF (64 << 10)
+/* unit of the decompressed cache */
+#define TFS_Z_BLOCK (256 << 10)
+#define TFS_Z_CURSORS 4
+
+#define TFS_ZIDX_MAGIC 0x7a736674u /* "tfsz" */
+#define TFS_ZIDX_VERSION 1
+
+static size_t tfs_z_span = 4 << 20;
+static size_t tfs_z_budget = 32 << 20;
+
+struct tfs_zpoint {
+	uint64_t in;
+	uint64_t out;
+	/* gzip: unused bits of the byte before in, window is NULL at a member start */
+	int bits;
+	unsigned char* window;
+};
+
+struct tfs_zcursor {
+	int busy;
+	int active;
+	uint64_t in;
+	uint64_t out;
+	/* gzip trailer bytes still to drop before the next member */
+	int skip;
+#ifdef TFS_WITH_ZLIB
+	z_stream zs;
+	int zs_init;
+	int raw;
+#endif
+#ifdef TFS_WITH_ZSTD
+	ZSTD_DCtx* zd;
+#endif
+	unsigned char* inbuf;
+	size_t avail_in;
+	const unsigned char* next_in;
+};
+
+struct tfs_zblock {
+	uint64_t start;
+	size_t len;
+	uint64_t used;
+	char* data;
+};
+
+struct tfs_zsrc {
+	int fd;
+	int kind;
+	uint64_t in_size;
+	uint64_t out_size;
+	struct tfs_zpoint* points;
+	uint32_t npoints;
+	uint32_t cap;
+
+	pthread_mutex_t lock;
+	struct tfs_zcursor cursors[TFS_Z_CURSORS];
+	struct tfs_zblock* blocks;
+	uint32_t nblocks;
+	uint64_t clock;
+};
+
+void tfs_zconfig(size_t span, size_t budget){
+	if(span) tfs_z_span = span;
+	if(budget) tfs_z_budget = budget;
+}
+
+int tfs_z_detect(int fd){
+	unsigned char magic[4];
+	if(pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) return TFS_Z_NONE;
+#ifdef TFS_WITH_ZLIB
+	if(magic[0] == 0x1f && magic[1] == 0x8b) return TFS_Z_GZIP;
+#endif
+#ifdef TFS_WITH_ZSTD
+	if(magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return TFS_Z_ZSTD;
+#endif
+	return TFS_Z_NONE;
+}
+
+uint64_t tfs_z_size(const struct tfs_zsrc* z){
+	return z->out_size;
+}
+
+static int tfs_z_addpoint(struct tfs_zsrc* z, uint64_t in, uint64_t out, int bits,
+	const unsigned char* window, size_t left){
+
+	if(z->npoints == z->cap){
+		uint32_t cap = z->cap? z->cap * 2: 64;
+		struct tfs_zpoint* points = realloc(z->points, cap * sizeof(*points));
+		if(!points) return -1;
+		z->points = points;
+		z->cap = cap;
+	}
+	struct tfs_zpoint* p = &z->points[z->npoints];
+	*p = (struct tfs_zpoint){ .in = in, .out = out, .bits = bits };
+	if(window){
+		/* window is circular, left bytes unwritten since the last wrap */
+		p->window = malloc(TFS_Z_WINSIZE);
+		if(!p->window) return -1;
+		if(left) memcpy(p->window, window + TFS_Z_WINSIZE - left, left);
+		if(left < TFS_Z_WINSIZE) memcpy(p->window + left, window, TFS_Z_WINSIZE - left);
+	}
+	++z->npoints;
+	return 0;
+}
+
+static ssize_t tfs_z_pread(int fd, void* buf, size_t len, uint64_t off){
+	for(;;){
+		ssize_t n = pread(fd, buf, len, off);
+		if(n < 0 && errno == EINTR) continue;
+		return n;
+	}
+}
+
+static void tfs_z_points_clear(struct tfs_zsrc* z){
+	for(uint32_t i = 0; i < z->npoints; ++i) free(z->points[i].window);
+	z->npoints = 0;
+}
+
+
+/* one pass over the whole input */
+
+#ifdef TFS_WITH_ZLIB
+static int tfs_z_build_gzip(struct tfs_zsrc* z){
+	unsigned char* in = malloc(TFS_Z_INBUF);
+	unsigned char* window = malloc(TFS_Z_WINSIZE);
+	z_stream zs = {};
+	int ret = Z_OK;
+	if(!in || !window || inflateInit2(&zs, 47) != Z_OK){
+		free(in);
+		free(window);
+		return -1;
+	}
+	uint64_t totin = 0, totout = 0, last = 0, pos = 0;
+	int res = tfs_z_addpoint(z, 0, 0, 0, NULL, 0);
+	zs.avail_out = 0;
+	while(res == 0){
+		if(zs.avail_in == 0){
+			ssize_t n = tfs_z_pread(z->fd, in, TFS_Z_INBUF, pos);
+			if(n < 0){
+				res = -1;
+				break;
+			}
+			if(n == 0) break;
+			pos += n;
+			zs.avail_in = n;
+			zs.next_in = in;
+		}
+		if(zs.avail_out == 0){
+			zs.avail_out = TFS_Z_WINSIZE;
+			zs.next_out = window;
+		}
+		totin += zs.avail_in;
+		totout += zs.avail_out;
+		ret = inflate(&zs, Z_BLOCK);
+		totin -= zs.avail_in;
+		totout -= zs.avail_out;
+		if(ret == Z_STREAM_END){
+			/* concatenated members, stop at anything that is not one */
+			if(zs.avail_in == 0){
+				ssize_t n = tfs_z_pread(z->fd, in, TFS_Z_INBUF, pos);
+				if(n <= 0) break;
+				pos += n;
+				zs.avail_in = n;
+				zs.next_in = in;
+			}
+			if(zs.next_in[0] != 0x1f) break;
+			inflateReset(&zs);
+			if(totout - last > tfs_z_span){
+				res = tfs_z_addpoint(z, totin, totout, 0, NULL, 0);
+				last = totout;
+			}
+			continue;
+		}
+		if(ret != Z_OK && ret != Z_BUF_ERROR){
+			res = -1;
+			break;
+		}
+		/* at the end of a block that is not the last one */
+		if((zs.data_type & 128) && !(zs.data_type & 64) && totout - last > tfs_z_span){
+			res = tfs_z_addpoint(z, totin, totout, zs.data_type & 7, window, zs.avail_out);
+			last = totout;
+		}
+	}
+	inflateEnd(&zs);
+	free(in);
+	free(window);
+	z->out_size = totout;
+	return res;
+}
+#endif
+
+#ifdef TFS_WITH_ZSTD
+static int tfs_z_build_zstd(struct tfs_zsrc* z){
+	size_t out_len = ZSTD_DStreamOutSize();
+	unsigned char* in = malloc(TFS_Z_INBUF);
+	unsigned char* out = malloc(out_len);
+	ZSTD_DCtx* zd = ZSTD_createDCtx();
+	int res = tfs_z_addpoint(z, 0, 0, 0, NULL, 0);
+	if(!in || !out || !zd) res = -1;
+	uint64_t pos = 0, totout = 0, last = 0;
+	while(res == 0){
+		ssize_t n = tfs_z_pread(z->fd, in, TFS_Z_INBUF, pos);
+		if(n < 0) res = -1;
+		if(n <= 0) break;
+		ZSTD_inBuffer zin = { in, n, 0 };
+		while(zin.pos < zin.size){
+			ZSTD_outBuffer zout = { out, out_len, 0 };
+			size_t ret = ZSTD_decompressStream(zd, &zout, &zin);
+			if(ZSTD_isError(ret)){
+				res = -1;
+				break;
+			}
+			totout += zout.pos;
+			/* a frame ended: the next one decodes on its own */
+			if(ret == 0 && totout - last > tfs_z_span){
+				res = tfs_z_addpoint(z, pos + zin.pos, totout, 0, NULL, 0);
+				last = totout;
+			}
+		}
+		pos += n;
+	}
+	ZSTD_freeDCtx(zd);
+	free(in);
+	free(out);
+	z->out_size = totout;
+	return res;
+}
+
+#define TFS_ZSTD_SKIPPABLE 0x184d2a5eu
+#define TFS_ZSTD_SEEKABLE 0x8f92eab1u
+
+static uint32_t tfs_le32(const unsigned char* p){
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/*
+	the seek table a seekable archive ends in: a skippable frame of one
+	compressed and decompressed size per frame, then a 9 byte footer
+*/
+static int tfs_z_seektable_zstd(struct tfs_zsrc* z){
+	unsigned char foot[9], head[8];
+	if(z->in_size < 17 || tfs_z_pread(z->fd, foot, sizeof(foot), z->in_size - 9) != sizeof(foot)
+		|| tfs_le32(foot + 5) != TFS_ZSTD_SEEKABLE || foot[4] & 0x7c)
+		return -1;
+	uint32_t frames = tfs_le32(foot);
+	size_t entry = foot[4] & 0x80? 12: 8;
+	uint64_t len = (uint64_t) frames * entry;
+	if(!frames || len > z->in_size - 17) return -1;
+	uint64_t table = z->in_size - 9 - len - 8;
+	if(tfs_z_pread(z->fd, head, sizeof(head), table) != sizeof(head)
+		|| tfs_le32(head) != TFS_ZSTD_SKIPPABLE || tfs_le32(head + 4) != len + 9)
+		return -1;
+	unsigned char* entries = malloc(len);
+	int res = entries && tfs_z_pread(z->fd, entries, len, table + 8) == (ssize_t) len? 0: -1;
+	uint64_t in = 0, out = 0, last = 0;
+	if(res == 0) res = tfs_z_addpoint(z, 0, 0, 0, NULL, 0);
+	for(uint32_t i = 0; res == 0 && i < frames; ++i){
+		if(out - last > tfs_z_span){
+			res = tfs_z_addpoint(z, in, out, 0, NULL, 0);
+			last = out;
+		}
+		in += tfs_le32(entries + i * entry);
+		out += tfs_le32(entries + i * entry + 4);
+	}
+	free(entries);
+	/* the frames have to add up to where the table starts */
+	if(res != 0 || in != table) return -1;
+	z->out_size = out;
+	return 0;
+}
+#endif
+
+
+/* cursors */
+
+static void tfs_z_cursor_end(struct tfs_zcursor* c){
+#ifdef TFS_WITH_ZLIB
+	if(c->zs_init) inflateEnd(&c->zs);
+	c->zs_init = 0;
+#endif
+#ifdef TFS_WITH_ZSTD
+	ZSTD_freeDCtx(c->zd);
+	c->zd = NULL;
+#endif
+	free(c->inbuf);
+	c->inbuf = NULL;
+	c->active = 0;
+}
+
+static int tfs_z_cursor_start(struct tfs_zsrc* z, struct tfs_zcursor* c, const struct tfs_zpoint* p){
+	if(!c->inbuf && !(c->inbuf = malloc(TFS_Z_INBUF))) return -1;
+	c->active = 0;
+	c->in = p->in;
+	c->out = p->out;
+	c->skip = 0;
+	c->avail_in = 0;
+#ifdef TFS_WITH_ZLIB
+	if(z->kind == TFS_Z_GZIP){
+		if(c->zs_init) inflateEnd(&c->zs);
+		memset(&c->zs, 0, sizeof(c->zs));
+		c->raw = p->window != NULL;
+		if(inflateInit2(&c->zs, c->raw? -15: 47) != Z_OK) return -1;
+		c->zs_init = 1;
+		if(c->raw){
+			if(p->bits){
+				unsigned char byte;
+				if(tfs_z_pread(z->fd, &byte, 1, p->in - 1) != 1) return -1;
+				inflatePrime(&c->zs, p->bits, byte >> (8 - p->bits));
+			}
+			inflateSetDictionary(&c->zs, p->window, TFS_Z_WINSIZE);
+		}
+	}
+#endif
+#ifdef TFS_WITH_ZSTD
+	if(z->kind == TFS_Z_ZSTD){
+		if(!c->zd && !(c->zd = ZSTD_createDCtx())) return -1;
+		ZSTD_DCtx_reset(c->zd, ZSTD_reset_session_only);
+	}
+#endif
+#if !defined(TFS_WITH_ZLIB) && !defined(TFS_WITH_ZSTD)
+	(void) z;
+#endif
+	c->active = 1;
+	return 0;
+}
+
+static int tfs_z_cursor_fill(struct tfs_zsrc* z, struct tfs_zcursor* c){
+	while(c->avail_in <= (size_t) c->skip){
+		c->skip -= c->avail_in;
+		ssize_t n = tfs_z_pread(z->fd, c->inbuf, TFS_Z_INBUF, c->in);
+		if(n <= 0) return -1;
+		c->in += n;
+		c->avail_in = n;
+		c->next_in = c->inbuf;
+	}
+	c->next_in += c->skip;
+	c->avail_in -= c->skip;
+	c->skip = 0;
+	return 0;
+}
+
+/* decode exactly len bytes at the cursor, fewer only at the end of the input */
+static ssize_t tfs_z_cursor_read(struct tfs_zsrc* z, struct tfs_zcursor* c, char* out, size_t len){
+	size_t done = 0;
+	while(done < len){
+		if(c->avail_in == 0 || c->skip){
+			if(tfs_z_cursor_fill(z, c) != 0) break;
+		}
+#ifdef TFS_WITH_ZLIB
+		if(z->kind == TFS_Z_GZIP){
+			c->zs.next_in = (unsigned char*) c->next_in;
+			c->zs.avail_in = c->avail_in;
+			c->zs.next_out = (unsigned char*) out + done;
+			c->zs.avail_out = len - done;
+			int ret = inflate(&c->zs, Z_NO_FLUSH);
+			done = len - c->zs.avail_out;
+			c->next_in = c->zs.next_in;
+			c->avail_in = c->zs.avail_in;
+			if(ret == Z_STREAM_END){
+				/* a raw stream leaves the gzip trailer for us */
+				if(c->raw) c->skip = 8;
+				c->raw = 0;
+				if(inflateReset2(&c->zs, 47) != Z_OK) return -1;
+			}else if(ret != Z_OK && ret != Z_BUF_ERROR){
+				c->active = 0;
+				return -1;
+			}
+		}
+#endif
+#ifdef TFS_WITH_ZSTD
+		if(z->kind == TFS_Z_ZSTD){
+			ZSTD_inBuffer zin = { c->next_in, c->avail_in, 0 };
+			ZSTD_outBuffer zout = { out + done, len - done, 0 };
+			size_t ret = ZSTD_decompressStream(c->zd, &zout, &zin);
+			if(ZSTD_isError(ret)){
+				c->active = 0;
+				return -1;
+			}
+			done += zout.pos;
+			c->next_in += zin.pos;
+			c->avail_in -= zin.pos;
+		}
+#endif
+	}
+#if !defined(TFS_WITH_ZLIB) && !defined(TFS_WITH_ZSTD)
+	(void) out;
+#endif
+	c->out += done;
+	return done;
+}
+
+
+/* cache */
+
+static struct tfs_zblock* tfs_z_block_find(struct tfs_zsrc* z, uint64_t start){
+	for(uint32_t i = 0; i < z->nblocks; ++i){
+		if(z->blocks[i].data && z->blocks[i].start == start) return &z->blocks[i];
+	}
+	return NULL;
+}
+
+static struct tfs_zblock* tfs_z_block_victim(struct tfs_zsrc* z){
+	struct tfs_zblock* victim = &z->blocks[0];
+	for(uint32_t i = 0; i < z->nblocks; ++i){
+		if(!z->blocks[i].data) return &z->blocks[i];
+		if(z->blocks[i].used < victim->used) victim = &z->blocks[i];
+	}
+	return victim;
+}
+
+/*
+	a free cursor already parked between the checkpoint and start, else an
+	idle one, else the one parked furthest back
+*/
+static struct tfs_zcursor* tfs_z_cursor_pick(struct tfs_zsrc* z, const struct tfs_zpoint* p, uint64_t start){
+	struct tfs_zcursor* best = NULL;
+	int best_rank = 0;
+	for(int i = 0; i < TFS_Z_CURSORS; ++i){
+		struct tfs_zcursor* c = &z->cursors[i];
+		if(c->busy) continue;
+		int rank = !c->active? 2: (c->out >= p->out && c->out <= start)? 3: 1;
+		if(rank > best_rank || (rank == best_rank && rank != 2 && c->out > best->out)){
+			best = c;
+			best_rank = rank;
+		}
+	}
+	if(best) best->busy = 1;
+	return best;
+}
+
+static int tfs_z_decode(struct tfs_zsrc* z, uint64_t start, char* buf, size_t len){
+	/* last checkpoint at or before start */
+	uint32_t lo = 0, hi = z->npoints;
+	while(hi - lo > 1){
+		uint32_t mid = (lo + hi) / 2;
+		if(z->points[mid].out <= start) lo = mid;
+		else hi = mid;
+	}
+	const struct tfs_zpoint* p = &z->points[lo];
+
+	pthread_mutex_lock(&z->lock);
+	struct tfs_zcursor* c = tfs_z_cursor_pick(z, p, start);
+	pthread_mutex_unlock(&z->lock);
+	struct tfs_zcursor spare = {};
+	if(!c) c = &spare;
+
+	int res = 0;
+	if(!c->active || c->out < p->out || c->out > start) res = tfs_z_cursor_start(z, c, p);
+	/* decode up to start into buf, which is overwritten afterwards anyway */
+	while(res == 0 && c->out < start){
+		size_t n = start - c->out < len? start - c->out: len;
+		if(tfs_z_cursor_read(z, c, buf, n) != (ssize_t) n) res = -1;
+	}
+	if(res == 0 && tfs_z_cursor_read(z, c, buf, len) != (ssize_t) len) res = -1;
+	if(res != 0) c->active = 0;
+
+	if(c == &spare) tfs_z_cursor_end(c);
+	else{
+		pthread_mutex_lock(&z->lock);
+		c->busy = 0;
+		pthread_mutex_unlock(&z->lock);
+	}
+	return res;
+}
+
+ssize_t tfs_z_read(struct tfs_zsrc* z, void* _buf, size_t len, uint64_t off){
+	char* buf = _buf;
+	if(off >= z->out_size) return 0;
+	if(len > z->out_size - off) len = z->out_size - off;
+	size_t done = 0;
+	while(done < len){
+		uint64_t pos = off + done;
+		uint64_t start = pos - pos % TFS_Z_BLOCK;
+		size_t block_len = z->out_size - start < TFS_Z_BLOCK? z->out_size - start: TFS_Z_BLOCK;
+		size_t n = start + block_len - pos;
+		if(n > len - done) n = len - done;
+
+		pthread_mutex_lock(&z->lock);
+		struct tfs_zblock* block = tfs_z_block_find(z, start);
+		if(block){
+			block->used = ++z->clock;
+			memcpy(buf + done, block->data + (pos - start), n);
+			pthread_mutex_unlock(&z->lock);
+			done += n;
+			continue;
+		}
+		pthread_mutex_unlock(&z->lock);
+
+		char* data = malloc(block_len);
+		if(!data || tfs_z_decode(z, start, data, block_len) != 0){
+			free(data);
+			TFS_SETERRNO(EIO);
+			return done? (ssize_t) done: -1;
+		}
+		memcpy(buf + done, data + (pos - start), n);
+		done += n;
+
+		pthread_mutex_lock(&z->lock);
+		if(!tfs_z_block_find(z, start)){
+			block = tfs_z_block_victim(z);
+			free(block->data);
+			*block = (struct tfs_zblock){ start, block_len, ++z->clock, data };
+			data = NULL;
+		}
+		pthread_mutex_unlock(&z->lock);
+		free(data);
+	}
+	return done;
+}
+
+
+/* checkpoint file */
+
+struct tfs_zidx_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t kind;
+	uint32_t npoints;
+	uint64_t in_size;
+	int64_t mtime_ns;
+	uint64_t out_size;
+};
+
+struct tfs_zidx_point {
+	uint64_t in;
+	uint64_t out;
+	uint32_t bits;
+	uint32_t has_window;
+};
+
+static int tfs_z_write_all(int fd, const void* data, size_t len){
+	while(len > 0){
+		ssize_t n = write(fd, data, len);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) return -1;
+		data = (const char*) data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+int tfs_z_save(const struct tfs_zsrc* z, const char* pathname, int64_t mtime_ns){
+	char tmp[TFS_PATH_MAX];
+	if(snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", pathname, (long) getpid()) >= (int) sizeof(tmp)){
+		TFS_SETERRNO(ENAMETOOLONG);
+		return -1;
+	}
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0) return -1;
+	struct tfs_zidx_header header = {
+		TFS_ZIDX_MAGIC, TFS_ZIDX_VERSION, z->kind, z->npoints, z->in_size, mtime_ns, z->out_size
+	};
+	int res = tfs_z_write_all(fd, &header, sizeof(header));
+	for(uint32_t i = 0; res == 0 && i < z->npoints; ++i){
+		const struct tfs_zpoint* p = &z->points[i];
+		struct tfs_zidx_point rec = { p->in, p->out, p->bits, p->window != NULL };
+		res = tfs_z_write_all(fd, &rec, sizeof(rec));
+		if(res == 0 && p->window) res = tfs_z_write_all(fd, p->window, TFS_Z_WINSIZE);
+	}
+	if(close(fd) != 0) res = -1;
+	if(res == 0 && rename(tmp, pathname) != 0) res = -1;
+	if(res != 0) unlink(tmp);
+	return res;
+}
+
+static int tfs_z_load(struct tfs_zsrc* z, const char* pathname, int64_t mtime_ns){
+	FILE* fp = fopen(pathname, "rb");
+	if(!fp) return -1;
+	struct tfs_zidx_header header;
+	int res = -1;
+	if(fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TFS_ZIDX_MAGIC
+		|| header.version != TFS_ZIDX_VERSION || (int) header.kind != z->kind
+		|| header.in_size != z->in_size || header.mtime_ns != mtime_ns || !header.npoints)
+		goto out;
+	for(uint32_t i = 0; i < header.npoints; ++i){
+		struct tfs_zidx_point rec;
+		unsigned char window[TFS_Z_WINSIZE];
+		if(fread(&rec, sizeof(rec), 1, fp) != 1 || rec.bits > 7
+			|| (rec.has_window && fread(window, sizeof(window), 1, fp) != 1))
+			goto out;
+		/* lookups bisect the points: from the start, strictly rising and inside both streams */
+		const struct tfs_zpoint* prev = i? &z->points[i - 1]: NULL;
+		if(prev? rec.in <= prev->in || rec.out <= prev->out: rec.in || rec.out || rec.has_window) goto out;
+		if(rec.in > header.in_size || rec.out > header.out_size) goto out;
+		if(tfs_z_addpoint(z, rec.in, rec.out, rec.bits, rec.has_window? window: NULL, 0) != 0) goto out;
+	}
+	z->out_size = header.out_size;
+	res = 0;
+out:
+	fclose(fp);
+	return res;
+}
+
+
+struct tfs_zsrc* tfs_z_open(int fd, int kind, uint64_t in_size, int64_t mtime_ns, const char* zindexpath){
+	struct tfs_zsrc* z = calloc(1, sizeof(*z));
+	if(!z) return NULL;
+	z->fd = fd;
+	z->kind = kind;
+	z->in_size = in_size;
+	pthread_mutex_init(&z->lock, NULL);
+	z->nblocks = tfs_z_budget / TFS_Z_BLOCK;
+	if(z->nblocks < 2) z->nblocks = 2;
+	z->blocks = calloc(z->nblocks, sizeof(*z->blocks));
+	if(!z->blocks){
+		tfs_z_close(z);
+		return NULL;
+	}
+
+	if(zindexpath && tfs_z_load(z, zindexpath, mtime_ns) == 0) return z;
+	tfs_z_points_clear(z);
+#ifdef TFS_WITH_ZSTD
+	if(kind == TFS_Z_ZSTD && tfs_z_seektable_zstd(z) == 0) return z;
+	tfs_z_points_clear(z);
+#endif
+
+	int res = -1;
+#ifdef TFS_WITH_ZLIB
+	if(kind == TFS_Z_GZIP) res = tfs_z_build_gzip(z);
+#endif
+#ifdef TFS_WITH_ZSTD
+	if(kind == TFS_Z_ZSTD) res = tfs_z_build_zstd(z);
+#endif
+	if(res != 0){
+		tfs_z_close(z);
+		TFS_SETERRNO(EINVAL);
+		return NULL;
+	}
+	return z;
+}
+
+void tfs_z_close(struct tfs_zsrc* z){
+	if(!z) return;
+	for(int i = 0; i < TFS_Z_CURSORS; ++i) tfs_z_cursor_end(&z->cursors[i]);
+	for(uint32_t i = 0; i < z->nblocks; ++i) free(z->blocks[i].data);
+	for(uint32_t i = 0; i < z->npoints; ++i) free(z->points[i].window);
+	free(z->blocks);
+	free(z->points);
+	pthread_mutex_destroy(&z->lock);
+	free(z);
+}